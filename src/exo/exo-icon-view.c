@@ -493,6 +493,12 @@ struct _ExoIconViewPrivate
 
   GList *items;
 
+  /* the most recently inserted item and its index, used to speed
+   * up consecutive row insertions (see exo_icon_view_row_inserted).
+   */
+  GList *insert_hint;
+  gint   insert_hint_index;
+
   GtkAdjustment *hadjustment;
   GtkAdjustment *vadjustment;
 
@@ -3883,8 +3889,12 @@ exo_icon_view_row_inserted (GtkTreeModel *model,
                             GtkTreeIter  *iter,
                             ExoIconView  *icon_view)
 {
-  ExoIconViewItem *item;
-  gint             index;
+  ExoIconViewPrivate *priv = icon_view->priv;
+  ExoIconViewItem    *item;
+  GList              *prev;
+  GList              *node;
+  gint                index;
+  gint                n;
 
   index = gtk_tree_path_get_indices (path)[0];
 
@@ -3892,7 +3902,43 @@ exo_icon_view_row_inserted (GtkTreeModel *model,
   item = _exo_slice_new0 (ExoIconViewItem);
   item->iter = *iter;
   item->area.width = -1;
-  icon_view->priv->items = g_list_insert (icon_view->priv->items, item, index);
+
+  if (G_UNLIKELY (index == 0 || priv->items == NULL))
+    {
+      priv->items = g_list_prepend (priv->items, item);
+      node = priv->items;
+    }
+  else
+    {
+      /* rows are usually inserted in ascending order (i.e. while a folder
+       * is being loaded), so start looking for the position at the last
+       * inserted item rather than at the beginning of the list.
+       */
+      if (priv->insert_hint != NULL && priv->insert_hint_index < index)
+        {
+          prev = priv->insert_hint;
+          n = priv->insert_hint_index;
+        }
+      else
+        {
+          prev = priv->items;
+          n = 0;
+        }
+      for (; n < index - 1 && prev->next != NULL; ++n)
+        prev = prev->next;
+
+      /* link the new item after prev */
+      node = g_list_alloc ();
+      node->data = item;
+      node->prev = prev;
+      node->next = prev->next;
+      if (prev->next != NULL)
+        prev->next->prev = node;
+      prev->next = node;
+    }
+
+  priv->insert_hint = node;
+  priv->insert_hint_index = index;
 
   /* recalculate the layout */
   exo_icon_view_queue_layout (icon_view);
@@ -3947,6 +3993,7 @@ exo_icon_view_row_deleted (GtkTreeModel *model,
 
   /* drop the item from the list */
   icon_view->priv->items = g_list_delete_link (icon_view->priv->items, list);
+  icon_view->priv->insert_hint = NULL;
 
   /* release the item */
   _exo_slice_free (ExoIconViewItem, item);
@@ -4007,6 +4054,9 @@ exo_icon_view_rows_reordered (GtkTreeModel *model,
   /* hook up the last item */
   list_array[length - 1]->next = NULL;
 
+  /* the index of the last inserted item is no longer valid */
+  icon_view->priv->insert_hint = NULL;
+
   exo_icon_view_queue_layout (icon_view);
 }
 
@@ -5280,6 +5330,7 @@ exo_icon_view_set_model (ExoIconView  *icon_view,
         }
       g_list_free (icon_view->priv->items);
       icon_view->priv->items = NULL;
+      icon_view->priv->insert_hint = NULL;
 
       /* reset statistics */
       icon_view->priv->search_column = -1;
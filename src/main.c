@@ -408,6 +408,8 @@ void init_folder()
 
     vfs_volume_init();
     vfs_thumbnail_init();
+    vfs_thumbnail_set_max_threads( app_settings.thumbnail_threads );
+    vfs_thumbnail_cache_set_max_size( (gsize)app_settings.thumbnail_cache_size << 10 );
 
     vfs_mime_type_set_icon_size( app_settings.big_icon_size,
                                  app_settings.small_icon_size );
@@ -770,7 +772,12 @@ void open_file( const char* path )
         {
             app = vfs_app_desktop_new( app_name );
             if ( ! vfs_app_desktop_get_exec( app ) )
-                app->exec = g_strdup( app_name ); /* This is a command line */
+            {
+                /* This is a command line. The cached desktop entry is shared, so use an empty one. */
+                vfs_app_desktop_unref( app );
+                app = vfs_app_desktop_new( NULL );
+                app->exec = g_strdup( app_name );
+            }
             files = g_list_prepend( NULL, (gpointer) path );
             opened = vfs_app_desktop_open_files( gdk_screen_get_default(),
                                                  NULL, app, files, &err );
@@ -49,26 +49,177 @@ gboolean save_to_file( const char* path, const char* data, gssize len )
 const char group_desktop[] = "Desktop Entry";
 const char key_mime_type[] = "MimeType";
 
-typedef char* (*DataDirFunc)    ( const char* dir, const char* mime_type, gpointer user_data );
+/*
+ * mimeinfo.cache and defaults.list in all data dirs are parsed only once,
+ * and so are the desktop files. They are thrown away by
+ * mime_type_reload_actions() when any of them is changed.
+ */
+typedef struct _AppDir
+{
+    char* dir;  /* data dir */
+    GHashTable* mime_cache;  /* mime-type => desktop ids in mimeinfo.cache */
+    GHashTable* defaults;  /* mime-type => default desktop id in defaults.list */
+    GHashTable* located;  /* desktop id => path of the desktop file, or "" if it's not in this dir */
+}AppDir;
 
-static char* data_dir_foreach( DataDirFunc func, const char* mime_type, gpointer user_data )
+typedef struct _DesktopEntry
+{
+    gboolean loaded;
+    char* exec;
+    char* name;
+    char** mime_types;
+}DesktopEntry;
+
+/* user data dir first, and then system data dirs */
+static AppDir* app_dirs = NULL;
+static int n_app_dirs = 0;
+static GHashTable* desktop_entries = NULL;  /* path of desktop file => DesktopEntry */
+G_LOCK_DEFINE_STATIC(actions);
+
+static char* _locate_desktop_file( const char* dir, const char* desktop_id );
+
+static GHashTable* load_key_file_group( const char* dir, const char* file_name,
+                                        const char* group, gboolean is_list )
+{
+    GKeyFile* file;
+    GHashTable* hash;
+    char* path = g_build_filename( dir, "applications", file_name, NULL );
+    char** keys;
+    gsize n_keys = 0, i;
+
+    hash = g_hash_table_new_full( g_str_hash, g_str_equal, g_free,
+                                  is_list ? (GDestroyNotify)g_strfreev : g_free );
+    file = g_key_file_new();
+    if( g_key_file_load_from_file( file, path, 0, NULL ) &&
+        (keys = g_key_file_get_keys( file, group, &n_keys, NULL )) )
+    {
+        for( i = 0; i < n_keys; ++i )
+        {
+            gpointer val;
+            if( is_list )
+                val = g_key_file_get_string_list( file, group, keys[i], NULL, NULL );
+            else
+                val = g_key_file_get_string( file, group, keys[i], NULL );
+            if( val )
+            {
+                g_hash_table_insert( hash, keys[i], val );
+                keys[i] = NULL; /* steal the string */
+            }
+        }
+        g_strfreev( keys );  /* the stolen strings are skipped, since it stops at the first NULL */
+    }
+    g_key_file_free( file );
+    g_free( path );
+    return hash;
+}
+
+static void app_dir_load( AppDir* app_dir, const char* dir )
+{
+    app_dir->dir = g_strdup( dir );
+    app_dir->mime_cache = load_key_file_group( dir, "mimeinfo.cache", "MIME Cache", TRUE );
+    app_dir->defaults = load_key_file_group( dir, "defaults.list", "Default Applications", FALSE );
+    app_dir->located = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+}
+
+static void desktop_entry_free( DesktopEntry* entry )
+{
+    g_free( entry->exec );
+    g_free( entry->name );
+    g_strfreev( entry->mime_types );
+    g_slice_free( DesktopEntry, entry );
+}
+
+/* Should be called with actions locked */
+static void load_app_dirs()
 {
-    char* ret = NULL;
     const gchar* const * dirs;
-    const char* dir = g_get_user_data_dir();
+    int i;
 
-    if( (ret = func( dir, mime_type, user_data )) )
-        return ret;
+    if( G_LIKELY( app_dirs ) )
+        return;
 
     dirs = g_get_system_data_dirs();
-    for( ; *dirs; ++dirs )
+    n_app_dirs = g_strv_length( (char**)dirs ) + 1;
+    app_dirs = g_new0( AppDir, n_app_dirs );
+    app_dir_load( &app_dirs[0], g_get_user_data_dir() );
+    for( i = 1; i < n_app_dirs; ++i )
+        app_dir_load( &app_dirs[i], dirs[i - 1] );
+
+    desktop_entries = g_hash_table_new_full( g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)desktop_entry_free );
+}
+
+void mime_type_reload_actions()
+{
+    int i;
+
+    G_LOCK( actions );
+    for( i = 0; i < n_app_dirs; ++i )
+    {
+        g_free( app_dirs[i].dir );
+        g_hash_table_destroy( app_dirs[i].mime_cache );
+        g_hash_table_destroy( app_dirs[i].defaults );
+        g_hash_table_destroy( app_dirs[i].located );
+    }
+    g_free( app_dirs );
+    app_dirs = NULL;
+    n_app_dirs = 0;
+    if( desktop_entries )
+    {
+        g_hash_table_destroy( desktop_entries );
+        desktop_entries = NULL;
+    }
+    G_UNLOCK( actions );
+}
+
+/* Returns the path of the desktop file if it's in the dir. Should be called with actions locked */
+static const char* app_dir_locate( AppDir* app_dir, const char* desktop_id )
+{
+    char* path = (char*)g_hash_table_lookup( app_dir->located, desktop_id );
+    if( ! path )
     {
-        if( (ret = func( *dirs, mime_type, user_data )) )
-            return ret;
+        path = _locate_desktop_file( app_dir->dir, desktop_id );
+        if( ! path )
+            path = g_strdup( "" );
+        g_hash_table_insert( app_dir->located, g_strdup( desktop_id ), path );
+    }
+    return *path ? path : NULL;
+}
+
+/* Should be called with actions locked */
+static const char* locate_desktop_file( const char* desktop_id )
+{
+    int i;
+    const char* path;
+    for( i = 0; i < n_app_dirs; ++i )
+    {
+        if( (path = app_dir_locate( &app_dirs[i], desktop_id )) )
+            return path;
     }
     return NULL;
 }
 
+/* Should be called with actions locked */
+static DesktopEntry* get_desktop_entry( const char* path )
+{
+    DesktopEntry* entry = (DesktopEntry*)g_hash_table_lookup( desktop_entries, path );
+    if( ! entry )
+    {
+        GKeyFile* kf = g_key_file_new();
+        entry = g_slice_new0( DesktopEntry );
+        if( g_key_file_load_from_file( kf, path, 0, NULL ) )
+        {
+            entry->loaded = TRUE;
+            entry->mime_types = g_key_file_get_string_list( kf, group_desktop, key_mime_type, NULL, NULL );
+            entry->exec = g_key_file_get_string( kf, group_desktop, "Exec", NULL );
+            entry->name = g_key_file_get_string( kf, group_desktop, "Name", NULL );
+        }
+        g_key_file_free( kf );
+        g_hash_table_insert( desktop_entries, g_strdup( path ), entry );
+    }
+    return entry;
+}
+
 static void update_desktop_database()
 {
     char* argv[3];
@@ -96,63 +247,56 @@ static int strv_index( char** strv, const char* str )
     return -1;
 }
 
-static char* get_actions( const char* dir, const char* type, GArray* actions )
+/* Should be called with actions locked */
+static void get_actions( AppDir* app_dir, const char* type, GArray* actions )
 {
-    GKeyFile* file;
-    gboolean opened;
-    char** apps = NULL;
-    char* path = g_build_filename( dir, "applications/mimeinfo.cache", NULL );
-    file = g_key_file_new();
-    opened = g_key_file_load_from_file( file, path, 0, NULL );
-    g_free( path );
-    if( G_LIKELY( opened ) )
+    char** apps = (char**)g_hash_table_lookup( app_dir->mime_cache, type );
+    char* app;
+
+    for( ; apps && *apps; ++apps )
     {
-        gsize n_apps = 0, i;
-        apps = g_key_file_get_string_list( file, "MIME Cache", type, &n_apps, NULL );
-        for( i = 0; i < n_apps; ++i )
+        /* check for existence */
+        if( -1 == strv_index( (char**)actions->data, *apps )
+            && app_dir_locate( app_dir, *apps ) )
         {
-            if( -1 == strv_index( (char**)actions->data, apps[i] ) )
-            {
-                /* check for existence */
-                path = mime_type_locate_desktop_file( dir, apps[i] );
-                if( G_LIKELY(path) )
-                {
-                    g_array_append_val( actions, apps[i] );
-                    g_free( path );
-                }
-                else
-                    g_free( apps[i] );
-                apps[i] = NULL; /* steal the string */
-            }
-            else
-            {
-                g_free( apps[i] );
-                apps[i] = NULL;
-            }
+            app = g_strdup( *apps );
+            g_array_append_val( actions, app );
         }
-        g_free( apps ); /* don't call g_strfreev since all strings in the array was stolen. */
     }
-    g_key_file_free( file );
-    return NULL;    /* return NULL so the for_each operation doesn't stop. */
 }
 
-/*
- *  Get a list of applications supporting this mime-type
- * The returned string array was newly allocated, and should be
- * freed with g_strfreev() when no longer used.
- */
-char** mime_type_get_actions( const char* type )
+/* Should be called with actions locked */
+static char* get_default_action( const char* type )
+{
+    int i;
+    const char* action;
+
+    /* FIXME: need to check parent types if default action of current type is not set. */
+    for( i = 0; i < n_app_dirs; ++i )
+    {
+        action = (const char*)g_hash_table_lookup( app_dirs[i].defaults, type );
+        /* check for existence */
+        if( action && locate_desktop_file( action ) )
+            return g_strdup( action );
+    }
+    return NULL;
+}
+
+/* Should be called with actions locked */
+static char** _mime_type_get_actions( const char* type )
 {
     GArray* actions = g_array_sized_new( TRUE, FALSE, sizeof(char*), 10 );
     char* default_app = NULL;
+    int i;
 
     /* FIXME: actions of parent types should be added, too. */
 
     /* get all actions for this file type */
-    data_dir_foreach( (DataDirFunc)get_actions, type, actions );
+    for( i = 0; i < n_app_dirs; ++i )
+        get_actions( &app_dirs[i], type, actions );
 
     /* ensure default app is in the list */
-    if( G_LIKELY( ( default_app = mime_type_get_default_action( type ) ) ) )
+    if( G_LIKELY( ( default_app = get_default_action( type ) ) ) )
     {
         int i = strv_index( (char**)actions->data, default_app );
         if( i == -1 )   /* default app is not in the list, add it! */
@@ -174,48 +318,62 @@ char** mime_type_get_actions( const char* type )
     return (char**)g_array_free( actions, actions->len == 0 );
 }
 
+/*
+ *  Get a list of applications supporting this mime-type
+ * The returned string array was newly allocated, and should be
+ * freed with g_strfreev() when no longer used.
+ */
+char** mime_type_get_actions( const char* type )
+{
+    char** actions;
+
+    G_LOCK( actions );
+    load_app_dirs();
+    actions = _mime_type_get_actions( type );
+    G_UNLOCK( actions );
+    return actions;
+}
+
 /*
  * NOTE:
  * This API is very time consuming, but unfortunately, due to the damn poor design of
  * Freedesktop.org spec, all the insane checks here are necessary.  Sigh...  :-(
+ * The parsed desktop files are cached, so it's not that slow now.
  */
 gboolean mime_type_has_action( const char* type, const char* desktop_id )
 {
     char** actions, **action;
-    char *cmd = NULL, *name = NULL;
+    const char *cmd = NULL, *name = NULL, *filename;
     gboolean found = FALSE;
     gboolean is_desktop = g_str_has_suffix( desktop_id, ".desktop" );
+    DesktopEntry* entry;
+
+    G_LOCK( actions );
+    load_app_dirs();
 
     if( is_desktop )
     {
-        char** types;
-        GKeyFile* kf = g_key_file_new();
-        char* filename = mime_type_locate_desktop_file( NULL, desktop_id );
-        if( filename && g_key_file_load_from_file( kf, filename, 0, NULL ) )
+        filename = locate_desktop_file( desktop_id );
+        if( filename && (entry = get_desktop_entry( filename ))->loaded )
         {
-            types = g_key_file_get_string_list( kf, group_desktop, key_mime_type, NULL, NULL );
-            if( -1 != strv_index( types, type ) )
+            if( -1 != strv_index( entry->mime_types, type ) )
             {
                 /* our mime-type is already found in the desktop file. no further check is needed */
                 found = TRUE;
             }
-            g_strfreev( types );
-
-            if( ! found )   /* get the content of desktop file for comparison */
+            else   /* get the content of desktop file for comparison */
             {
-                cmd = g_key_file_get_string( kf, group_desktop, "Exec", NULL );
-                name = g_key_file_get_string( kf, group_desktop, "Name", NULL );
+                cmd = entry->exec;
+                name = entry->name;
             }
         }
-        g_free( filename );
-        g_key_file_free( kf );
     }
     else
     {
-        cmd = (char*)desktop_id;
+        cmd = desktop_id;
     }
 
-    actions = mime_type_get_actions( type );
+    actions = found ? NULL : _mime_type_get_actions( type );
     if( actions )
     {
         for( action = actions; ! found && *action; ++action )
@@ -227,43 +385,30 @@ gboolean mime_type_has_action( const char* type, const char* desktop_id )
             }
             else /* Then, try to match by "Exec" and "Name" keys */
             {
-                char *name2 = NULL, *cmd2 = NULL, *filename = NULL;
-                GKeyFile* kf = g_key_file_new();
-                filename = mime_type_locate_desktop_file( NULL, *action );
-                if( filename && g_key_file_load_from_file( kf, filename, 0, NULL ) )
+                filename = locate_desktop_file( *action );
+                if( ! filename || ! (entry = get_desktop_entry( filename ))->loaded )
+                    continue;
+                if( cmd && entry->exec && 0 == strcmp( cmd, entry->exec ) )   /* 2 desktop files have same "Exec" */
                 {
-                    cmd2 = g_key_file_get_string( kf, group_desktop, "Exec", NULL );
-                    if( cmd && cmd2 && 0 == strcmp( cmd, cmd2 ) )   /* 2 desktop files have same "Exec" */
+                    if( is_desktop )
                     {
-                        if( is_desktop )
+                        /* Then, check if the "Name" keys of 2 desktop files are the same. */
+                        if( name && entry->name && 0 == strcmp( name, entry->name ) )
                         {
-                            name2 = g_key_file_get_string( kf, group_desktop, "Name", NULL );
-                            /* Then, check if the "Name" keys of 2 desktop files are the same. */
-                            if( name && name2 && 0 == strcmp( name, name2 ) )
-                            {
-                                /* Both "Exec" and "Name" keys of the 2 desktop files are
-                                 *  totally the same. So, despite having different desktop id
-                                 *  They actually refer to the same application. */
-                                found = TRUE;
-                            }
-                            g_free( name2 );
-                        }
-                        else
+                            /* Both "Exec" and "Name" keys of the 2 desktop files are
+                             *  totally the same. So, despite having different desktop id
+                             *  They actually refer to the same application. */
                             found = TRUE;
+                        }
                     }
+                    else
+                        found = TRUE;
                 }
-                g_free( filename );
-                g_free( cmd2 );
-                g_key_file_free( kf );
             }
         }
         g_strfreev( actions );
     }
-    if( is_desktop )
-    {
-        g_free( cmd );
-        g_free( name );
-    }
+    G_UNLOCK( actions );
     return found;
 }
 
@@ -361,6 +506,7 @@ static char* make_custom_desktop_file( const char* desktop_id, const char* mime_
 
         /* execute update-desktop-database" to update mimeinfo.cache */
         update_desktop_database();
+        mime_type_reload_actions();
     }
     return cust;
 }
@@ -388,13 +534,13 @@ void mime_type_add_action( const char* type, const char* desktop_id, char** cust
         g_free( cust );
 }
 
-static char* _locate_desktop_file( const char* dir, const char* unused, const gpointer desktop_id )
+char* _locate_desktop_file( const char* dir, const char* desktop_id )
 {
     char *path, *sep = NULL;
     gboolean found = FALSE;
 
-    path = g_build_filename( dir, "applications", (const char*)desktop_id, NULL );
-    sep = strchr( (const char*)desktop_id, '-' );
+    path = g_build_filename( dir, "applications", desktop_id, NULL );
+    sep = strchr( desktop_id, '-' );
     if( sep )
         sep = strrchr( path, '-' );
 
@@ -423,37 +569,27 @@ static char* _locate_desktop_file( const char* dir, const char* unused, const gp
 
 char* mime_type_locate_desktop_file( const char* dir, const char* desktop_id )
 {
-    if( dir )
-        return _locate_desktop_file( dir, NULL, (gpointer) desktop_id );
-    return data_dir_foreach( _locate_desktop_file, NULL, (gpointer) desktop_id );
-}
+    char* path = NULL;
+    int i;
 
-static char* get_default_action( const char* dir, const char* type, gpointer user_data )
-{
-    GKeyFile* file;
-    gboolean opened;
-    char* action = NULL;
-    char* path = g_build_filename( dir, "applications/defaults.list", NULL );
-    file = g_key_file_new();
-    opened = g_key_file_load_from_file( file, path, 0, NULL );
-    g_free( path );
-    if( G_LIKELY( opened ) )
-        action = g_key_file_get_string( file, "Default Applications", type, NULL );
-    g_key_file_free( file );
-
-    /* check for existence */
-    if( action )
+    G_LOCK( actions );
+    load_app_dirs();
+    if( dir )
     {
-        path = mime_type_locate_desktop_file( NULL, action );
-        if( G_LIKELY( path ) )
-            g_free( path );
-        else
+        for( i = 0; i < n_app_dirs; ++i )
         {
-            g_free( action );
-            action = NULL;
+            if( 0 == strcmp( app_dirs[i].dir, dir ) )
+                break;
         }
+        if( i < n_app_dirs )
+            path = g_strdup( app_dir_locate( &app_dirs[i], desktop_id ) );
+        else
+            path = _locate_desktop_file( dir, desktop_id );
     }
-    return action;
+    else
+        path = g_strdup( locate_desktop_file( desktop_id ) );
+    G_UNLOCK( actions );
+    return path;
 }
 
 /*
@@ -464,8 +600,13 @@ static char* get_default_action( const char* dir, const char* type, gpointer use
  */
 char* mime_type_get_default_action( const char* type )
 {
-    /* FIXME: need to check parent types if default action of current type is not set. */
-    return data_dir_foreach( (DataDirFunc)get_default_action, type, NULL );
+    char* action;
+
+    G_LOCK( actions );
+    load_app_dirs();
+    action = get_default_action( type );
+    G_UNLOCK( actions );
+    return action;
 }
 
 /*
@@ -494,4 +635,6 @@ void mime_type_set_default_action( const char* type, const char* desktop_id )
 
     g_free( path );
     g_free( data );
+
+    mime_type_reload_actions();
 }
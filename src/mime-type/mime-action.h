@@ -64,6 +64,12 @@ void mime_type_set_default_action( const char* type, const char* desktop_id );
 /* Locate the file path of desktop file by desktop_id */
 char* mime_type_locate_desktop_file( const char* dir, const char* desktop_id );
 
+/*
+ * Forget the parsed mimeinfo.cache, defaults.list and desktop files.
+ * Should be called when any of them is changed.
+ */
+void mime_type_reload_actions();
+
 G_END_DECLS
 
 #endif
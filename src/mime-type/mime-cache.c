@@ -18,6 +18,10 @@
  *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  *      MA 02110-1301, USA.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for memmem() */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -39,6 +43,12 @@
 #include <unistd.h>
 #include <fnmatch.h>
 
+/* Compare the result and speed of the compiled globs with fnmatch() */
+/* #define MIME_CACHE_DEBUG_GLOB */
+
+/* Compare the result and speed of the compiled magics with the old implementation */
+/* #define MIME_CACHE_DEBUG_MAGIC */
+
 #define LIB_MAJOR_VERSION 1
 /* FIXME: since mime-cache 1.2, weight is splitted into three parts
  * only lower 8 bit contains weight, and higher bits are flags and case-sensitivity.
@@ -64,6 +74,82 @@
 #define    MAGIC_LIST    24
 #define    NAMESPACE_LIST    28
 
+/*
+ * Globs in the glob list are the ones which can't be handled by the literal
+ * list or the suffix tree, like "README*" or "*.[1-9]".  Running fnmatch()
+ * against all of them for every file name is slow, so they are compiled
+ * when the cache is loaded.  The literal characters at the beginning and at
+ * the end of each glob, and the shortest name it can match, rule out most
+ * globs with a few comparisons, and fnmatch() is only called for the rest.
+ */
+typedef struct _MimeGlob
+{
+    const char* glob;
+    const char* type;
+    const char* suffix; /* literal characters at the end of the glob */
+    guint32 index;      /* position in the glob list of the cache */
+    guint16 len;
+    guint16 prefix_len; /* number of literal characters at the beginning */
+    guint16 suffix_len;
+    guint16 min_len;    /* length of the shortest file name matched */
+}MimeGlob;
+
+/* Globs starting with a literal character are put in the bucket of
+ * that character, and the others in the last bucket. */
+#define N_GLOB_BUCKETS  257
+
+typedef struct _MimeGlobIndex
+{
+    MimeGlob* globs;
+    /* globs[ bucket_start[i] ] to globs[ bucket_start[i + 1] - 1 ] are in bucket i,
+     * and they are sorted by length, the longest first. */
+    guint32 bucket_start[ N_GLOB_BUCKETS + 1 ];
+}MimeGlobIndex;
+
+/*
+ * Magic rules are decoded from the cache file every time they are checked,
+ * and every magic is checked in turn. So they are compiled when the cache
+ * is loaded, and the magics are dispatched by the first byte of the data.
+ * The magics are kept in the order of the cache, the highest priority first.
+ */
+typedef struct _MimeMagicRule
+{
+    guint32 offset;
+    guint32 range;
+    guint32 val_len;
+    const guchar* value;
+    const guchar* mask;  /* NULL if there is no mask */
+    guint32 n_children;
+    struct _MimeMagicRule* children;
+    const char* raw;  /* the rule in the cache file */
+}MimeMagicRule;
+
+typedef struct _MimeMagic
+{
+    const char* type;
+    guint32 n_rules;
+    MimeMagicRule* rules;
+}MimeMagic;
+
+/* Magics which can only match data starting with some specific bytes
+ * are put in the buckets of these bytes, and the others in the last bucket. */
+#define N_MAGIC_BUCKETS  257
+
+typedef struct _MimeMagicIndex
+{
+    MimeMagic* magics;
+    MimeMagicRule* rules;  /* all rules of the magics */
+    /* buckets[ bucket_start[i] ] to buckets[ bucket_start[i + 1] - 1 ] are
+     * the indices of the magics in bucket i, in ascending order. */
+    guint32* buckets;
+    guint32 bucket_start[ N_MAGIC_BUCKETS + 1 ];
+}MimeMagicIndex;
+
+static void mime_cache_compile_globs( MimeCache* cache );
+static void mime_cache_compile_magics( MimeCache* cache );
+static gboolean check_reverse_suffix_nodes( const char* buf, const char* nodes, guint32 n,
+                                            guint32 parent_ch, gboolean has_dot, int depth );
+
 MimeCache* mime_cache_new( const char* file_path )
 {
     MimeCache* cache = NULL;
@@ -75,6 +161,20 @@ MimeCache* mime_cache_new( const char* file_path )
 
 static void mime_cache_unload( MimeCache* cache, gboolean clear )
 {
+    if( cache->magic_index )
+    {
+        g_free( cache->magic_index->magics );
+        g_free( cache->magic_index->rules );
+        g_free( cache->magic_index->buckets );
+        g_slice_free( MimeMagicIndex, cache->magic_index );
+        cache->magic_index = NULL;
+    }
+    if( cache->glob_index )
+    {
+        g_free( cache->glob_index->globs );
+        g_slice_free( MimeGlobIndex, cache->glob_index );
+        cache->glob_index = NULL;
+    }
     if( G_LIKELY(cache->buffer) )
     {
 #ifdef HAVE_MMAP
@@ -187,23 +287,331 @@ gboolean mime_cache_load( MimeCache* cache, const char* file_path )
     cache->magic_max_extent = VAL32( buffer + offset, 4 );
     cache->magics = buffer + VAL32( buffer + offset, 8 );
 
+    mime_cache_compile_globs( cache );
+    mime_cache_compile_magics( cache );
+
+    /* Suffixes like ".tar.gz" and "~" are fine, but "*foo.txt" is not. */
+    cache->dotted_suffix = cache->has_reverse_suffix &&
+                check_reverse_suffix_nodes( buffer, cache->suffix_roots,
+                                            cache->n_suffix_roots, 0, FALSE, 0 );
+
     return TRUE;
 }
 
-static gboolean magic_rule_match( const char* buf, const char* rule, const char* data, int len )
+/*
+ * Check if every suffix in the reverse suffix tree which contains '.' starts with it.
+ * If so, the suffix matched in a filename never starts before the first '.' in it.
+ */
+gboolean check_reverse_suffix_nodes( const char* buf, const char* nodes, guint32 n,
+                                     guint32 parent_ch, gboolean has_dot, int depth )
+{
+    int i;
+
+    if( G_UNLIKELY( depth > 256 ) )  /* broken cache file */
+        return FALSE;
+
+    for( i = 0; i < n; ++i )
+    {
+        const char* node = nodes + i * 12;
+        guint32 ch = VAL32(node, 0);
+        if( ch )
+        {
+            if( ! check_reverse_suffix_nodes( buf, buf + VAL32(node, 8), VAL32(node, 4),
+                                              ch, has_dot || ch == '.', depth + 1 ) )
+                return FALSE;
+        }
+        else if( has_dot && parent_ch != '.' )  /* end of a suffix */
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean is_glob_special( char ch )
+{
+    return ( ch == '*' || ch == '?' || ch == '[' || ch == '\\' );
+}
+
+static void glob_compile( MimeGlob* g )
+{
+    const char *p = g->glob, *end;
+    guint min_len = 0;
+
+    g->len = strlen( p );
+    end = p + g->len;
+
+    for( g->prefix_len = 0; g->prefix_len < g->len && ! is_glob_special( p[ g->prefix_len ] ); ++g->prefix_len )
+        ;
+    /* ']' might be the end of a bracket expression */
+    for( g->suffix_len = 0; g->suffix_len < g->len
+         && ! is_glob_special( end[ - 1 - g->suffix_len ] ) && end[ - 1 - g->suffix_len ] != ']'; ++g->suffix_len )
+        ;
+    if( g->suffix_len == g->len )   /* no wildcard at all */
+        g->suffix_len = 0;
+    g->suffix = end - g->suffix_len;
+
+    while( *p )
+    {
+        switch( *p )
+        {
+        case '*':
+            ++p;
+            continue;
+        case '[':   /* a bracket expression matches one character */
+            ++p;
+            if( *p == '!' || *p == '^' )
+                ++p;
+            if( *p == ']' )
+                ++p;
+            while( *p && *p != ']' )
+                ++p;
+            if( *p )
+                ++p;
+            break;
+        case '\\':
+            ++p;
+            if( *p )
+                ++p;
+            break;
+        default:
+            ++p;
+        }
+        ++min_len;
+    }
+    g->min_len = MIN( min_len, G_MAXUINT16 );
+}
+
+static int glob_compare( const MimeGlob* g1, const MimeGlob* g2 )
+{
+    /* longest first, and keep the order in the cache for globs of the same length */
+    if( g1->len != g2->len )
+        return g2->len - g1->len;
+    return g1->index < g2->index ? -1 : ( g1->index > g2->index );
+}
+
+static guint glob_bucket( const MimeGlob* g )
+{
+    return g->prefix_len > 0 ? (guchar)g->glob[0] : N_GLOB_BUCKETS - 1;
+}
+
+void mime_cache_compile_globs( MimeCache* cache )
+{
+    MimeGlobIndex* index;
+    MimeGlob* sorted;
+    const char* entry = cache->globs;
+    guint32 i, counts[ N_GLOB_BUCKETS ] = { 0 }, pos[ N_GLOB_BUCKETS ];
+    /* entry size is changed in mime.cache 1.1 */
+    size_t entry_size = cache->has_str_weight ? 12 : 8;
+
+    if( cache->n_globs == 0 )
+        return;
+
+    sorted = g_new( MimeGlob, cache->n_globs );
+    for( i = 0; i < cache->n_globs; ++i, entry += entry_size )
+    {
+        sorted[ i ].glob = cache->buffer + VAL32( entry, 0 );
+        sorted[ i ].type = cache->buffer + VAL32( entry, 4 );
+        sorted[ i ].index = i;
+        glob_compile( &sorted[ i ] );
+        ++counts[ glob_bucket( &sorted[ i ] ) ];
+    }
+    qsort( sorted, cache->n_globs, sizeof(MimeGlob), (GCompareFunc)glob_compare );
+
+    /* distribute them into the buckets, keeping the order */
+    index = g_slice_new( MimeGlobIndex );
+    index->globs = g_new( MimeGlob, cache->n_globs );
+    index->bucket_start[ 0 ] = 0;
+    for( i = 0; i < N_GLOB_BUCKETS; ++i )
+    {
+        index->bucket_start[ i + 1 ] = index->bucket_start[ i ] + counts[ i ];
+        pos[ i ] = index->bucket_start[ i ];
+    }
+    for( i = 0; i < cache->n_globs; ++i )
+        index->globs[ pos[ glob_bucket( &sorted[ i ] ) ]++ ] = sorted[ i ];
+    g_free( sorted );
+
+    cache->glob_index = index;
+}
+
+/* Whether the 32 bytes of a magic rule are inside the cache file */
+static gboolean is_magic_rule_in_cache( const char* buf, const char* buf_end, const char* rule )
+{
+    return rule >= buf && rule <= buf_end && buf_end - rule >= 32;
+}
+
+/*
+ * Count the rules and all of their children.
+ * Returns -1 if the rules are nested too deep, or not inside the cache file.
+ */
+static int count_magic_rules( const char* buf, const char* buf_end,
+                              const char* rule, guint32 n, int depth )
+{
+    int i, n_rules = n, n_children;
+
+    if( G_UNLIKELY( depth > 64 ) )  /* broken cache file */
+        return -1;
+    for( i = 0; i < n; ++i, rule += 32 )
+    {
+        if( G_UNLIKELY( ! is_magic_rule_in_cache( buf, buf_end, rule ) ) )
+            return -1;
+        if( VAL32( rule, 24 ) == 0 )
+            continue;
+        n_children = count_magic_rules( buf, buf_end, buf + VAL32( rule, 28 ),
+                                        VAL32( rule, 24 ), depth + 1 );
+        if( n_children < 0 )
+            return -1;
+        n_rules += n_children;
+    }
+    return n_rules;
+}
+
+/* Decode n rules into *pool, and advance *pool past them and their children */
+static MimeMagicRule* compile_magic_rules( const char* buf, const char* rule, guint32 n,
+                                           MimeMagicRule** pool )
+{
+    MimeMagicRule* rules = *pool;
+    int i;
+
+    *pool += n;
+    for( i = 0; i < n; ++i, rule += 32 )
+    {
+        MimeMagicRule* r = &rules[ i ];
+        guint32 mask_off = VAL32( rule, 20 );
+        r->offset = VAL32( rule, 0 );
+        r->range = VAL32( rule, 4 );
+        /* FIXME: word_size and byte order are not supported! */
+        r->val_len = VAL32( rule, 12 );
+        r->value = (const guchar*)buf + VAL32( rule, 16 );
+        r->mask = mask_off > 0 ? (const guchar*)buf + mask_off : NULL;
+        r->n_children = VAL32( rule, 24 );
+        r->children = r->n_children > 0 ?
+                compile_magic_rules( buf, buf + VAL32( rule, 28 ), r->n_children, pool ) : NULL;
+        r->raw = rule;
+    }
+    return rules;
+}
+
+/*
+ * Find the bytes the data should start with to match the magic.
+ * Returns FALSE if the magic can match data starting with any byte.
+ */
+static gboolean get_magic_first_bytes( MimeMagic* magic, gboolean* bytes )
+{
+    int i, b;
+
+    memset( bytes, 0, 256 * sizeof(gboolean) );
+    for( i = 0; i < magic->n_rules; ++i )
+    {
+        MimeMagicRule* r = &magic->rules[ i ];
+        guchar mask;
+
+        if( r->offset != 0 || r->range != 1 || r->val_len == 0 )
+            return FALSE;
+        mask = r->mask ? r->mask[0] : 0xff;
+        for( b = 0; b < 256; ++b )
+        {
+            if( (b & mask) == r->value[0] )
+                bytes[ b ] = TRUE;
+        }
+    }
+    return TRUE;
+}
+
+void mime_cache_compile_magics( MimeCache* cache )
+{
+    const char* buf = cache->buffer, *magic;
+    MimeMagicIndex* index;
+    MimeMagicRule* pool;
+    guint32 pos[ N_MAGIC_BUCKETS ];
+    gboolean bytes[ 256 ];
+    int i, b, n_rules = 0, n;
+
+    if( ! cache->magics || cache->n_magics == 0 )
+        return;
+
+    for( i = 0, magic = cache->magics; i < cache->n_magics; ++i, magic += 16 )
+    {
+        n = count_magic_rules( buf, buf + cache->size,
+                               buf + VAL32( magic, 12 ), VAL32( magic, 8 ), 0 );
+        if( G_UNLIKELY( n < 0 ) )
+            return;
+        n_rules += n;
+    }
+
+    index = g_slice_new0( MimeMagicIndex );
+    index->magics = g_new( MimeMagic, cache->n_magics );
+    index->rules = pool = g_new( MimeMagicRule, n_rules );
+
+    /* magics in the cache file are already sorted by priority, the highest first */
+    for( i = 0, magic = cache->magics; i < cache->n_magics; ++i, magic += 16 )
+    {
+        MimeMagic* m = &index->magics[ i ];
+        m->type = buf + VAL32( magic, 4 );
+        m->n_rules = VAL32( magic, 8 );
+        m->rules = compile_magic_rules( buf, buf + VAL32( magic, 12 ), m->n_rules, &pool );
+
+        if( get_magic_first_bytes( m, bytes ) )
+        {
+            for( b = 0; b < 256; ++b )
+                if( bytes[ b ] )
+                    ++index->bucket_start[ b + 1 ];
+        }
+        else
+            ++index->bucket_start[ N_MAGIC_BUCKETS ];
+    }
+
+    for( b = 0; b < N_MAGIC_BUCKETS; ++b )
+    {
+        index->bucket_start[ b + 1 ] += index->bucket_start[ b ];
+        pos[ b ] = index->bucket_start[ b ];
+    }
+    index->buckets = g_new( guint32, index->bucket_start[ N_MAGIC_BUCKETS ] );
+    for( i = 0; i < cache->n_magics; ++i )
+    {
+        if( get_magic_first_bytes( &index->magics[ i ], bytes ) )
+        {
+            for( b = 0; b < 256; ++b )
+                if( bytes[ b ] )
+                    index->buckets[ pos[ b ]++ ] = i;
+        }
+        else
+            index->buckets[ pos[ N_MAGIC_BUCKETS - 1 ]++ ] = i;
+    }
+
+    cache->magic_index = index;
+}
+
+/*
+ * The original matcher, which decodes the rules from the cache file.
+ * It's kept as it was since the compiled magics must give the same results,
+ * including its handling of children which fail to match: the rule pointer
+ * is left after the children, and the match flag is never reset.
+ * Only the checks of the rule pointers against buf_end are added.
+ */
+static gboolean magic_rule_match( const char* buf, const char* buf_end,
+                                  const char* rule, const char* data, int len )
 {
     gboolean match = FALSE;
-    guint32 offset = VAL32( rule, 0 );
-    guint32 range = VAL32( rule, 4 );
+    guint32 offset, range, max_offset, val_len;
 
-    guint32 max_offset = offset + range;
-    guint32 val_len = VAL32( rule, 12 );
+    if( G_UNLIKELY( ! is_magic_rule_in_cache( buf, buf_end, rule ) ) )
+        return FALSE;
+    offset = VAL32( rule, 0 );
+    range = VAL32( rule, 4 );
+
+    max_offset = offset + range;
+    val_len = VAL32( rule, 12 );
 
     for( ; offset < max_offset && (offset + val_len) <= len ; ++offset )
     {
-        guint32 val_off = VAL32( rule, 16 );
-        guint32 mask_off = VAL32( rule, 20 );
-        const char* value = buf + val_off;
+        guint32 val_off;
+        guint32 mask_off;
+        const char* value;
+        /* the rule is moved past its children if they don't match */
+        if( G_UNLIKELY( ! is_magic_rule_in_cache( buf, buf_end, rule ) ) )
+            return FALSE;
+        val_off = VAL32( rule, 16 );
+        mask_off = VAL32( rule, 20 );
+        value = buf + val_off;
         /* FIXME: word_size and byte order are not supported! */
 
         if( G_UNLIKELY( mask_off > 0 ) )    /* compare with mask applied */
@@ -235,7 +643,7 @@ static gboolean magic_rule_match( const char* buf, const char* rule, const char*
                 rule = buf + first_child_off;
                 for( i = 0; i < n_children; ++i, rule += 32 )
                 {
-                    if( magic_rule_match( buf, rule, data, len ) )
+                    if( magic_rule_match( buf, buf_end, rule, data, len ) )
                         return TRUE;
                 }
             }
@@ -246,7 +654,131 @@ static gboolean magic_rule_match( const char* buf, const char* rule, const char*
     return FALSE;
 }
 
-static gboolean magic_match( const char* buf, const char* magic, const char* data, int len )
+/*
+ * The old matcher goes on after the children of a matched rule fail, with the
+ * rule stored right after the children, for the rest of the offsets. Since its
+ * match flag is still set, that rule matches if it has no children, or else its
+ * children are checked, and so on. n_left is the number of offsets left.
+ * The walk stops if it leaves the cache file, as after the last rule.
+ */
+static gboolean magic_rule_match_after_children( const char* buf, const char* buf_end,
+                                                 const char* rule, guint32 n_left,
+                                                 const char* data, int len )
+{
+    guint32 n_children, i;
+
+    for( ; n_left > 0; --n_left )
+    {
+        rule = buf + VAL32( rule, 28 ) + 32 * (gsize)VAL32( rule, 24 );
+        if( G_UNLIKELY( ! is_magic_rule_in_cache( buf, buf_end, rule ) ) )
+            return FALSE;
+        n_children = VAL32( rule, 24 );
+        if( n_children == 0 )
+            return TRUE;
+        for( i = 0; i < n_children; ++i )
+        {
+            if( magic_rule_match( buf, buf_end, buf + VAL32( rule, 28 ) + 32 * (gsize)i,
+                                  data, len ) )
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean magic_rule_match_compiled( const char* buf, const char* buf_end,
+                                           const MimeMagicRule* rule,
+                                           const guchar* data, guint32 len )
+{
+    guint32 offset = rule->offset, end, val_len = rule->val_len, i;
+    const guchar* found;
+
+    if( val_len > len || offset > len - val_len )
+        return FALSE;
+    /* the value is compared at offset, offset + 1, ..., end - 1 */
+    end = MIN( offset + rule->range, len - val_len + 1 );
+    if( offset >= end )
+        return FALSE;
+
+    if( G_UNLIKELY( rule->mask ) )    /* compare with mask applied */
+    {
+        for( ; offset < end; ++offset )
+        {
+            for( i = 0; i < val_len; ++i )
+            {
+                if( (data[offset + i] & rule->mask[i]) != rule->value[i] )
+                    break;
+            }
+            if( i >= val_len )
+                break;
+        }
+        if( offset >= end )
+            return FALSE;
+    }
+    else if( end - offset == 1 )    /* direct comparison */
+    {
+        if( 0 != memcmp( rule->value, data + offset, val_len ) )
+            return FALSE;
+    }
+    else    /* search the range */
+    {
+        found = memmem( data + offset, end - offset - 1 + val_len, rule->value, val_len );
+        if( ! found )
+            return FALSE;
+        offset = found - data;
+    }
+
+    if( rule->n_children == 0 )
+        return TRUE;
+    /* Offsets of the children are not relative to the matched position,
+     * so there is no need to find the value again if they don't match. */
+    for( i = 0; i < rule->n_children; ++i )
+    {
+        if( magic_rule_match_compiled( buf, buf_end, &rule->children[ i ], data, len ) )
+            return TRUE;
+    }
+    return magic_rule_match_after_children( buf, buf_end, rule->raw, end - offset - 1,
+                                            (const char*)data, len );
+}
+
+static const char* lookup_magic_compiled( MimeCache* cache, const char* data, int len )
+{
+    MimeMagicIndex* index = cache->magic_index;
+    guint32 i, end_i, j, end_j, m, r;
+    guchar b;
+
+    if( G_UNLIKELY( ! data || (len <= 0) || ! index ) )
+        return NULL;
+
+    /* Merge the bucket of the first byte with the last bucket, so the
+     * magics are still checked in the order of their priorities. */
+    b = (guchar)data[ 0 ];
+    i = index->bucket_start[ b ];
+    end_i = index->bucket_start[ b + 1 ];
+    j = index->bucket_start[ N_MAGIC_BUCKETS - 1 ];
+    end_j = index->bucket_start[ N_MAGIC_BUCKETS ];
+    while( i < end_i || j < end_j )
+    {
+        MimeMagic* magic;
+        if( j >= end_j || (i < end_i && index->buckets[ i ] < index->buckets[ j ]) )
+            m = index->buckets[ i++ ];
+        else
+            m = index->buckets[ j++ ];
+
+        magic = &index->magics[ m ];
+        for( r = 0; r < magic->n_rules; ++r )
+        {
+            if( magic_rule_match_compiled( cache->buffer, cache->buffer + cache->size,
+                                           &magic->rules[ r ], (const guchar*)data, len ) )
+                return magic->type;
+        }
+    }
+    return NULL;
+}
+
+#ifdef MIME_CACHE_DEBUG_MAGIC
+/* The old implementation, used to check the compiled magics */
+static gboolean magic_match( const char* buf, const char* buf_end,
+                             const char* magic, const char* data, int len )
 {
     guint32 n_rules = VAL32( magic, 8 );
     guint32 rules_off = VAL32( magic, 12 );
@@ -254,12 +786,12 @@ static gboolean magic_match( const char* buf, const char* magic, const char* dat
     int i;
 
     for( i = 0; i < n_rules; ++i, rule += 32 )
-        if( magic_rule_match( buf, rule, data, len ) )
+        if( magic_rule_match( buf, buf_end, rule, data, len ) )
             return TRUE;
     return FALSE;
 }
 
-const char* mime_cache_lookup_magic( MimeCache* cache, const char* data, int len )
+static const char* lookup_magic_linear( MimeCache* cache, const char* data, int len )
 {
     const char* magic = cache->magics;
     int i;
@@ -269,7 +801,7 @@ const char* mime_cache_lookup_magic( MimeCache* cache, const char* data, int len
 
     for( i = 0; i < cache->n_magics; ++i, magic += 16 )
     {
-        if( magic_match( cache->buffer, magic, data, len ) )
+        if( magic_match( cache->buffer, cache->buffer + cache->size, magic, data, len ) )
         {
             return cache->buffer + VAL32( magic, 4 );
         }
@@ -277,6 +809,35 @@ const char* mime_cache_lookup_magic( MimeCache* cache, const char* data, int len
     return NULL;
 }
 
+const char* mime_cache_lookup_magic( MimeCache* cache, const char* data, int len )
+{
+    static gdouble t_compiled = 0, t_linear = 0;
+    static guint n_lookups = 0;
+    GTimer* timer;
+    const char *type, *type2;
+
+    timer = g_timer_new();
+    type = lookup_magic_compiled( cache, data, len );
+    t_compiled += g_timer_elapsed( timer, NULL );
+    g_timer_start( timer );
+    type2 = lookup_magic_linear( cache, data, len );
+    t_linear += g_timer_elapsed( timer, NULL );
+    g_timer_destroy( timer );
+
+    if( type != type2 )
+        g_warning( "magic mismatch: %s, %s", type, type2 );
+    if( ++n_lookups % 100 == 0 )
+        g_debug( "%u magic lookups: compiled %.3f ms, linear %.3f ms",
+                 n_lookups, t_compiled * 1000, t_linear * 1000 );
+    return type;
+}
+#else
+const char* mime_cache_lookup_magic( MimeCache* cache, const char* data, int len )
+{
+    return lookup_magic_compiled( cache, data, len );
+}
+#endif
+
 static const char* lookup_suffix_nodes( const char* buf, const char* nodes, guint32 n, const char* name )
 {
     gunichar uchar;
@@ -504,7 +1065,47 @@ const char* mime_cache_lookup_literal( MimeCache* cache, const char* filename )
     return lookup_str_in_entries( cache, cache->literals, cache->n_literals, filename );
 }
 
-const char* mime_cache_lookup_glob( MimeCache* cache, const char* filename, int *glob_len )
+/* Find the longest glob matching the file name in the bucket.
+ * Globs matched by a previous bucket are passed in best. */
+static const MimeGlob* lookup_glob_bucket( MimeGlobIndex* index, guint bucket,
+                                           const char* filename, guint name_len,
+                                           const MimeGlob* best )
+{
+    const MimeGlob *g, *end;
+
+    g = index->globs + index->bucket_start[ bucket ];
+    end = index->globs + index->bucket_start[ bucket + 1 ];
+    for( ; g < end; ++g )
+    {
+        /* The globs left are shorter, or appear later in the cache */
+        if( best && ( g->len < best->len || ( g->len == best->len && g->index > best->index ) ) )
+            break;
+        if( name_len < g->min_len
+            || strncmp( filename, g->glob, g->prefix_len )
+            || ( g->suffix_len && memcmp( filename + name_len - g->suffix_len, g->suffix, g->suffix_len ) ) )
+            continue;
+        if( 0 == fnmatch( g->glob, filename, 0 ) )
+            return g;
+    }
+    return best;
+}
+
+static const char* lookup_glob_compiled( MimeCache* cache, const char* filename, int *glob_len )
+{
+    const MimeGlob* best = NULL;
+    guint name_len = strlen( filename );
+
+    if( G_LIKELY( filename[0] ) )
+        best = lookup_glob_bucket( cache->glob_index, (guchar)filename[0], filename, name_len, NULL );
+    best = lookup_glob_bucket( cache->glob_index, N_GLOB_BUCKETS - 1, filename, name_len, best );
+
+    *glob_len = best ? best->len : 0;
+    return best ? best->type : NULL;
+}
+
+#ifdef MIME_CACHE_DEBUG_GLOB
+/* The old implementation, used to check the compiled globs */
+static const char* lookup_glob_fnmatch( MimeCache* cache, const char* filename, int *glob_len )
 {
     const char* entry = cache->globs, *type = NULL;
     int i;
@@ -528,6 +1129,47 @@ const char* mime_cache_lookup_glob( MimeCache* cache, const char* filename, int
     return type;
 }
 
+const char* mime_cache_lookup_glob( MimeCache* cache, const char* filename, int *glob_len )
+{
+    static gdouble t_compiled = 0, t_fnmatch = 0;
+    static guint n_lookups = 0;
+    GTimer* timer;
+    const char *type, *type2;
+    int len2;
+
+    if( G_UNLIKELY( ! cache->glob_index ) )
+    {
+        *glob_len = 0;
+        return NULL;
+    }
+
+    timer = g_timer_new();
+    type = lookup_glob_compiled( cache, filename, glob_len );
+    t_compiled += g_timer_elapsed( timer, NULL );
+    g_timer_start( timer );
+    type2 = lookup_glob_fnmatch( cache, filename, &len2 );
+    t_fnmatch += g_timer_elapsed( timer, NULL );
+    g_timer_destroy( timer );
+
+    if( type != type2 || *glob_len != len2 )
+        g_warning( "glob mismatch for %s: %s, %s", filename, type, type2 );
+    if( ++n_lookups % 1000 == 0 )
+        g_debug( "%u glob lookups: compiled %.3f ms, fnmatch %.3f ms",
+                 n_lookups, t_compiled * 1000, t_fnmatch * 1000 );
+    return type;
+}
+#else
+const char* mime_cache_lookup_glob( MimeCache* cache, const char* filename, int *glob_len )
+{
+    if( G_UNLIKELY( ! cache->glob_index ) )
+    {
+        *glob_len = 0;
+        return NULL;
+    }
+    return lookup_glob_compiled( cache, filename, glob_len );
+}
+#endif
+
 const char** mime_cache_lookup_parents( MimeCache* cache, const char* mime_type )
 {
     guint32 n, i;
@@ -33,6 +33,8 @@ struct _MimeCache
     char* file_path;
     gboolean has_reverse_suffix : 1; /* since mime.cache v1.1, shared mime info v0.4 */
     gboolean has_str_weight : 1; /* since mime.cache v1.1, shared mime info v0.4 */
+    gboolean dotted_suffix : 1; /* every suffix containing '.' starts with it */
+    int n_ref;  /* number of the lists of loaded caches containing it */
     const char* buffer;
     guint size;
 
@@ -47,6 +49,7 @@ struct _MimeCache
 
     guint32 n_globs;
     const char* globs;
+    struct _MimeGlobIndex* glob_index;  /* globs compiled by mime_cache_load() */
 
     guint32 n_suffix_roots;
     const char* suffix_roots;
@@ -54,6 +57,7 @@ struct _MimeCache
     guint32 n_magics;
     guint32 magic_max_extent;
     const char* magics;
+    struct _MimeMagicIndex* magic_index;  /* magics compiled by mime_cache_load() */
 };
 typedef struct _MimeCache MimeCache;
 
@@ -19,7 +19,10 @@
  *      MA 02110-1301, USA.
  */
 
-/* Currently this library is NOT MT-safe */
+/*
+ * The lookup functions can be called from many threads at the same time.
+ * Loading and reloading the mime caches should be done in the main thread.
+ */
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -36,6 +39,7 @@
 #include <sys/types.h>
 
 #include "glib-mem.h"
+#include "glib-utils.h" /* for g_mkdir_with_parents() */
 
 /*
  * FIXME:
@@ -59,15 +63,72 @@ const char xdg_mime_type_directory[] = "inode/directory";
 const char xdg_mime_type_executable[] = "application/x-executable";
 const char xdg_mime_type_plain_text[] = "text/plain";
 
-static MimeCache** caches = NULL;
-static guint n_caches = 0;
+/*
+ * Memoized results of mime_type_get_by_filename().
+ * Most files are recognized by their suffixes, so the results are cached
+ * by the part of the filename starting from the first '.', converted to
+ * lower case. Other filenames, such as "Makefile", are cached as they are.
+ */
+typedef struct _SuffixCacheEntry
+{
+    const char* type;
+    int cache_idx;  /* index of the mime cache in which the suffix was found */
+}SuffixCacheEntry;
+
+#define FILENAME_CACHE_MAX_ENTRIES    4096
+
+/*
+ * The loaded mime caches.
+ * A list is never changed once it's created. The lookup functions hold a
+ * reference to the current list, and mime_cache_reload() replaces it with
+ * a new one, so the caches are never changed or freed under the feet of
+ * other threads. The memoized results point into the caches, so they are
+ * kept in the list, too.
+ */
+typedef struct _MimeCacheList
+{
+    MimeCache** caches;
+    guint n_caches;
+    guint32 max_extent;  /* max magic extent of the caches */
+    int n_ref;
+    GHashTable* suffix_cache;  /* lower case suffix => SuffixCacheEntry */
+    GHashTable* name_cache;  /* filename => mime-type */
+}MimeCacheList;
+
+static MimeCacheList* cache_list = NULL;
+/* The list replaced by the last reload. Mime-types returned by the lookup
+ * functions point into it, so it's kept until the next reload. */
+static MimeCacheList* retired_cache_list = NULL;
+static MimeCacheList empty_cache_list = { NULL, 0, 0, 1, NULL, NULL };
+/* guards cache_list while a reference is taken */
+G_LOCK_DEFINE_STATIC(cache_list);
+
 guint32 mime_cache_max_extent = 0;
 
-/* allocated buffer used for mime magic checking to
-     prevent frequent memory allocation */
-static char* mime_magic_buf = NULL;
-/* for MT safety, the buffer should be locked */
-G_LOCK_DEFINE_STATIC(mime_magic_buf);
+/* The buffer of each thread used for mime magic checking
+ * to prevent frequent memory allocation */
+typedef struct _MagicBuf
+{
+    guint32 size;
+    char data[1];
+}MagicBuf;
+static GStaticPrivate magic_buf = G_STATIC_PRIVATE_INIT;
+
+/* guards the memoized results in all lists */
+static guint filename_cache_hits = 0;
+static guint filename_cache_misses = 0;
+G_LOCK_DEFINE_STATIC(filename_cache);
+
+/*
+ * Reading the xml file of a mime-type to get its description, or the
+ * generic-icons file to get its generic icon, every time they are needed
+ * is slow. So all of them are read into the indices once. The descriptions
+ * for the current locale are saved to the user's cache dir, and the saved
+ * ones are used until the mime caches are updated.
+ */
+static GHashTable* desc_index = NULL;  /* mime-type => description */
+static GHashTable* generic_icon_index = NULL;  /* mime-type => icon name */
+G_LOCK_DEFINE_STATIC(mime_index);
 
 /* load all mime.cache files on the system,
  * including /usr/share/mime/mime.cache,
@@ -80,23 +141,26 @@ static void mime_cache_free_all();
 
 static gboolean mime_type_is_data_plain_text( const char* data, int len );
 
+static MimeCacheList* cache_list_get();
+static void cache_list_unref( MimeCacheList* list );
+
+static void mime_index_clear();
+
 /*
- * Get mime-type of the specified file (quick, but less accurate):
- * Mime-type of the file is determined by cheking the filename only.
- * If statbuf != NULL, it will be used to determine if the file is a directory.
-*/
-const char* mime_type_get_by_filename( const char* filename, struct stat* statbuf )
+ * Look up the filename in the mime caches.
+ * If the type is found by suffix, *suffix_cache_idx is set to the index
+ * of the mime cache containing it; otherwise, it's set to -1.
+ */
+static const char* lookup_filename( MimeCacheList* list, const char* filename, int* suffix_cache_idx )
 {
     const char* type = NULL, *suffix_pos = NULL, *prev_suffix_pos = (const char*)-1;
     int i;
     MimeCache* cache;
 
-    if( G_UNLIKELY( statbuf && S_ISDIR( statbuf->st_mode ) ) )
-        return XDG_MIME_TYPE_DIRECTORY;
-
-    for( i = 0; ! type && i < n_caches; ++i )
+    *suffix_cache_idx = -1;
+    for( i = 0; ! type && i < list->n_caches; ++i )
     {
-        cache = caches[i];
+        cache = list->caches[i];
         type = mime_cache_lookup_literal( cache, filename );
         if( G_LIKELY( ! type ) )
         {
@@ -105,6 +169,7 @@ const char* mime_type_get_by_filename( const char* filename, struct stat* statbu
             {
                 type = _type;
                 prev_suffix_pos = suffix_pos;
+                *suffix_cache_idx = i;
             }
         }
     }
@@ -112,9 +177,9 @@ const char* mime_type_get_by_filename( const char* filename, struct stat* statbu
     if( G_UNLIKELY( ! type ) )  /* glob matching */
     {
         int max_glob_len = 0, glob_len = 0;
-        for( i = 0; ! type && i < n_caches; ++i )
+        for( i = 0; ! type && i < list->n_caches; ++i )
         {
-            cache = caches[i];
+            cache = list->caches[i];
             const char* matched_type;
             matched_type = mime_cache_lookup_glob( cache, filename, &glob_len );
             /* according to the mime.cache 1.0 spec, we should use the longest glob matched. */
@@ -126,10 +191,142 @@ const char* mime_type_get_by_filename( const char* filename, struct stat* statbu
         }
     }
 
-
     return type && *type ? type : XDG_MIME_TYPE_UNKNOWN;
 }
 
+/*
+ * Get the key used in suffix_cache for the filename.
+ * The suffix matched in the filename can only be used for other files
+ * if it never starts before the first '.' of the filename in any mime cache.
+ * Returns NULL if the filename cannot be cached by suffix.
+ */
+static char* get_suffix_key( MimeCacheList* list, const char* filename )
+{
+    const char* dot = strchr( filename, '.' );
+    const char* p;
+    GString* key;
+    int i;
+
+    if( ! dot || ! g_utf8_validate( dot, -1, NULL ) )
+        return NULL;
+    for( i = 0; i < list->n_caches; ++i )
+    {
+        if( list->caches[i]->n_suffix_roots > 0 && ! list->caches[i]->dotted_suffix )
+            return NULL;
+    }
+
+    /* convert the suffix to lower case the same way as the suffix tree does */
+    key = g_string_sized_new( strlen( dot ) );
+    for( p = dot; *p; p = g_utf8_next_char( p ) )
+        g_string_append_unichar( key, g_unichar_tolower( g_utf8_get_char( p ) ) );
+    return g_string_free( key, FALSE );
+}
+
+static void suffix_cache_entry_free( SuffixCacheEntry* entry )
+{
+    g_slice_free( SuffixCacheEntry, entry );
+}
+
+static gboolean remove_cache_entry( gpointer key, gpointer value, gpointer user_data )
+{
+    return TRUE;
+}
+
+/*
+ * Get mime-type of the specified file (quick, but less accurate):
+ * Mime-type of the file is determined by cheking the filename only.
+ * If statbuf != NULL, it will be used to determine if the file is a directory.
+*/
+const char* mime_type_get_by_filename( const char* filename, struct stat* statbuf )
+{
+    const char* type = NULL;
+    char* key;
+    SuffixCacheEntry* entry;
+    MimeCacheList* list;
+    int i, cache_idx = -1;
+
+    if( G_UNLIKELY( statbuf && S_ISDIR( statbuf->st_mode ) ) )
+        return XDG_MIME_TYPE_DIRECTORY;
+
+    list = cache_list_get();
+    key = get_suffix_key( list, filename );
+
+    G_LOCK( filename_cache );
+    if( G_UNLIKELY( ! list->name_cache ) )
+    {
+        list->name_cache = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+        list->suffix_cache = g_hash_table_new_full( g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify)suffix_cache_entry_free );
+    }
+    type = (const char*)g_hash_table_lookup( list->name_cache, filename );
+    if( ! type && key )
+    {
+        entry = (SuffixCacheEntry*)g_hash_table_lookup( list->suffix_cache, key );
+        if( entry )
+        {
+            type = entry->type;
+            cache_idx = entry->cache_idx;
+        }
+    }
+    if( type )
+        ++filename_cache_hits;
+    else
+        ++filename_cache_misses;
+    G_UNLOCK( filename_cache );
+
+    if( type )
+    {
+        g_free( key );
+        /* Literals are looked up before suffixes, and they are case-sensitive. */
+        for( i = 0; i <= cache_idx; ++i )
+        {
+            const char* literal = mime_cache_lookup_literal( list->caches[i], filename );
+            if( G_UNLIKELY( literal ) )
+            {
+                type = *literal ? literal : XDG_MIME_TYPE_UNKNOWN;
+                break;
+            }
+        }
+        cache_list_unref( list );
+        return type;
+    }
+
+    type = lookup_filename( list, filename, &cache_idx );
+
+    G_LOCK( filename_cache );
+    if( cache_idx >= 0 && key )
+    {
+        if( g_hash_table_size( list->suffix_cache ) >= FILENAME_CACHE_MAX_ENTRIES )
+            g_hash_table_foreach_remove( list->suffix_cache, remove_cache_entry, NULL );
+        entry = g_slice_new( SuffixCacheEntry );
+        entry->type = type;
+        entry->cache_idx = cache_idx;
+        g_hash_table_replace( list->suffix_cache, key, entry );
+        key = NULL;
+    }
+    else
+    {
+        if( g_hash_table_size( list->name_cache ) >= FILENAME_CACHE_MAX_ENTRIES )
+            g_hash_table_foreach_remove( list->name_cache, remove_cache_entry, NULL );
+        g_hash_table_replace( list->name_cache, g_strdup( filename ), (gpointer)type );
+    }
+    G_UNLOCK( filename_cache );
+
+    g_free( key );
+    cache_list_unref( list );
+    return type;
+}
+
+void mime_type_get_filename_cache_stats( guint* hits, guint* misses )
+{
+    G_LOCK( filename_cache );
+    if( hits )
+        *hits = filename_cache_hits;
+    if( misses )
+        *misses = filename_cache_misses;
+    G_UNLOCK( filename_cache );
+}
+
 /*
  * Get mime-type info of the specified file (slow, but more accurate):
  * To determine the mime-type of the file, mime_type_get_by_filename() is
@@ -143,19 +340,24 @@ const char* mime_type_get_by_filename( const char* filename, struct stat* statbu
  * efifciency, too. Otherwise, the function will try to get the basename of
  * the specified file again.
 */
-const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, const char* basename )
+/*
+ * The part of mime_type_get_by_file() which doesn't read the file.
+ * Returns NULL if the content of the file needs to be checked.
+ * Symlinks are followed, and *statbuf is pointed to the stat of the target.
+ */
+static const char* get_by_name_and_stat( const char* filepath, struct stat** statbuf,
+                                         struct stat* _statbuf, const char* basename )
 {
     const char* type;
-    struct stat _statbuf;
 
-    if( statbuf == NULL || G_UNLIKELY( S_ISLNK(statbuf->st_mode) ) )
+    if( *statbuf == NULL || G_UNLIKELY( S_ISLNK((*statbuf)->st_mode) ) )
     {
-        statbuf = &_statbuf;
-        if( stat ( filepath, statbuf ) == -1 )
+        *statbuf = _statbuf;
+        if( stat ( filepath, *statbuf ) == -1 )
             return XDG_MIME_TYPE_UNKNOWN;
     }
 
-    if( S_ISDIR( statbuf->st_mode ) )
+    if( S_ISDIR( (*statbuf)->st_mode ) )
         return XDG_MIME_TYPE_DIRECTORY;
 
     if( basename == NULL )
@@ -169,11 +371,51 @@ const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, c
 
     if( G_LIKELY(basename) )
     {
-        type = mime_type_get_by_filename( basename, statbuf );
+        type = mime_type_get_by_filename( basename, *statbuf );
         if( G_LIKELY( strcmp( type, XDG_MIME_TYPE_UNKNOWN ) ) )
             return type;
-        type = NULL;
     }
+    return NULL;
+}
+
+const char* mime_type_get_by_file_fast( const char* filepath, struct stat* statbuf,
+                                        const char* basename, gboolean* need_magic )
+{
+    const char* type;
+    struct stat _statbuf;
+
+    *need_magic = FALSE;
+    type = get_by_name_and_stat( filepath, &statbuf, &_statbuf, basename );
+    if( type )
+        return type;
+    if( statbuf->st_size == 0 )  /* empty file can be viewed as text file */
+        return XDG_MIME_TYPE_PLAIN_TEXT;
+    *need_magic = TRUE;
+    return XDG_MIME_TYPE_UNKNOWN;
+}
+
+/* Get the magic checking buffer of the calling thread */
+static char* get_magic_buf( guint32 size )
+{
+    MagicBuf* buf = (MagicBuf*)g_static_private_get( &magic_buf );
+    if( G_UNLIKELY( ! buf || buf->size < size ) )
+    {
+        buf = (MagicBuf*)g_malloc( sizeof(MagicBuf) + size );
+        buf->size = size;
+        /* the old buffer is freed */
+        g_static_private_set( &magic_buf, buf, g_free );
+    }
+    return buf->data;
+}
+
+const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, const char* basename )
+{
+    const char* type;
+    struct stat _statbuf;
+
+    type = get_by_name_and_stat( filepath, &statbuf, &_statbuf, basename );
+    if( type )
+        return type;
 
     if( G_LIKELY(statbuf->st_size > 0) )
     {
@@ -184,38 +426,21 @@ const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, c
         fd = open ( filepath, O_RDONLY, 0 );
         if ( fd != -1 )
         {
-            int len = mime_cache_max_extent < statbuf->st_size ?  mime_cache_max_extent : statbuf->st_size;
+            MimeCacheList* list = cache_list_get();
+            int len = list->max_extent < statbuf->st_size ?  list->max_extent : statbuf->st_size;
 #ifdef HAVE_MMAP
             data = (char*) mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 );
 #else
-            /*
-             * FIXME: Can g_alloca() be used here? It's very fast, but is it safe?
-             * Actually, we can allocate a block of memory with the size of mime_cache_max_extent,
-             * then we don't need to  do dynamic allocation/free every time, but multi-threading
-             * will be a nightmare, so...
-             */
-            /* try to lock the common buffer */
-            if( G_LIKELY( G_TRYLOCK( mime_magic_buf ) ) )
-                data = mime_magic_buf;
-            else /* the buffer is in use, allocate new one */
-                data = g_malloc( len );
-
+            data = get_magic_buf( len );
             len = read( fd, data, len );
-
             if( G_UNLIKELY( len == -1 ) )
-            {
-                if( G_LIKELY( data == mime_magic_buf ) )
-                    G_UNLOCK( mime_magic_buf );
-                else
-                    g_free( data );
                 data = (void*)-1;
-            }
 #endif
             if( data != (void*)-1 )
             {
                 int i;
-                for( i = 0; ! type && i < n_caches; ++i )
-                    type = mime_cache_lookup_magic( caches[i], data, len );
+                for( i = 0; ! type && i < list->n_caches; ++i )
+                    type = mime_cache_lookup_magic( list->caches[i], data, len );
 
                 /* Check for executable file */
                 if( ! type && g_file_test( filepath, G_FILE_TEST_IS_EXECUTABLE ) )
@@ -230,13 +455,9 @@ const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, c
 
 #ifdef HAVE_MMAP
                 munmap ( (char*)data, len );
-#else
-                if( G_LIKELY( data == mime_magic_buf ) )
-                    G_UNLOCK( mime_magic_buf );  /* unlock the common buffer */
-                else /* we use our own buffer */
-                    g_free( data );
 #endif
             }
+            cache_list_unref( list );
             close( fd );
         }
     }
@@ -294,15 +515,11 @@ static char* parse_xml_desc( const char* buf, size_t len, const char* locale )
     return g_strndup( eng_comment, eng_comment_len );
 }
 
-static char* _mime_type_get_desc( const char* type, const char* data_dir, const char* locale )
+static char* read_xml_desc( const char* file_path, const char* locale )
 {
     int fd;
     struct stat statbuf;
-    char *buffer, *_locale, *desc;
-    char file_path[ 256 ];
-
-    /* FIXME: This path shouldn't be hard-coded. */
-    g_snprintf( file_path, 256, "%s/mime/%s.xml", data_dir, type );
+    char *buffer, *desc;
 
     fd = open ( file_path, O_RDONLY, 0 );
     if ( G_UNLIKELY( fd == -1 ) )
@@ -326,18 +543,7 @@ static char* _mime_type_get_desc( const char* type, const char* data_dir, const
     if ( G_UNLIKELY( buffer == (void*)-1 ) )
         return NULL;
 
-    _locale = NULL;
-    if( ! locale )
-    {
-        const char* const * langs = g_get_language_names();
-        char* dot = strchr( langs[0], '.' );
-        if( dot )
-            locale = _locale = g_strndup( langs[0], (size_t)(dot - langs[0]) );
-        else
-            locale = langs[0];
-    }
     desc = parse_xml_desc( buffer, statbuf.st_size, locale );
-    g_free( _locale );
 
 #ifdef HAVE_MMAP
     munmap ( buffer, statbuf.st_size );
@@ -347,6 +553,185 @@ static char* _mime_type_get_desc( const char* type, const char* data_dir, const
     return desc;
 }
 
+/* The locale used for descriptions when no locale is specified */
+static char* get_default_locale()
+{
+    const char* const * langs = g_get_language_names();
+    char* dot = strchr( langs[0], '.' );
+    if( dot )
+        return g_strndup( langs[0], (size_t)(dot - langs[0]) );
+    return g_strdup( langs[0] );
+}
+
+static char* _mime_type_get_desc( const char* type, const char* data_dir, const char* locale )
+{
+    char *_locale = NULL, *desc;
+    char file_path[ 256 ];
+
+    /* FIXME: This path shouldn't be hard-coded. */
+    g_snprintf( file_path, 256, "%s/mime/%s.xml", data_dir, type );
+
+    if( ! locale )
+        locale = _locale = get_default_locale();
+    desc = read_xml_desc( file_path, locale );
+    g_free( _locale );
+    return desc;
+}
+
+/* Add descriptions of the mime-types defined in data_dir to the index */
+static void desc_index_add_dir( GHashTable* index, const char* data_dir, const char* locale )
+{
+    char *mime_dir_path, *media_dir_path, *file_path;
+    const char *media, *name;
+    GDir *mime_dir, *media_dir;
+
+    mime_dir_path = g_build_filename( data_dir, "mime", NULL );
+    mime_dir = g_dir_open( mime_dir_path, 0, NULL );
+    if( ! mime_dir )
+    {
+        g_free( mime_dir_path );
+        return;
+    }
+    while( (media = g_dir_read_name( mime_dir )) )
+    {
+        if( 0 == strcmp( media, "packages" ) )
+            continue;
+        media_dir_path = g_build_filename( mime_dir_path, media, NULL );
+        /* other files in mime dir, such as "globs", fail here */
+        media_dir = g_dir_open( media_dir_path, 0, NULL );
+        if( media_dir )
+        {
+            while( (name = g_dir_read_name( media_dir )) )
+            {
+                char* type, *desc;
+                if( ! g_str_has_suffix( name, ".xml" ) )
+                    continue;
+                type = g_strdup_printf( "%s/%.*s", media, (int)strlen(name) - 4, name );
+                /* the dirs with higher priority are added first */
+                if( g_hash_table_lookup( index, type ) )
+                {
+                    g_free( type );
+                    continue;
+                }
+                file_path = g_build_filename( media_dir_path, name, NULL );
+                desc = read_xml_desc( file_path, locale );
+                g_free( file_path );
+                if( desc )
+                    g_hash_table_insert( index, type, desc );
+                else
+                    g_free( type );
+            }
+            g_dir_close( media_dir );
+        }
+        g_free( media_dir_path );
+    }
+    g_dir_close( mime_dir );
+    g_free( mime_dir_path );
+}
+
+/*
+ * The saved index is valid as long as the locale is the same, and
+ * the mime caches aren't changed by update-mime-database.
+ */
+static char* get_desc_index_stamp( const char* locale )
+{
+    const gchar* const * dir;
+    GString* stamp = g_string_new( locale );
+    struct stat statbuf;
+    char* path;
+
+    for( dir = g_get_system_data_dirs(); ; ++dir )
+    {
+        /* system data dirs, and then user data dir, in the order they are searched */
+        path = g_build_filename( *dir ? *dir : g_get_user_data_dir(), "mime/mime.cache", NULL );
+        if( stat( path, &statbuf ) == 0 )
+            g_string_append_printf( stamp, ";%lu", (gulong)statbuf.st_mtime );
+        else
+            g_string_append( stamp, ";0" );
+        g_free( path );
+        if( ! *dir )
+            break;
+    }
+    return g_string_free( stamp, FALSE );
+}
+
+static gboolean desc_index_load( GHashTable* index, const char* path, const char* stamp )
+{
+    char *data, *line, *next, *tab;
+    gsize len = strlen( stamp );
+
+    if( ! g_file_get_contents( path, &data, NULL, NULL ) )
+        return FALSE;
+    if( strncmp( data, stamp, len ) || data[ len ] != '\n' )
+    {
+        g_free( data );
+        return FALSE;
+    }
+    for( line = data + len + 1; *line; line = next )
+    {
+        next = strchr( line, '\n' );
+        if( next )
+            *next++ = '\0';
+        else
+            next = line + strlen( line );
+        if( (tab = strchr( line, '\t' )) )
+        {
+            *tab = '\0';
+            g_hash_table_insert( index, g_strdup( line ), g_strcompress( tab + 1 ) );
+        }
+    }
+    g_free( data );
+    return TRUE;
+}
+
+static void append_desc( const char* type, const char* desc, GString* data )
+{
+    char* escaped = g_strescape( desc, NULL );
+    g_string_append_printf( data, "%s\t%s\n", type, escaped );
+    g_free( escaped );
+}
+
+static void desc_index_save( GHashTable* index, const char* path, const char* stamp )
+{
+    GString* data = g_string_new( stamp );
+    char* dir;
+
+    g_string_append_c( data, '\n' );
+    g_hash_table_foreach( index, (GHFunc)append_desc, data );
+    dir = g_path_get_dirname( path );
+    g_mkdir_with_parents( dir, 0700 );
+    g_free( dir );
+    g_file_set_contents( path, data->str, data->len, NULL );
+    g_string_free( data, TRUE );
+}
+
+/* Should be called with mime_index locked */
+static void desc_index_build()
+{
+    const gchar* const * dir;
+    char *locale, *stamp, *name, *path;
+
+    desc_index = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+    locale = get_default_locale();
+    stamp = get_desc_index_stamp( locale );
+    name = g_strconcat( "mime-desc-", locale, NULL );
+    g_strdelimit( name, "/", '_' );
+    path = g_build_filename( g_get_user_cache_dir(), "pcmanfm", name, NULL );
+    g_free( name );
+
+    if( ! desc_index_load( desc_index, path, stamp ) )
+    {
+        for( dir = g_get_system_data_dirs(); *dir; ++dir )
+            desc_index_add_dir( desc_index, *dir, locale );
+        /* see the FIXME in mime_type_get_desc() */
+        desc_index_add_dir( desc_index, g_get_user_data_dir(), locale );
+        desc_index_save( desc_index, path, stamp );
+    }
+    g_free( path );
+    g_free( stamp );
+    g_free( locale );
+}
+
 /*
  * Get human-readable description of the mime-type
  * If locale is NULL, current locale will be used.
@@ -357,6 +742,17 @@ char* mime_type_get_desc( const char* type, const char* locale )
     char* desc;
     const gchar* const * dir;
 
+    if( G_LIKELY( ! locale ) )
+    {
+        G_LOCK( mime_index );
+        if( G_UNLIKELY( ! desc_index ) )
+            desc_index_build();
+        desc = g_strdup( (const char*)g_hash_table_lookup( desc_index, type ) );
+        G_UNLOCK( mime_index );
+        if( G_LIKELY( desc ) )
+            return desc;
+    }
+
     dir = g_get_system_data_dirs();
     for( ; *dir; ++dir )
     {
@@ -376,6 +772,23 @@ char* mime_type_get_desc( const char* type, const char* locale )
     return desc;
 }
 
+/* Free the indices. They will be built again when needed. */
+void mime_index_clear()
+{
+    G_LOCK( mime_index );
+    if( desc_index )
+    {
+        g_hash_table_destroy( desc_index );
+        desc_index = NULL;
+    }
+    if( generic_icon_index )
+    {
+        g_hash_table_destroy( generic_icon_index );
+        generic_icon_index = NULL;
+    }
+    G_UNLOCK( mime_index );
+}
+
 void mime_type_finalize()
 {
 /*
@@ -431,6 +844,76 @@ void mime_type_init()
 //    table = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, (GDestroyNotify)mime_type_unref );
 }
 
+/* Take a reference of the current list of mime caches */
+MimeCacheList* cache_list_get()
+{
+    MimeCacheList* list;
+
+    G_LOCK( cache_list );
+    list = G_LIKELY( cache_list ) ? cache_list : &empty_cache_list;
+    g_atomic_int_inc( &list->n_ref );
+    G_UNLOCK( cache_list );
+    return list;
+}
+
+void cache_list_unref( MimeCacheList* list )
+{
+    int i;
+
+    if( ! g_atomic_int_dec_and_test( &list->n_ref ) )
+        return;
+
+    for( i = 0; i < list->n_caches; ++i )
+    {
+        /* the caches not reloaded are shared with other lists */
+        if( g_atomic_int_dec_and_test( &list->caches[i]->n_ref ) )
+            mime_cache_free( list->caches[i] );
+    }
+    g_slice_free1( list->n_caches * sizeof(MimeCache*), list->caches );
+    if( list->name_cache )
+    {
+        g_hash_table_destroy( list->name_cache );
+        g_hash_table_destroy( list->suffix_cache );
+    }
+    g_slice_free( MimeCacheList, list );
+}
+
+static MimeCacheList* cache_list_new( guint n_caches )
+{
+    MimeCacheList* list = g_slice_new0( MimeCacheList );
+    list->n_ref = 1;
+    list->n_caches = n_caches;
+    list->caches = (MimeCache**)g_slice_alloc( n_caches * sizeof(MimeCache*) );
+    return list;
+}
+
+/* Make the list current. The readers still holding the old list can go on using it. */
+static void cache_list_set( MimeCacheList* list )
+{
+    MimeCacheList* old;
+    int i;
+
+    if( list )
+    {
+        list->max_extent = 0;
+        for( i = 0; i < list->n_caches; ++i )
+        {
+            if( list->caches[i]->magic_max_extent > list->max_extent )
+                list->max_extent = list->caches[i]->magic_max_extent;
+        }
+    }
+    mime_cache_max_extent = list ? list->max_extent : 0;
+
+    G_LOCK( cache_list );
+    old = cache_list;
+    cache_list = list;
+    G_UNLOCK( cache_list );
+
+    if( retired_cache_list )
+        cache_list_unref( retired_cache_list );
+    retired_cache_list = old;
+}
+
 /* load all mime.cache files on the system,
  * including /usr/share/mime/mime.cache,
  * /usr/local/share/mime/mime.cache,
@@ -441,67 +924,72 @@ void mime_cache_load_all()
     int i;
     const char filename[] = "/mime/mime.cache";
     char* path;
+    MimeCacheList* list;
 
     dirs = g_get_system_data_dirs();
-    n_caches = g_strv_length( (char**)dirs ) + 1;
-    caches = (MimeCache**)g_slice_alloc( n_caches * sizeof(MimeCache*) );
+    list = cache_list_new( g_strv_length( (char**)dirs ) + 1 );
 
     path = g_build_filename( g_get_user_data_dir(), filename, NULL );
-    caches[0] = mime_cache_new( path );
+    list->caches[0] = mime_cache_new( path );
+    list->caches[0]->n_ref = 1;
     g_free( path );
-    if( caches[0]->magic_max_extent > mime_cache_max_extent )
-        mime_cache_max_extent = caches[0]->magic_max_extent;
 
-    for( i = 1; i < n_caches; ++i )
+    for( i = 1; i < list->n_caches; ++i )
     {
         path = g_build_filename( dirs[i - 1], filename, NULL );
-        caches[ i ] = mime_cache_new( path );
+        list->caches[ i ] = mime_cache_new( path );
+        list->caches[ i ]->n_ref = 1;
         g_free( path );
-        if( caches[i]->magic_max_extent > mime_cache_max_extent )
-            mime_cache_max_extent = caches[i]->magic_max_extent;
     }
-    mime_magic_buf = g_malloc( mime_cache_max_extent );
-    return ;
+    cache_list_set( list );
 }
 
 /* free all mime.cache files on the system */
 void mime_cache_free_all()
 {
-    mime_cache_foreach( (GFunc)mime_cache_free, NULL );
-    g_slice_free1( n_caches * sizeof(MimeCache*), caches );
-    n_caches = 0;
-    caches = NULL;
-    mime_cache_max_extent = 0;
-
-    g_free( mime_magic_buf );
-    mime_magic_buf = NULL;
+    mime_index_clear();
+    cache_list_set( NULL );
+    /* free the list replaced just now */
+    cache_list_set( NULL );
 }
 
 /* Iterate through all mime caches */
 void mime_cache_foreach( GFunc func, gpointer user_data )
 {
     int i;
-    for( i = 0; i < n_caches; ++i )
-        func( caches[i], user_data );
+    for( i = 0; cache_list && i < cache_list->n_caches; ++i )
+        func( cache_list->caches[i], user_data );
 }
 
+/*
+ * Replace the cache with a newly loaded one. Instead of changing the
+ * cache in place, a new list of caches is made current, so the lookups
+ * running in other threads are not affected.
+ */
 gboolean mime_cache_reload( MimeCache* cache )
 {
+    MimeCacheList* list;
+    gboolean ret = FALSE;
     int i;
-    gboolean ret = mime_cache_load( cache, cache->file_path );
-    /* recalculate max magic extent */
-    for( i = 0; i < n_caches; ++i )
-    {
-        if( caches[i]->magic_max_extent > mime_cache_max_extent )
-            mime_cache_max_extent = caches[i]->magic_max_extent;
-    }
 
-    G_LOCK( mime_magic_buf );
-
-    mime_magic_buf = g_realloc( mime_magic_buf, mime_cache_max_extent );
-
-    G_UNLOCK( mime_magic_buf );
+    if( G_UNLIKELY( ! cache_list ) )
+        return FALSE;
 
+    list = cache_list_new( cache_list->n_caches );
+    for( i = 0; i < list->n_caches; ++i )
+    {
+        if( cache_list->caches[i] == cache )
+        {
+            list->caches[i] = mime_cache_new( cache->file_path );
+            ret = ( list->caches[i]->buffer != NULL );
+        }
+        else
+            list->caches[i] = cache_list->caches[i];
+        g_atomic_int_inc( &list->caches[i]->n_ref );
+    }
+    cache_list_set( list );
+    /* the descriptions and generic icons might be changed, too */
+    mime_index_clear();
     return ret;
 }
 
@@ -596,23 +1084,31 @@ gboolean mime_type_is_subclass( const char* type, const char* parent )
     const char** parents = NULL;
     const char** p;
 
+    MimeCacheList* list;
+    gboolean ret = FALSE;
+
     /* special case, the type specified is identical to the parent type. */
     if( G_UNLIKELY( 0 == strcmp(type, parent) ) )
         return TRUE;
 
-    for( i = 0; i < n_caches; ++i )
+    list = cache_list_get();
+    for( i = 0; ! ret && i < list->n_caches; ++i )
     {
-        parents = mime_cache_lookup_parents( caches[i], type );
+        parents = mime_cache_lookup_parents( list->caches[i], type );
         if( parents )
         {
             for( p = parents; *p; ++p )
             {
                 if( 0 == strcmp( parent, *p ) )
-                    return TRUE;
+                {
+                    ret = TRUE;
+                    break;
+                }
             }
         }
     }
-    return FALSE;
+    cache_list_unref( list );
+    return ret;
 }
 
 /*
@@ -625,10 +1121,11 @@ char** mime_type_get_parents( const char* type )
     const char** parents = NULL;
     const char** p;
     GArray* ret = g_array_sized_new( TRUE, TRUE, sizeof(char*), 5 );
+    MimeCacheList* list = cache_list_get();
 
-    for( i = 0; i < n_caches; ++i )
+    for( i = 0; i < list->n_caches; ++i )
     {
-        parents = mime_cache_lookup_parents( caches[i], type );
+        parents = mime_cache_lookup_parents( list->caches[i], type );
         if( parents )
         {
             for( p = parents; *p; ++p )
@@ -638,6 +1135,7 @@ char** mime_type_get_parents( const char* type )
             }
         }
     }
+    cache_list_unref( list );
     return (char**)g_array_free( ret, (0 == ret->len) );
 }
 
@@ -651,10 +1149,11 @@ char** mime_type_get_alias( const char* type )
     const char** alias = NULL;
     const char** p;
     GArray* ret = g_array_sized_new( TRUE, TRUE, sizeof(char*), 5 );
+    MimeCacheList* list = cache_list_get();
 
-    for( i = 0; i < n_caches; ++i )
+    for( i = 0; i < list->n_caches; ++i )
     {
-        alias = (const char **) mime_cache_lookup_alias( caches[i], type );
+        alias = (const char **) mime_cache_lookup_alias( list->caches[i], type );
         if( alias )
         {
             for( p = alias; *p; ++p )
@@ -664,6 +1163,7 @@ char** mime_type_get_alias( const char* type )
             }
         }
     }
+    cache_list_unref( list );
     return (char**)g_array_free( ret, (0 == ret->len) );
 }
 
@@ -671,74 +1171,51 @@ char** mime_type_get_alias( const char* type )
  * search generic-icons file
  * (the returned string should be freed when no longer used)
  */
-char* mime_type_get_generic_icon( const char* type )
+/* Should be called with mime_index locked */
+static void generic_icon_index_build()
 {
     const gchar* const * dir;
-    char file_path[ 256 ], *buffer;
-    int fd;
-    struct stat statbuf;
-    const char* generic_icon = NULL;
-    size_t type_len, generic_icon_len;
-    gchar *type_str;
-
-    type_len = strlen(type);
-    type_str = g_strndup(type, type_len + 1);
-    type_str[type_len] = ':';
+    char *path, *data, *line, *next, *sep;
 
-    dir = g_get_system_data_dirs();
-    for( ; *dir; ++dir )
+    generic_icon_index = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+    for( dir = g_get_system_data_dirs(); *dir; ++dir )
     {
         /* FIXME: This path shouldn't be hard-coded. */
-        g_snprintf( file_path, 256, "%s/mime/generic-icons", *dir );
-
-        fd = open ( file_path, O_RDONLY, 0 );
-        if ( G_UNLIKELY( fd == -1 ) )
-            continue;
-        if( G_UNLIKELY( fstat ( fd, &statbuf ) == -1 ) )
+        path = g_build_filename( *dir, "mime/generic-icons", NULL );
+        if( g_file_get_contents( path, &data, NULL, NULL ) )
         {
-            close( fd );
-            continue;
-        }
-#ifdef HAVE_MMAP
-        buffer = (char*)mmap( NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0 );
-#else
-        buffer = (char*)g_malloc( statbuf.st_size );
-        if( read( fd, buffer, statbuf.st_size ) == -1 )
-        {
-            g_free( buffer );
-            buffer = (char*)-1;
-        }
-#endif
-        close( fd );
-        if ( G_UNLIKELY( buffer == (void*)-1 ) )
-            continue;
-
-        if (( generic_icon = g_strstr_len( buffer, statbuf.st_size, type_str ) ))
-        {
-            generic_icon += type_len + 1;
-            generic_icon_len = 0;
-            if ( generic_icon + 1 < buffer + statbuf.st_size )
+            /* each line is "mime-type:icon-name" */
+            for( line = data; *line; line = next )
             {
-                char *eol;
-                if (( eol = g_strstr_len( generic_icon, buffer + statbuf.st_size - generic_icon, "\n" ) ))
-                   generic_icon_len = eol - generic_icon;
+                next = strchr( line, '\n' );
+                if( next )
+                    *next++ = '\0';
+                else
+                    next = line + strlen( line );
+                sep = strchr( line, ':' );
+                if( ! sep || ! sep[1] || line[0] == '#' )
+                    continue;
+                *sep = '\0';
+                /* the dirs with higher priority are added first */
+                if( ! g_hash_table_lookup( generic_icon_index, line ) )
+                    g_hash_table_insert( generic_icon_index, g_strdup( line ), g_strdup( sep + 1 ) );
             }
-            if ( generic_icon_len == 0 ) generic_icon = NULL;
+            g_free( data );
         }
-
-#ifdef HAVE_MMAP
-        munmap ( buffer, statbuf.st_size );
-#else
-        g_free( buffer );
-#endif
-
-        g_free( type_str );
-
-        if ( generic_icon )
-            return g_strndup( generic_icon, generic_icon_len );
+        g_free( path );
     }
+}
 
-    return NULL;
+char* mime_type_get_generic_icon( const char* type )
+{
+    char* icon;
+
+    G_LOCK( mime_index );
+    if( G_UNLIKELY( ! generic_icon_index ) )
+        generic_icon_index_build();
+    icon = g_strdup( (const char*)g_hash_table_lookup( generic_icon_index, type ) );
+    G_UNLOCK( mime_index );
+    return icon;
 }
 
 /*
@@ -746,6 +1223,11 @@ char* mime_type_get_generic_icon( const char* type )
  */
 MimeCache** mime_type_get_caches( int* n )
 {
-    *n = n_caches;
-    return caches;
+    if( G_UNLIKELY( ! cache_list ) )
+    {
+        *n = 0;
+        return NULL;
+    }
+    *n = cache_list->n_caches;
+    return cache_list->caches;
 }
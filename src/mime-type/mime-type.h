@@ -63,6 +63,9 @@ void mime_type_finalize();
 */
 const char* mime_type_get_by_filename( const char* filename, struct stat* statbuf );
 
+/* Number of mime_type_get_by_filename() calls answered with memoized results, and the others */
+void mime_type_get_filename_cache_stats( guint* hits, guint* misses );
+
 /*
  * Get mime-type info of the specified file (slow, but more accurate):
  * To determine the mime-type of the file, mime_type_get_by_filename() is
@@ -78,6 +81,15 @@ const char* mime_type_get_by_filename( const char* filename, struct stat* statbu
 */
 const char* mime_type_get_by_file( const char* filepath, struct stat* statbuf, const char* basename );
 
+/*
+ * Same as mime_type_get_by_file(), but the content of the file is never read.
+ * If the mime-type can only be determined by the content, XDG_MIME_TYPE_UNKNOWN
+ * is returned and *need_magic is set to TRUE. The caller can call
+ * mime_type_get_by_file() for the file later to get the accurate mime-type.
+*/
+const char* mime_type_get_by_file_fast( const char* filepath, struct stat* statbuf,
+                                        const char* basename, gboolean* need_magic );
+
 gboolean mime_type_is_text_file( const char * file_path, const char * mime_type );
 
 gboolean mime_type_is_executable_file( const char * file_path, const char * mime_type );
@@ -131,6 +143,8 @@ char* mime_type_get_generic_icon( const char* type );
 
 /*
  * Get mime caches
+ * The caches are replaced when reloaded, so the returned array should only be
+ * used in the main thread, and should not be kept after the caches are reloaded.
  */
 MimeCache** mime_type_get_caches( int* n );
 
@@ -825,6 +825,76 @@ static PtkDirTreeNode* find_node( PtkDirTreeNode* parent, const char* name )
     return NULL;
 }
 
+static void prepend_key( gpointer key, gpointer value, GSList** keys )
+{
+    *keys = g_slist_prepend( *keys, key );
+}
+
+/*
+ * Compare the children of the node with the dir on the disk, and add or
+ * remove the sub dirs which were changed. Used when events were lost.
+ */
+static void ptk_dir_tree_rescan_node( PtkDirTree* tree,
+                                      PtkDirTreeNode* node,
+                                      const char* path )
+{
+    GDir *dir;
+    GHashTable* sub_dirs;   /* name => full path */
+    GSList *new_dirs = NULL, *l;
+    PtkDirTreeNode *child, *next;
+    const char* name;
+    char* file_path;
+
+    dir = g_dir_open( path, 0, NULL );
+    if( ! dir )
+        return;
+    sub_dirs = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+    while( (name = g_dir_read_name( dir )) )
+    {
+        file_path = g_build_filename( path, name, NULL );
+        if( g_file_test( file_path, G_FILE_TEST_IS_DIR ) )
+            g_hash_table_insert( sub_dirs, g_strdup( name ), file_path );
+        else
+            g_free( file_path );
+    }
+    g_dir_close( dir );
+
+    /* remove the dirs which are gone, and forget the ones we already have */
+    for( child = node->children; child; child = next )
+    {
+        next = child->next;
+        if( ! child->file )
+            continue;
+        if( ! g_hash_table_remove( sub_dirs, vfs_file_info_get_name( child->file ) ) )
+            ptk_dir_tree_delete_child( tree, child );
+    }
+
+    /* add the new ones */
+    g_hash_table_foreach( sub_dirs, (GHFunc)prepend_key, &new_dirs );
+    for( l = new_dirs; l; l = l->next )
+    {
+        name = (const char*)l->data;
+        ptk_dir_tree_insert_child( tree, node,
+                                   (char*)g_hash_table_lookup( sub_dirs, name ),
+                                   name );
+    }
+    g_slist_free( new_dirs );
+    g_hash_table_destroy( sub_dirs );
+
+    /* remove the place holder if there are real children now */
+    if( node->n_children > 1 )
+    {
+        for( child = node->children; child; child = child->next )
+        {
+            if( ! child->file )
+            {
+                ptk_dir_tree_delete_child( tree, child );
+                break;
+            }
+        }
+    }
+}
+
 void on_file_monitor_event ( VFSFileMonitor* fm,
                              VFSFileMonitorEvent event,
                              const char* file_name,
@@ -891,6 +961,10 @@ void on_file_monitor_event ( VFSFileMonitor* fm,
             gtk_tree_path_free( tree_path );
         }
         break;
+    case VFS_FILE_MONITOR_OVERFLOW:
+        /* some events were lost, check all the sub dirs again */
+        ptk_dir_tree_rescan_node( node->tree, node, fm->path );
+        break;
     }
     GDK_THREADS_LEAVE();
 }
@@ -83,6 +83,10 @@ static void on_dir_file_listed( VFSDir* dir,
                                              gboolean is_cancelled,
                                              PtkFileBrowser* file_browser );
 
+static void on_dir_file_listed_partial( VFSDir* dir,
+                                        GList* files,
+                                        PtkFileBrowser* file_browser );
+
 void ptk_file_browser_open_selected_files_with_app( PtkFileBrowser* file_browser,
                                                     char* app_desktop );
 
@@ -162,6 +166,9 @@ on_folder_view_scroll_scrolled ( GtkAdjustment *adjust,
                                  PtkFileBrowser* file_browser );
 #endif
 static void
+on_folder_view_scroll_changed ( GtkAdjustment *adjust,
+                                PtkFileBrowser* file_browser );
+static void
 on_dir_tree_sel_changed ( GtkTreeSelection *treesel,
                           PtkFileBrowser* file_browser );
 static void
@@ -382,11 +389,22 @@ void ptk_file_browser_class_init( PtkFileBrowserClass* klass )
 
 void ptk_file_browser_init( PtkFileBrowser* file_browser )
 {
+    GtkAdjustment* adj;
+
     file_browser->folder_view_scroll = gtk_scrolled_window_new ( NULL, NULL );
     gtk_paned_pack2 ( GTK_PANED ( file_browser ),
                       file_browser->folder_view_scroll, TRUE, TRUE );
     gtk_scrolled_window_set_policy ( GTK_SCROLLED_WINDOW ( file_browser->folder_view_scroll ),
                                      GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC );
+
+    /* The adjustments are kept when the folder view is replaced,
+     * so they tell us whenever the visible files are changed. */
+    adj = gtk_scrolled_window_get_vadjustment( GTK_SCROLLED_WINDOW ( file_browser->folder_view_scroll ) );
+    g_signal_connect( adj, "value-changed", G_CALLBACK( on_folder_view_scroll_changed ), file_browser );
+    g_signal_connect( adj, "changed", G_CALLBACK( on_folder_view_scroll_changed ), file_browser );
+    adj = gtk_scrolled_window_get_hadjustment( GTK_SCROLLED_WINDOW ( file_browser->folder_view_scroll ) );
+    g_signal_connect( adj, "value-changed", G_CALLBACK( on_folder_view_scroll_changed ), file_browser );
+    g_signal_connect( adj, "changed", G_CALLBACK( on_folder_view_scroll_changed ), file_browser );
 }
 
 void ptk_file_browser_finalize( GObject *obj )
@@ -592,12 +610,17 @@ gboolean ptk_file_browser_chdir( PtkFileBrowser* file_browser,
 
     g_signal_emit( file_browser, signals[ BEGIN_CHDIR_SIGNAL ], 0 );
 
+    file_browser->partially_listed = FALSE;
     if( vfs_dir_is_file_listed( file_browser->dir ) )
     {
         on_dir_file_listed( file_browser->dir, FALSE, file_browser );
     }
     else
+    {
         file_browser->busy = TRUE;
+        g_signal_connect( file_browser->dir, "file-listed-partial",
+                                        G_CALLBACK(on_dir_file_listed_partial), file_browser );
+    }
     g_signal_connect( file_browser->dir, "file-listed",
                                     G_CALLBACK(on_dir_file_listed), file_browser );
 
@@ -658,6 +681,46 @@ static gboolean ptk_file_browser_content_changed( PtkFileBrowser* file_browser )
     return FALSE;
 }
 
+/* Tell the model which rows are visible, so their thumbnails are loaded first */
+static gboolean on_visible_range_idle( PtkFileBrowser* file_browser )
+{
+    GtkTreePath *start = NULL, *end = NULL;
+    gboolean visible = FALSE;
+
+    gdk_threads_enter();
+    file_browser->visible_range_idle = 0;
+    if ( file_browser->file_list && GTK_WIDGET_REALIZED( file_browser->folder_view ) )
+    {
+        if ( file_browser->view_mode == PTK_FB_ICON_VIEW || file_browser->view_mode == PTK_FB_COMPACT_VIEW )
+            visible = exo_icon_view_get_visible_range( EXO_ICON_VIEW( file_browser->folder_view ),
+                                                       &start, &end );
+        else if ( file_browser->view_mode == PTK_FB_LIST_VIEW )
+            visible = gtk_tree_view_get_visible_range( GTK_TREE_VIEW( file_browser->folder_view ),
+                                                       &start, &end );
+        if ( visible && start && end )
+            ptk_file_list_set_visible_range( PTK_FILE_LIST( file_browser->file_list ),
+                                             gtk_tree_path_get_indices( start ) [ 0 ],
+                                             gtk_tree_path_get_indices( end ) [ 0 ] );
+        else
+            ptk_file_list_set_visible_range( PTK_FILE_LIST( file_browser->file_list ), -1, -1 );
+        if ( start )
+            gtk_tree_path_free( start );
+        if ( end )
+            gtk_tree_path_free( end );
+    }
+    gdk_threads_leave();
+    return FALSE;
+}
+
+void on_folder_view_scroll_changed ( GtkAdjustment *adjust,
+                                     PtkFileBrowser* file_browser )
+{
+    /* Scrolling emits lots of signals, handle them all at once */
+    if ( ! file_browser->visible_range_idle )
+        file_browser->visible_range_idle = g_idle_add( ( GSourceFunc ) on_visible_range_idle,
+                                                       file_browser );
+}
+
 static void on_folder_content_changed( VFSDir* dir, VFSFileInfo* file,
                                        PtkFileBrowser* file_browser )
 {
@@ -740,6 +803,24 @@ void ptk_file_browser_update_model( PtkFileBrowser* file_browser )
     else if ( file_browser->view_mode == PTK_FB_LIST_VIEW )
         gtk_tree_view_set_model( GTK_TREE_VIEW( file_browser->folder_view ),
                                  GTK_TREE_MODEL( list ) );
+
+    /* The new model doesn't know which rows are visible yet */
+    on_folder_view_scroll_changed( NULL, file_browser );
+}
+
+/* Show the files loaded so far while the dir is still being listed.
+ * The model is created on the first call, and the files arriving later
+ * are appended to it by PtkFileList itself. */
+void on_dir_file_listed_partial( VFSDir* dir,
+                                 GList* files,
+                                 PtkFileBrowser* file_browser )
+{
+    if( ! file_browser->partially_listed )
+    {
+        file_browser->partially_listed = TRUE;
+        ptk_file_browser_update_model( file_browser );
+    }
+    g_signal_emit( file_browser, signals[ CONTENT_CHANGE_SIGNAL ], 0 );
 }
 
 void on_dir_file_listed( VFSDir* dir,
@@ -748,6 +829,8 @@ void on_dir_file_listed( VFSDir* dir,
 {
     file_browser->n_sel_files = 0;
 
+    g_signal_handlers_disconnect_by_func( dir, on_dir_file_listed_partial, file_browser );
+
     if ( G_LIKELY( ! is_cancelled ) )
     {
         g_signal_connect( dir, "file-created",
@@ -757,7 +840,11 @@ void on_dir_file_listed( VFSDir* dir,
         g_signal_connect( dir, "file-changed",
                           G_CALLBACK( on_folder_content_changed ), file_browser );
     }
-    ptk_file_browser_update_model( file_browser );
+
+    /* The model is already up to date if it's created by on_dir_file_listed_partial() */
+    if( ! file_browser->partially_listed )
+        ptk_file_browser_update_model( file_browser );
+    file_browser->partially_listed = FALSE;
 
     file_browser->busy = FALSE;
 
@@ -76,6 +76,7 @@ struct _PtkFileBrowser
     gboolean show_hidden_files : 1;
     gboolean busy : 1;
     gboolean pending_drag_status : 1;
+    gboolean partially_listed : 1; /* the model was created before the dir is fully listed */
     dev_t drag_source_dev;
 
     GtkWidget* side_pane;
@@ -90,6 +91,7 @@ struct _PtkFileBrowser
 
     glong prev_update_time;
     guint update_timeout;
+    guint visible_range_idle;
 };
 
 typedef enum{
@@ -15,6 +15,7 @@
 
 
 #include "ptk-file-icon-renderer.h"
+#include "vfs-utils.h"  /* for vfs_is_cached_icon */
 
 static void
 ptk_file_icon_renderer_init ( PtkFileIconRenderer *renderer );
@@ -66,6 +67,35 @@ static gpointer parent_class;
 
 static GdkPixbuf* link_icon = NULL;
 
+#if GTK_CHECK_VERSION( 2, 8, 0 )
+/*
+ * Icons are painted from cairo surfaces which are already composited with
+ * the link emblem and colorized for the selection state, so painting an
+ * item doesn't need to convert and composite its pixbuf every time.
+ * The surfaces are created like the window, so they are kept in the X
+ * server and painted without uploading the pixels again.
+ * Only the icons shared by many files are cached this way, not thumbnails.
+ * The surfaces are attached to the pixbuf they are created from, so they
+ * go away with it when the icon size or icon theme is changed.
+ */
+typedef struct _IconSurface
+{
+    cairo_surface_t* surface;
+    GdkScreen* screen;  /* screen of the window it's created for */
+    guint is_link : 1;
+    guint tinted : 1;
+    guint16 red, green, blue;  /* color of the tint */
+}IconSurface;
+
+/* max number of the cached variants of a pixbuf */
+#define MAX_ICON_SURFACES   6
+
+/* the link emblem is drawn at (-2, -2) relative to the icon */
+#define LINK_ICON_OFFSET    2
+
+static GQuark icon_surfaces_quark = 0;
+#endif
+
 /* GdkPixbuf RGBA C-Source image dump */
 #ifdef __SUNPRO_C
 #pragma align 4 (link_icon_data)
@@ -161,6 +191,11 @@ ptk_file_icon_renderer_get_type ( void )
 static void
 ptk_file_icon_renderer_init ( PtkFileIconRenderer *renderer )
 {
+#if GTK_CHECK_VERSION( 2, 8, 0 )
+    if ( G_UNLIKELY( 0 == icon_surfaces_quark ) )
+        icon_surfaces_quark = g_quark_from_static_string( "ptk-icon-surfaces" );
+#endif
+
     if ( !link_icon )
     {
         link_icon = gdk_pixbuf_new_from_inline(
@@ -365,6 +400,107 @@ create_colorized_pixbuf ( GdkPixbuf *src,
 }
 
 
+#if GTK_CHECK_VERSION( 2, 8, 0 )
+static void icon_surfaces_free( GSList* surfaces )
+{
+    GSList* l;
+    for ( l = surfaces; l; l = l->next )
+    {
+        IconSurface* ent = ( IconSurface* ) l->data;
+        cairo_surface_destroy( ent->surface );
+        g_slice_free( IconSurface, ent );
+    }
+    g_slist_free( surfaces );
+}
+
+/* target is the cairo context of the window the surface is painted to */
+static cairo_surface_t* create_icon_surface( cairo_t* target,
+                                             GdkPixbuf* pixbuf,
+                                             gboolean is_link,
+                                             GdkColor* tint )
+{
+    cairo_surface_t* surface;
+    cairo_t* cr;
+    GdkPixbuf* colorized = NULL;
+    int offset = is_link ? LINK_ICON_OFFSET : 0;
+
+    if ( tint )
+        pixbuf = colorized = create_colorized_pixbuf( pixbuf, tint );
+
+    surface = cairo_surface_create_similar( cairo_get_target( target ),
+                                            CAIRO_CONTENT_COLOR_ALPHA,
+                                            gdk_pixbuf_get_width( pixbuf ) + offset,
+                                            gdk_pixbuf_get_height( pixbuf ) + offset );
+    cr = cairo_create( surface );
+    gdk_cairo_set_source_pixbuf( cr, pixbuf, offset, offset );
+    cairo_paint( cr );
+    if ( is_link )
+    {
+        /* the emblem is clipped by the area of the icon */
+        gdk_cairo_set_source_pixbuf( cr, link_icon, 0, 0 );
+        cairo_rectangle( cr, 0, 0,
+                         gdk_pixbuf_get_width( pixbuf ),
+                         gdk_pixbuf_get_height( pixbuf ) );
+        cairo_fill( cr );
+    }
+    cairo_destroy( cr );
+
+    if ( colorized )
+        g_object_unref( colorized );
+    return surface;
+}
+
+/*
+* The returned surface is owned by pixbuf.
+* target is the cairo context of the window on screen.
+*/
+static cairo_surface_t* get_icon_surface( cairo_t* target,
+                                          GdkScreen* screen,
+                                          GdkPixbuf* pixbuf,
+                                          gboolean is_link,
+                                          GdkColor* tint )
+{
+    GSList *surfaces, *l;
+    IconSurface* ent;
+    guint n = 0;
+
+    surfaces = ( GSList* ) g_object_get_qdata( G_OBJECT( pixbuf ), icon_surfaces_quark );
+    for ( l = surfaces; l; l = l->next, ++n )
+    {
+        ent = ( IconSurface* ) l->data;
+        if ( ent->screen == screen
+             && ent->is_link == !!is_link && ent->tinted == !!tint
+             && ( ! tint || ( ent->red == tint->red && ent->green == tint->green
+                              && ent->blue == tint->blue ) ) )
+            return ent->surface;
+    }
+
+    /* steal the list, otherwise it's freed when the new one is set */
+    g_object_steal_qdata( G_OBJECT( pixbuf ), icon_surfaces_quark );
+    if ( G_UNLIKELY( n >= MAX_ICON_SURFACES ) ) /* the style might be changed many times */
+    {
+        icon_surfaces_free( surfaces );
+        surfaces = NULL;
+    }
+
+    ent = g_slice_new0( IconSurface );
+    ent->surface = create_icon_surface( target, pixbuf, is_link, tint );
+    ent->screen = screen;
+    ent->is_link = !!is_link;
+    if ( tint )
+    {
+        ent->tinted = TRUE;
+        ent->red = tint->red;
+        ent->green = tint->green;
+        ent->blue = tint->blue;
+    }
+    surfaces = g_slist_prepend( surfaces, ent );
+    g_object_set_qdata_full( G_OBJECT( pixbuf ), icon_surfaces_quark,
+                             surfaces, ( GDestroyNotify ) icon_surfaces_free );
+    return ent->surface;
+}
+#endif
+
 /***************************************************************************
     *
     *  ptk_file_icon_renderer_render: crucial - do the rendering.
@@ -392,6 +528,9 @@ ptk_file_icon_renderer_render ( GtkCellRenderer *cell,
 #if GTK_CHECK_VERSION( 2, 8, 0 )
 
     cairo_t *cr;
+    cairo_surface_t* surface;
+    GdkColor* tint = NULL;
+    int offset;
 #endif
 
     GtkCellRendererClass* parent_renderer_class;
@@ -473,14 +612,40 @@ ptk_file_icon_renderer_render ( GtkCellRenderer *cell,
                 state = GTK_STATE_PRELIGHT;
             }
 
+#if GTK_CHECK_VERSION(2, 8, 0)
+            tint = color;
+#else
             colorized = create_colorized_pixbuf ( pixbuf,
                                                   color );
 
             pixbuf = colorized;
+#endif
         }
     }
+
+    file = PTK_FILE_ICON_RENDERER( cell )->info;
+
 #if GTK_CHECK_VERSION(2, 8, 0)
     cr = gdk_cairo_create ( window );
+    if ( ! invisible && vfs_is_cached_icon( pixbuf ) )
+    {
+        /* paint the cached composited icon in one go */
+        offset = ( file && vfs_file_info_is_symlink( file ) ) ? LINK_ICON_OFFSET : 0;
+        surface = get_icon_surface( cr, gdk_drawable_get_screen( window ),
+                                    pixbuf, offset != 0, tint );
+        cairo_set_source_surface ( cr, surface, pix_rect.x - offset, pix_rect.y - offset );
+        draw_rect.x -= offset;
+        draw_rect.y -= offset;
+        draw_rect.width += offset;
+        draw_rect.height += offset;
+        gdk_cairo_rectangle ( cr, &draw_rect );
+        cairo_fill ( cr );
+        cairo_destroy ( cr );
+        return ;
+    }
+    /* thumbnails are not shared, so they are painted directly */
+    if ( tint )
+        pixbuf = colorized = create_colorized_pixbuf ( pixbuf, tint );
     gdk_cairo_set_source_pixbuf ( cr, pixbuf, pix_rect.x, pix_rect.y );
     gdk_cairo_rectangle ( cr, &draw_rect );
     cairo_fill ( cr );
@@ -490,7 +655,6 @@ ptk_file_icon_renderer_render ( GtkCellRenderer *cell,
                       GDK_RGB_DITHER_NORMAL, 0, 0 );
 #endif
 
-    file = PTK_FILE_ICON_RENDERER( cell )->info;
     if ( file )
     {
         if ( vfs_file_info_is_symlink( file ) )
@@ -99,6 +99,12 @@ static void ptk_file_list_sort ( PtkFileList* list );
 
 static void on_thumbnail_loaded( VFSDir* dir, VFSFileInfo* file, PtkFileList* list );
 
+static void on_file_listed_partial( VFSDir* dir, GList* files, PtkFileList* list );
+
+static gint ptk_file_list_compare( gconstpointer a, gconstpointer b, gpointer user_data );
+
+static void ptk_file_list_request_thumbnail( PtkFileList* list, VFSFileInfo* file, gint row );
+
 /*
  * already declared in ptk-file-list.h
 void ptk_file_list_file_created( VFSDir* dir, VFSFileInfo* file,
@@ -173,10 +179,10 @@ GType ptk_file_list_get_type ( void )
 
 void ptk_file_list_init ( PtkFileList *list )
 {
-    list->n_files = 0;
-    list->files = NULL;
+    list->files = g_ptr_array_new();
     list->sort_order = -1;
     list->sort_col = -1;
+    list->visible_first = list->visible_last = -1;
     /* Random int to check whether an iter belongs to our model */
     list->stamp = g_random_int();
 }
@@ -243,6 +249,7 @@ void ptk_file_list_finalize ( GObject *object )
     PtkFileList *list = ( PtkFileList* ) object;
 
     ptk_file_list_set_dir( list, NULL );
+    g_ptr_array_free( list->files, TRUE );
     /* must chain up - finalize parent */
     ( * parent_class->finalize ) ( object );
 }
@@ -262,12 +269,7 @@ static void _ptk_file_list_file_changed( VFSDir* dir, VFSFileInfo* file,
     ptk_file_list_file_changed( dir, file, list );
 
     /* check if reloading of thumbnail is needed. */
-    if( vfs_file_info_is_image( file )
-        && vfs_file_info_get_size( file ) < list->max_thumbnail )
-    {
-        if( ! vfs_file_info_is_thumbnail_loaded( file, list->big_thumbnail ) )
-            vfs_thumbnail_loader_request( list->dir, file, list->big_thumbnail );
-    }
+    ptk_file_list_request_thumbnail( list, file, -1 );
 }
 
 static void _ptk_file_list_file_created( VFSDir* dir, VFSFileInfo* file,
@@ -276,12 +278,7 @@ static void _ptk_file_list_file_created( VFSDir* dir, VFSFileInfo* file,
     ptk_file_list_file_created( dir, file, list );
 
     /* check if reloading of thumbnail is needed. */
-    if( vfs_file_info_is_image( file )
-        && vfs_file_info_get_size( file ) < list->max_thumbnail )
-    {
-        if( ! vfs_file_info_is_thumbnail_loaded( file, list->big_thumbnail ) )
-            vfs_thumbnail_loader_request( list->dir, file, list->big_thumbnail );
-    }
+    ptk_file_list_request_thumbnail( list, file, -1 );
 }
 
 void ptk_file_list_set_dir( PtkFileList* list, VFSDir* dir )
@@ -298,8 +295,7 @@ void ptk_file_list_set_dir( PtkFileList* list, VFSDir* dir )
             /* cancel all possible pending requests */
             vfs_thumbnail_loader_cancel_all_requests( list->dir, list->big_thumbnail );
         }
-        g_list_foreach( list->files, (GFunc)vfs_file_info_unref, NULL );
-        g_list_free( list->files );
+        g_ptr_array_foreach( list->files, (GFunc)vfs_file_info_unref, NULL );
         g_signal_handlers_disconnect_by_func( list->dir,
                                               _ptk_file_list_file_created, list );
         g_signal_handlers_disconnect_by_func( list->dir,
@@ -308,12 +304,13 @@ void ptk_file_list_set_dir( PtkFileList* list, VFSDir* dir )
                                               _ptk_file_list_file_changed, list );
         g_signal_handlers_disconnect_by_func( list->dir,
                                               on_thumbnail_loaded, list );
+        g_signal_handlers_disconnect_by_func( list->dir,
+                                              on_file_listed_partial, list );
         g_object_unref( list->dir );
     }
 
     list->dir = dir;
-    list->files = NULL;
-    list->n_files = 0;
+    g_ptr_array_set_size( list->files, 0 );
     if( ! dir )
         return;
 
@@ -328,6 +325,9 @@ void ptk_file_list_set_dir( PtkFileList* list, VFSDir* dir )
     g_signal_connect( list->dir, "file-changed",
                       G_CALLBACK(_ptk_file_list_file_changed),
                       list );
+    g_signal_connect( list->dir, "file-listed-partial",
+                      G_CALLBACK(on_file_listed_partial),
+                      list );
 
     if( dir && dir->file_list )
     {
@@ -336,13 +336,91 @@ void ptk_file_list_set_dir( PtkFileList* list, VFSDir* dir )
             if( list->show_hidden ||
                     ((VFSFileInfo*)l->data)->disp_name[0] != '.' )
             {
-                list->files = g_list_prepend( list->files, vfs_file_info_ref( (VFSFileInfo*)l->data) );
-                ++list->n_files;
+                g_ptr_array_add( list->files, vfs_file_info_ref( (VFSFileInfo*)l->data) );
             }
         }
     }
 }
 
+/*
+ * Find the row of the file with binary search.
+ * Returns -1 if the file is not in the list.
+ */
+static gint ptk_file_list_find_index( PtkFileList* list, VFSFileInfo* file )
+{
+    VFSFileInfo** files = (VFSFileInfo**)list->files->pdata;
+    guint lo = 0, hi = list->files->len, mid, i;
+
+    while( lo < hi )
+    {
+        mid = ( lo + hi ) / 2;
+        if( ptk_file_list_compare( files[ mid ], file, list ) < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for( i = lo; i < list->files->len
+         && ptk_file_list_compare( files[ i ], file, list ) == 0; ++i )
+    {
+        if( files[ i ] == file )
+            return i;
+    }
+
+    /* The list can be out of order if a file was changed after being
+     * inserted, or if it's not sorted yet. Fall back to a linear search. */
+    for( i = 0; i < list->files->len; ++i )
+    {
+        if( files[ i ] == file )
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Get the row index of the iter.
+ * The index cached in the iter is outdated if rows were inserted or
+ * deleted before it. Locate the file and update the iter in this case.
+ */
+static gint ptk_file_list_iter_get_index( PtkFileList* list, GtkTreeIter* iter )
+{
+    guint i = GPOINTER_TO_UINT( iter->user_data );
+    gint n;
+
+    if( G_LIKELY( i < list->files->len
+                  && g_ptr_array_index( list->files, i ) == iter->user_data2 ) )
+        return i;
+
+    n = ptk_file_list_find_index( list, (VFSFileInfo*)iter->user_data2 );
+    if( n >= 0 )
+        iter->user_data = GUINT_TO_POINTER( n );
+    return n;
+}
+
+/* Position where the file should be inserted to keep the list sorted */
+static guint ptk_file_list_find_insert_pos( PtkFileList* list, VFSFileInfo* file )
+{
+    VFSFileInfo** files = (VFSFileInfo**)list->files->pdata;
+    guint lo = 0, hi = list->files->len, mid;
+
+    while( lo < hi )
+    {
+        mid = ( lo + hi ) / 2;
+        if( ptk_file_list_compare( files[ mid ], file, list ) <= 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void ptk_file_list_set_iter( PtkFileList* list, GtkTreeIter* iter, guint i )
+{
+    iter->stamp = list->stamp;
+    iter->user_data  = GUINT_TO_POINTER( i );   /* cached row index */
+    iter->user_data2 = g_ptr_array_index( list->files, i );
+    iter->user_data3 = NULL;   /* unused */
+}
+
 GtkTreeModelFlags ptk_file_list_get_flags ( GtkTreeModel *tree_model )
 {
     g_return_val_if_fail ( PTK_IS_FILE_LIST( tree_model ), ( GtkTreeModelFlags ) 0 );
@@ -368,7 +446,6 @@ gboolean ptk_file_list_get_iter ( GtkTreeModel *tree_model,
 {
     PtkFileList *list;
     gint *indices, n, depth;
-    GList* l;
 
     g_assert(PTK_IS_FILE_LIST(tree_model));
     g_assert(path!=NULL);
@@ -383,18 +460,10 @@ gboolean ptk_file_list_get_iter ( GtkTreeModel *tree_model,
 
     n = indices[0]; /* the n-th top level row */
 
-    if ( n >= list->n_files || n < 0 )
+    if ( n >= list->files->len || n < 0 )
         return FALSE;
 
-    l = g_list_nth( list->files, n );
-
-    g_assert(l != NULL);
-
-    /* We simply store a pointer in the iter */
-    iter->stamp = list->stamp;
-    iter->user_data  = l;
-    iter->user_data2 = l->data;
-    iter->user_data3 = NULL;   /* unused */
+    ptk_file_list_set_iter( list, iter, n );
 
     return TRUE;
 }
@@ -403,18 +472,19 @@ GtkTreePath *ptk_file_list_get_path ( GtkTreeModel *tree_model,
                                       GtkTreeIter *iter )
 {
     GtkTreePath* path;
-    GList* l;
+    gint i;
     PtkFileList* list = PTK_FILE_LIST(tree_model);
 
     g_return_val_if_fail (list, NULL);
     g_return_val_if_fail (iter->stamp == list->stamp, NULL);
     g_return_val_if_fail (iter != NULL, NULL);
-    g_return_val_if_fail (iter->user_data != NULL, NULL);
+    g_return_val_if_fail (iter->user_data2 != NULL, NULL);
 
-    l = (GList*) iter->user_data;
+    i = ptk_file_list_iter_get_index( list, iter );
+    g_return_val_if_fail (i >= 0, NULL);
 
     path = gtk_tree_path_new();
-    gtk_tree_path_append_index(path, g_list_index(list->files, l->data) );
+    gtk_tree_path_append_index(path, i );
     return path;
 }
 
@@ -423,7 +493,6 @@ void ptk_file_list_get_value ( GtkTreeModel *tree_model,
                                gint column,
                                GValue *value )
 {
-    GList* l;
     PtkFileList* list = PTK_FILE_LIST(tree_model);
     VFSFileInfo* info;
     GdkPixbuf* icon;
@@ -434,10 +503,8 @@ void ptk_file_list_get_value ( GtkTreeModel *tree_model,
 
     g_value_init (value, column_types[column] );
 
-    l = (GList*) iter->user_data;
-    g_return_if_fail ( l != NULL );
-
     info = (VFSFileInfo*)iter->user_data2;
+    g_return_if_fail ( info != NULL );
 
     switch(column)
     {
@@ -496,24 +563,22 @@ void ptk_file_list_get_value ( GtkTreeModel *tree_model,
 gboolean ptk_file_list_iter_next ( GtkTreeModel *tree_model,
                                    GtkTreeIter *iter )
 {
-    GList* l;
+    gint i;
     PtkFileList* list;
 
     g_return_val_if_fail (PTK_IS_FILE_LIST (tree_model), FALSE);
 
-    if (iter == NULL || iter->user_data == NULL)
+    if (iter == NULL || iter->user_data2 == NULL)
         return FALSE;
 
     list = PTK_FILE_LIST(tree_model);
-    l = (GList *) iter->user_data;
+    i = ptk_file_list_iter_get_index( list, iter );
 
-    /* Is this the last l in the list? */
-    if ( ! l->next )
+    /* Is this the last row in the list? */
+    if ( i < 0 || i + 1 >= list->files->len )
         return FALSE;
 
-    iter->stamp = list->stamp;
-    iter->user_data = l->next;
-    iter->user_data2 = l->next->data;
+    ptk_file_list_set_iter( list, iter, i + 1 );
 
     return TRUE;
 }
@@ -523,7 +588,7 @@ gboolean ptk_file_list_iter_children ( GtkTreeModel *tree_model,
                                        GtkTreeIter *parent )
 {
     PtkFileList* list;
-    g_return_val_if_fail ( parent == NULL || parent->user_data != NULL, FALSE );
+    g_return_val_if_fail ( parent == NULL || parent->user_data2 != NULL, FALSE );
 
     /* this is a list, nodes have no children */
     if ( parent )
@@ -534,13 +599,11 @@ gboolean ptk_file_list_iter_children ( GtkTreeModel *tree_model,
     list = PTK_FILE_LIST( tree_model );
 
     /* No rows => no first row */
-    if ( list->dir->n_files == 0 )
+    if ( list->files->len == 0 )
         return FALSE;
 
     /* Set iter to first item in list */
-    iter->stamp = list->stamp;
-    iter->user_data = list->files;
-    iter->user_data2 = list->files->data;
+    ptk_file_list_set_iter( list, iter, 0 );
     return TRUE;
 }
 
@@ -555,11 +618,11 @@ gint ptk_file_list_iter_n_children ( GtkTreeModel *tree_model,
 {
     PtkFileList* list;
     g_return_val_if_fail ( PTK_IS_FILE_LIST ( tree_model ), -1 );
-    g_return_val_if_fail ( iter == NULL || iter->user_data != NULL, FALSE );
+    g_return_val_if_fail ( iter == NULL || iter->user_data2 != NULL, FALSE );
     list = PTK_FILE_LIST( tree_model );
     /* special case: if iter == NULL, return number of top-level rows */
     if ( !iter )
-        return list->n_files;
+        return list->files->len;
     return 0; /* otherwise, this is easy again for a list */
 }
 
@@ -568,7 +631,6 @@ gboolean ptk_file_list_iter_nth_child ( GtkTreeModel *tree_model,
                                         GtkTreeIter *parent,
                                         gint n )
 {
-    GList* l;
     PtkFileList* list;
 
     g_return_val_if_fail (PTK_IS_FILE_LIST (tree_model), FALSE);
@@ -579,15 +641,10 @@ gboolean ptk_file_list_iter_nth_child ( GtkTreeModel *tree_model,
         return FALSE;
 
     /* special case: if parent == NULL, set iter to n-th top-level row */
-    if( n >= list->n_files || n < 0 )
+    if( n >= list->files->len || n < 0 )
         return FALSE;
 
-    l = g_list_nth( list->files, n );
-    g_assert( l != NULL );
-
-    iter->stamp = list->stamp;
-    iter->user_data = l;
-    iter->user_data2 = l->data;
+    ptk_file_list_set_iter( list, iter, n );
 
     return TRUE;
 }
@@ -648,7 +705,7 @@ static gint ptk_file_list_compare( gconstpointer a,
     VFSFileInfo* file1 = (VFSFileInfo*)a;
     VFSFileInfo* file2 = (VFSFileInfo*)b;
     PtkFileList* list = (PtkFileList*)user_data;
-    int ret;
+    int ret = 0;
     /* put folders before files */
     ret = vfs_file_info_is_dir(file1) - vfs_file_info_is_dir(file2);
     if( ret )
@@ -683,30 +740,36 @@ static gint ptk_file_list_compare( gconstpointer a,
     return list->sort_order == GTK_SORT_ASCENDING ? ret : -ret;
 }
 
+static gint ptk_file_list_compare_ptr( gconstpointer a,
+                                       gconstpointer b,
+                                       gpointer user_data)
+{
+    return ptk_file_list_compare( *(VFSFileInfo**)a, *(VFSFileInfo**)b, user_data );
+}
+
 void ptk_file_list_sort ( PtkFileList* list )
 {
     GHashTable* old_order;
     gint *new_order;
     GtkTreePath *path;
-    GList* l;
     int i;
 
-    if( list->n_files <=1 )
+    if( list->files->len <=1 )
         return;
 
     old_order = g_hash_table_new( g_direct_hash, g_direct_equal );
     /* save old order */
-    for( i = 0, l = list->files; l; l = l->next, ++i )
-        g_hash_table_insert( old_order, l, GINT_TO_POINTER(i) );
+    for( i = 0; i < list->files->len; ++i )
+        g_hash_table_insert( old_order, g_ptr_array_index( list->files, i ), GINT_TO_POINTER(i) );
 
     /* sort the list */
-    list->files = g_list_sort_with_data( list->files,
-                                         ptk_file_list_compare, list );
+    g_ptr_array_sort_with_data( list->files,
+                                ptk_file_list_compare_ptr, list );
 
     /* save new order */
-    new_order = g_new( int, list->n_files );
-    for( i = 0, l = list->files; l; l = l->next, ++i )
-        new_order[i] = (guint)g_hash_table_lookup( old_order, l );
+    new_order = g_new( int, list->files->len );
+    for( i = 0; i < list->files->len; ++i )
+        new_order[i] = GPOINTER_TO_INT( g_hash_table_lookup( old_order, g_ptr_array_index( list->files, i ) ) );
     g_hash_table_destroy( old_order );
     path = gtk_tree_path_new ();
     gtk_tree_model_rows_reordered (GTK_TREE_MODEL (list),
@@ -717,27 +780,27 @@ void ptk_file_list_sort ( PtkFileList* list )
 
 gboolean ptk_file_list_find_iter(  PtkFileList* list, GtkTreeIter* it, VFSFileInfo* fi )
 {
-    GList* l;
-    for( l = list->files; l; l = l->next )
+    gint i = ptk_file_list_find_index( list, fi );
+    if( i < 0 )
     {
-        VFSFileInfo* fi2 = (VFSFileInfo*)l->data;
-        if( G_UNLIKELY( fi2 == fi
-            || 0 == strcmp( vfs_file_info_get_name(fi), vfs_file_info_get_name(fi2) ) ) )
+        for( i = list->files->len - 1; i >= 0; --i )
         {
-            it->stamp = list->stamp;
-            it->user_data = l;
-            it->user_data2 = fi2;
-            return TRUE;
+            VFSFileInfo* fi2 = (VFSFileInfo*)g_ptr_array_index( list->files, i );
+            if( G_UNLIKELY( 0 == strcmp( vfs_file_info_get_name(fi), vfs_file_info_get_name(fi2) ) ) )
+                break;
         }
+        if( i < 0 )
+            return FALSE;
     }
-    return FALSE;
+    ptk_file_list_set_iter( list, it, i );
+    return TRUE;
 }
 
 void ptk_file_list_file_created( VFSDir* dir,
                                  VFSFileInfo* file,
                                  PtkFileList* list )
 {
-    GList* l;
+    guint pos, i;
     GtkTreeIter it;
     GtkTreePath* path;
     VFSFileInfo* file2;
@@ -745,33 +808,28 @@ void ptk_file_list_file_created( VFSDir* dir,
     if( ! list->show_hidden && vfs_file_info_get_name(file)[0] == '.' )
         return;
 
-    for( l = list->files; l; l = l->next )
+    pos = ptk_file_list_find_insert_pos( list, file );
+    for( i = pos; i > 0; --i )
     {
-        file2 = (VFSFileInfo*)l->data;
-        if( G_UNLIKELY( file == file2 || ptk_file_list_compare( file2, file, list ) == 0 ) )
+        file2 = (VFSFileInfo*)g_ptr_array_index( list->files, i - 1 );
+        if( ptk_file_list_compare( file2, file, list ) != 0 )
+            break;
+        if( G_UNLIKELY( file == file2 ) )
         {
             /* The file is already in the list */
             return;
         }
-        if( ptk_file_list_compare( file2, file, list ) > 0 )
-        {
-            break;
-        }
     }
 
-    list->files = g_list_insert_before( list->files, l, vfs_file_info_ref( file ) );
-    ++list->n_files;
+    /* insert the file at pos */
+    g_ptr_array_add( list->files, NULL );
+    g_memmove( list->files->pdata + pos + 1, list->files->pdata + pos,
+               ( list->files->len - 1 - pos ) * sizeof( gpointer ) );
+    list->files->pdata[ pos ] = vfs_file_info_ref( file );
 
-    if( l )
-        l = l->prev;
-    else
-        l = g_list_last( list->files );
+    ptk_file_list_set_iter( list, &it, pos );
 
-    it.stamp = list->stamp;
-    it.user_data = l;
-    it.user_data2 = file;
-
-    path = gtk_tree_path_new_from_indices( g_list_index(list->files, l->data), -1 );
+    path = gtk_tree_path_new_from_indices( pos, -1 );
 
     gtk_tree_model_row_inserted( GTK_TREE_MODEL(list), path, &it );
 
@@ -782,70 +840,202 @@ void ptk_file_list_file_deleted( VFSDir* dir,
                                  VFSFileInfo* file,
                                  PtkFileList* list )
 {
-    GList* l;
+    gint i;
     GtkTreePath* path;
 
     /* If there is no file info, that means the dir itself was deleted. */
     if( G_UNLIKELY( ! file ) )
     {
-        /* Clear the whole list */
-        path = gtk_tree_path_new_from_indices(0, -1);
-        for( l = list->files; l; l = list->files )
+        /* Clear the whole list, starting from the last row */
+        for( i = list->files->len - 1; i >= 0; --i )
         {
+            file = (VFSFileInfo*)g_ptr_array_remove_index( list->files, i );
+            path = gtk_tree_path_new_from_indices( i, -1 );
             gtk_tree_model_row_deleted( GTK_TREE_MODEL(list), path );
-            file = (VFSFileInfo*)l->data;
-            list->files = g_list_delete_link( list->files, l );
+            gtk_tree_path_free( path );
             vfs_file_info_unref( file );
-            --list->n_files;
         }
-        gtk_tree_path_free( path );
         return;
     }
 
     if( ! list->show_hidden && vfs_file_info_get_name(file)[0] == '.' )
         return;
 
-    l = g_list_find( list->files, file );
-    if( ! l )
+    i = ptk_file_list_find_index( list, file );
+    if( i < 0 )
         return;
 
-    path = gtk_tree_path_new_from_indices( g_list_index(list->files, l->data), -1 );
+    g_ptr_array_remove_index( list->files, i );
+
+    path = gtk_tree_path_new_from_indices( i, -1 );
 
     gtk_tree_model_row_deleted( GTK_TREE_MODEL(list), path );
 
     gtk_tree_path_free( path );
 
-    list->files = g_list_delete_link( list->files, l );
     vfs_file_info_unref( file );
-    --list->n_files;
+}
+
+/*
+ * Move the file at row i to its sorted position if it's out of order,
+ * and return the new row. rows_reordered is used rather than deleting
+ * and inserting the row, so the selection is kept.
+ */
+static gint ptk_file_list_resort_file( PtkFileList* list, gint i )
+{
+    VFSFileInfo** files = (VFSFileInfo**)list->files->pdata;
+    VFSFileInfo* file = files[ i ];
+    gint n = list->files->len, pos, k;
+    gint* new_order;
+    GtkTreePath* path;
+
+    if( ( i == 0 || ptk_file_list_compare( files[ i - 1 ], file, list ) <= 0 )
+        && ( i == n - 1 || ptk_file_list_compare( file, files[ i + 1 ], list ) <= 0 ) )
+        return i;
+
+    g_ptr_array_remove_index( list->files, i );
+    pos = ptk_file_list_find_insert_pos( list, file );
+    g_ptr_array_add( list->files, NULL );
+    g_memmove( list->files->pdata + pos + 1, list->files->pdata + pos,
+               ( n - 1 - pos ) * sizeof( gpointer ) );
+    list->files->pdata[ pos ] = file;
+
+    /* new_order[ new row ] = old row */
+    new_order = g_new( gint, n );
+    for( k = 0; k < n; ++k )
+    {
+        if( k == pos )
+            new_order[ k ] = i;
+        else if( pos < i && k > pos && k <= i )
+            new_order[ k ] = k - 1;
+        else if( pos > i && k >= i && k < pos )
+            new_order[ k ] = k + 1;
+        else
+            new_order[ k ] = k;
+    }
+    path = gtk_tree_path_new();
+    gtk_tree_model_rows_reordered( GTK_TREE_MODEL( list ), path, NULL, new_order );
+    gtk_tree_path_free( path );
+    g_free( new_order );
+    return pos;
 }
 
 void ptk_file_list_file_changed( VFSDir* dir,
                                  VFSFileInfo* file,
                                  PtkFileList* list )
 {
-    GList* l;
+    gint i;
     GtkTreeIter it;
     GtkTreePath* path;
 
     if( ! list->show_hidden && vfs_file_info_get_name(file)[0] == '.' )
         return;
-    l = g_list_find( list->files, file );
+    i = ptk_file_list_find_index( list, file );
 
-    if( ! l )
+    if( i < 0 )
         return;
 
-    it.stamp = list->stamp;
-    it.user_data = l;
-    it.user_data2 = l->data;
+    /* The sort key might have changed, e.g. the mime-type of a file
+     * whose content is checked after the dir is listed. */
+    i = ptk_file_list_resort_file( list, i );
+
+    ptk_file_list_set_iter( list, &it, i );
 
-    path = gtk_tree_path_new_from_indices( g_list_index(list->files, l->data), -1 );
+    path = gtk_tree_path_new_from_indices( i, -1 );
 
     gtk_tree_model_row_changed( GTK_TREE_MODEL(list), path, &it );
 
     gtk_tree_path_free( path );
 }
 
+/*
+ * Files are delivered in large batches while the dir is still being loaded.
+ * Sort the new files first, and then merge them into the sorted list in one pass
+ * rather than searching for the position of every file from the beginning.
+ * The new rows are appended and announced first, so the model always holds
+ * exactly the rows the views know about, and then the new order is announced
+ * once for the whole batch.
+ */
+void on_file_listed_partial( VFSDir* dir, GList* files, PtkFileList* list )
+{
+    GList *added = NULL, *l;
+    GPtrArray *old, *merged;
+    guint *rows, n_added = 0, old_len, i, j;
+    gint* new_order;
+    gboolean reordered = FALSE;
+    GtkTreeIter it;
+    GtkTreePath* path;
+    VFSFileInfo* file;
+
+    for( l = files; l; l = l->next )
+    {
+        file = (VFSFileInfo*)l->data;
+        if( list->show_hidden || vfs_file_info_get_name( file )[0] != '.' )
+        {
+            added = g_list_prepend( added, vfs_file_info_ref( file ) );
+            ++n_added;
+        }
+    }
+    if( ! added )
+        return;
+    added = g_list_sort_with_data( added, ptk_file_list_compare, list );
+
+    old = list->files;
+    old_len = old->len;
+    for( l = added; l; l = l->next )
+    {
+        g_ptr_array_add( old, l->data );
+        ptk_file_list_set_iter( list, &it, old->len - 1 );
+        path = gtk_tree_path_new_from_indices( old->len - 1, -1 );
+        gtk_tree_model_row_inserted( GTK_TREE_MODEL(list), path, &it );
+        gtk_tree_path_free( path );
+    }
+
+    merged = g_ptr_array_sized_new( old->len );
+    new_order = g_new( gint, old->len );  /* new_order[ new row ] = old row */
+    rows = g_new( guint, n_added );
+    for( l = added, i = 0, j = 0; l; l = l->next, ++i )
+    {
+        file = (VFSFileInfo*)l->data;
+        while( j < old_len
+               && ptk_file_list_compare( g_ptr_array_index( old, j ), file, list ) <= 0 )
+        {
+            new_order[ merged->len ] = j;
+            g_ptr_array_add( merged, g_ptr_array_index( old, j++ ) );
+        }
+        if( j < old_len )
+            reordered = TRUE;
+        rows[ i ] = merged->len;
+        new_order[ merged->len ] = old_len + i;
+        g_ptr_array_add( merged, file );
+    }
+    for( ; j < old_len; ++j )
+    {
+        new_order[ merged->len ] = j;
+        g_ptr_array_add( merged, g_ptr_array_index( old, j ) );
+    }
+    g_list_free( added );
+
+    list->files = merged;
+    g_ptr_array_free( old, TRUE );
+
+    /* Nothing moves if all the new files are sorted after the old ones */
+    if( reordered )
+    {
+        path = gtk_tree_path_new();
+        gtk_tree_model_rows_reordered( GTK_TREE_MODEL(list), path, NULL, new_order );
+        gtk_tree_path_free( path );
+    }
+    g_free( new_order );
+
+    for( i = 0; i < n_added; ++i )
+    {
+        file = (VFSFileInfo*)g_ptr_array_index( list->files, rows[ i ] );
+        ptk_file_list_request_thumbnail( list, file, rows[ i ] );
+    }
+    g_free( rows );
+}
+
 void on_thumbnail_loaded( VFSDir* dir, VFSFileInfo* file, PtkFileList* list )
 {
     /* g_debug( "LOADED: %s", file->name ); */
@@ -855,7 +1045,7 @@ void on_thumbnail_loaded( VFSDir* dir, VFSFileInfo* file, PtkFileList* list )
 void ptk_file_list_show_thumbnails( PtkFileList* list, gboolean is_big,
                                     int max_file_size )
 {
-    GList* l;
+    guint i;
     VFSFileInfo* file;
     int old_max_thumbnail;
 
@@ -871,9 +1061,9 @@ void ptk_file_list_show_thumbnails( PtkFileList* list, gboolean is_big,
             vfs_thumbnail_loader_cancel_all_requests( list->dir, list->big_thumbnail );
             g_signal_handlers_disconnect_by_func( list->dir, on_thumbnail_loaded, list );
 
-            for( l = list->files; l; l = l->next )
+            for( i = 0; i < list->files->len; ++i )
             {
-                file = (VFSFileInfo*)l->data;
+                file = (VFSFileInfo*)g_ptr_array_index( list->files, i );
                 if( vfs_file_info_is_image( file )
                     && vfs_file_info_is_thumbnail_loaded( file, is_big ) )
                 {
@@ -888,9 +1078,9 @@ void ptk_file_list_show_thumbnails( PtkFileList* list, gboolean is_big,
     g_signal_connect( list->dir, "thumbnail-loaded",
                                     G_CALLBACK(on_thumbnail_loaded), list );
 
-    for( l = list->files; l; l = l->next )
+    for( i = 0; i < list->files->len; ++i )
     {
-        file = (VFSFileInfo*)l->data;
+        file = (VFSFileInfo*)g_ptr_array_index( list->files, i );
         if( vfs_file_info_is_image( file )
             && vfs_file_info_get_size( file ) < list->max_thumbnail )
         {
@@ -898,9 +1088,92 @@ void ptk_file_list_show_thumbnails( PtkFileList* list, gboolean is_big,
                 ptk_file_list_file_changed( list->dir, file, list );
             else
             {
-                vfs_thumbnail_loader_request( list->dir, file, is_big );
+                ptk_file_list_request_thumbnail( list, file, i );
                 /* g_debug( "REQUEST: %s", file->name ); */
             }
         }
     }
 }
+
+/*
+ * The thumbnails of the visible rows are loaded first, followed by one page
+ * of rows before and after them, so they are ready when the view is scrolled.
+ * The rest of the rows are loaded last.
+ */
+static VFSThumbnailPriority ptk_file_list_get_thumbnail_priority( PtkFileList* list, gint row )
+{
+    gint n;
+
+    if( list->visible_first < 0 || row < 0 )
+        return VFS_THUMBNAIL_PRIORITY_NORMAL;
+    if( row >= list->visible_first && row <= list->visible_last )
+        return VFS_THUMBNAIL_PRIORITY_HIGH;
+    n = list->visible_last - list->visible_first + 1;
+    if( row >= list->visible_first - n && row <= list->visible_last + n )
+        return VFS_THUMBNAIL_PRIORITY_NORMAL;
+    return VFS_THUMBNAIL_PRIORITY_LOW;
+}
+
+/* Request the thumbnail of the file if it's needed.
+ * If the row of the file is not known, pass -1 for row. */
+void ptk_file_list_request_thumbnail( PtkFileList* list, VFSFileInfo* file, gint row )
+{
+    if( ! vfs_file_info_is_image( file )
+        || vfs_file_info_get_size( file ) >= list->max_thumbnail
+        || vfs_file_info_is_thumbnail_loaded( file, list->big_thumbnail ) )
+        return;
+    if( row < 0 )
+        row = ptk_file_list_find_index( list, file );
+    vfs_thumbnail_loader_request_full( list->dir, file, list->big_thumbnail,
+                                       ptk_file_list_get_thumbnail_priority( list, row ) );
+}
+
+/* Move the queued thumbnail requests of the rows between first and last
+ * to the priority they should have now */
+static void ptk_file_list_update_thumbnail_priorities( PtkFileList* list,
+                                                      gint first, gint last )
+{
+    gint i;
+    VFSFileInfo* file;
+
+    if( first < 0 )
+        first = 0;
+    if( last >= (gint)list->files->len )
+        last = list->files->len - 1;
+    for( i = first; i <= last; ++i )
+    {
+        file = (VFSFileInfo*)g_ptr_array_index( list->files, i );
+        if( vfs_file_info_is_image( file )
+            && ! vfs_file_info_is_thumbnail_loaded( file, list->big_thumbnail ) )
+        {
+            vfs_thumbnail_loader_set_priority( list->dir, file,
+                                               ptk_file_list_get_thumbnail_priority( list, i ) );
+        }
+    }
+}
+
+void ptk_file_list_set_visible_range( PtkFileList* list, gint first, gint last )
+{
+    gint old_first = list->visible_first, old_last = list->visible_last, n;
+
+    if( first == old_first && last == old_last )
+        return;
+    list->visible_first = first;
+    list->visible_last = last;
+
+    if( list->max_thumbnail <= 0 || ! list->dir )
+        return;
+
+    /* Demote the requests which were visible or prefetched before... */
+    if( old_first >= 0 )
+    {
+        n = old_last - old_first + 1;
+        ptk_file_list_update_thumbnail_priorities( list, old_first - n, old_last + n );
+    }
+    /* ...and promote the ones around the new visible rows */
+    if( first >= 0 )
+    {
+        n = last - first + 1;
+        ptk_file_list_update_thumbnail_priorities( list, first - n, last + n );
+    }
+}
@@ -52,12 +52,14 @@ struct _PtkFileList
     GObject parent;
     /* <private> */
     VFSDir* dir;
-    GList* files;
-    guint n_files;
+    GPtrArray* files;   /* sorted array of VFSFileInfo* */
 
     gboolean show_hidden : 1;
     gboolean big_thumbnail : 1;
     int max_thumbnail;
+    /* Rows shown in the view, whose thumbnails are loaded first. -1 if unknown. */
+    gint visible_first;
+    gint visible_last;
 
     int sort_col;
     GtkSortType sort_order;
@@ -95,6 +97,9 @@ void ptk_file_list_file_changed( VFSDir* dir, VFSFileInfo* file,
 void ptk_file_list_show_thumbnails( PtkFileList* list, gboolean is_big,
                                     int max_file_size );
 
+/* Called by the view when the range of visible rows is changed */
+void ptk_file_list_set_visible_range( PtkFileList* list, gint first, gint last );
+
 G_END_DECLS
 
 #endif
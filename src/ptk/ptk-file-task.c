@@ -22,11 +22,7 @@
 
 static gboolean open_up_progress_dlg( PtkFileTask* task );
 
-static void on_vfs_file_task_progress_cb( VFSFileTask* task,
-                                          int percent,
-                                          const char* src_file,
-                                          const char* dest_file,
-                                          gpointer user_data );
+static gboolean update_progress_dlg( PtkFileTask* task );
 
 static gboolean on_vfs_file_task_state_cb( VFSFileTask* task,
                                            VFSFileTaskState state,
@@ -42,9 +38,9 @@ PtkFileTask* ptk_file_task_new( VFSFileTaskType type,
 {
     PtkFileTask * task = g_slice_new0( PtkFileTask );
     task->task = vfs_task_new( type, src_files, dest_dir );
-    vfs_file_task_set_progress_callback( task->task,
-                                         on_vfs_file_task_progress_cb,
-                                         task );
+    /* The progress is polled by update_progress_dlg() rather than
+     * pushed by the task thread, which would hold the GDK lock
+     * for every file processed. */
     vfs_file_task_set_state_callback( task->task,
                                       on_vfs_file_task_state_cb, task );
     task->parent_window = parent_window;
@@ -59,6 +55,10 @@ void ptk_file_task_destroy( PtkFileTask* task )
         gtk_widget_destroy( task->progress_dlg );
     if ( task->timeout )
         g_source_remove( task->timeout );
+    if ( task->progress_timer )
+        g_source_remove( task->progress_timer );
+    g_free( task->old_src_file );
+    g_free( task->old_dest_file );
     g_slice_free( PtkFileTask, task );
 }
 
@@ -98,6 +98,7 @@ gboolean open_up_progress_dlg( PtkFileTask* task )
     GtkTable* table;
     GtkLabel* label;
     gchar *disp_name;
+    char* src_file;
 
     const char * actions[] =
         {
@@ -140,9 +141,12 @@ gboolean open_up_progress_dlg( PtkFileTask* task )
     gtk_table_attach( table,
                       GTK_WIDGET(label),
                       0, 1, 0, 1, GTK_FILL, 0, 0, 0 );
-    disp_name = g_filename_display_name( task->task->current_file );
+    /* the current_file of the task might be freed by the task thread */
+    vfs_file_task_get_progress( task->task, &src_file, NULL );
+    disp_name = src_file ? g_filename_display_name( src_file ) : NULL;
     task->from = GTK_LABEL(gtk_label_new( disp_name ));
     g_free( disp_name );
+    g_free( src_file );
     gtk_misc_set_alignment( GTK_MISC ( task->from ), 0, 0.5 );
     gtk_label_set_ellipsize( task->from, PANGO_ELLIPSIZE_MIDDLE );
     gtk_table_attach( table,
@@ -213,6 +217,10 @@ gboolean open_up_progress_dlg( PtkFileTask* task )
                       G_CALLBACK( on_progress_dlg_response ), task );
     gtk_widget_show_all( task->progress_dlg );
 
+    /* update the progress ten times per second */
+    task->progress_timer = g_timeout_add( 100,
+                                          ( GSourceFunc ) update_progress_dlg, task );
+
     gdk_threads_leave();
 
     return TRUE;
@@ -235,38 +243,50 @@ void ptk_file_task_set_recursive( PtkFileTask* task, gboolean recursive )
     vfs_file_task_set_recursive( task->task, recursive );
 }
 
-void on_vfs_file_task_progress_cb( VFSFileTask* task,
-                                   int percent,
-                                   const char* src_file,
-                                   const char* dest_file,
-                                   gpointer user_data )
+gboolean update_progress_dlg( PtkFileTask* data )
 {
-    PtkFileTask * data = ( PtkFileTask* ) user_data;
+    char* src_file;
+    char* dest_file;
     char* ufile_path;
     char percent_str[ 16 ];
-
-    if ( ! data->progress_dlg )
-        return ;
+    int percent;
 
     gdk_threads_enter();
 
+    /* The task might have finished while we were waiting for the lock */
+    if ( g_source_is_destroyed( g_main_current_source() ) )
+    {
+        gdk_threads_leave();
+        return FALSE;
+    }
+
+    percent = vfs_file_task_get_progress( data->task, &src_file, &dest_file );
+
     /* update current src file */
-    if ( data->old_src_file != src_file )
+    if ( src_file && ( ! data->old_src_file
+                       || strcmp( data->old_src_file, src_file ) ) )
     {
-        data->old_src_file = src_file;
         ufile_path = g_filename_display_name( src_file );
         gtk_label_set_text( data->current, ufile_path );
         g_free( ufile_path );
+        g_free( data->old_src_file );
+        data->old_src_file = src_file;
     }
+    else
+        g_free( src_file );
 
     /* update current dest file */
-    if ( data->old_dest_file != dest_file )
+    if ( data->to && dest_file && ( ! data->old_dest_file
+                                    || strcmp( data->old_dest_file, dest_file ) ) )
     {
-        data->old_dest_file = dest_file;
         ufile_path = g_filename_display_name( dest_file );
         gtk_label_set_text( data->to, ufile_path );
         g_free( ufile_path );
+        g_free( data->old_dest_file );
+        data->old_dest_file = dest_file;
     }
+    else
+        g_free( dest_file );
 
     /* update progress */
     if ( data->old_percent != percent )
@@ -279,6 +299,8 @@ void on_vfs_file_task_progress_cb( VFSFileTask* task,
     }
 
     gdk_threads_leave();
+
+    return TRUE;
 }
 
 gboolean on_vfs_file_task_state_cb( VFSFileTask* task,
@@ -302,6 +324,11 @@ gboolean on_vfs_file_task_state_cb( VFSFileTask* task,
             g_source_remove( data->timeout );
             data->timeout = 0;
         }
+        if ( data->progress_timer )
+        {
+            g_source_remove( data->progress_timer );
+            data->progress_timer = 0;
+        }
         if ( data->progress_dlg )
         {
             gtk_widget_destroy( data->progress_dlg );
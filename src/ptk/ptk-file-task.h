@@ -31,10 +31,11 @@ struct _PtkFileTask
 
     /* <private> */
     guint timeout;
+    guint progress_timer;
     GFunc complete_notify;
     gpointer user_data;
-    const char* old_src_file;
-    const char* old_dest_file;
+    char* old_src_file;
+    char* old_dest_file;
     int old_percent;
 };
 
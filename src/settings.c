@@ -33,6 +33,8 @@ const gboolean show_side_pane_default = TRUE;
 const int side_pane_mode_default = PTK_FB_SIDE_PANE_BOOKMARKS;
 const gboolean show_thumbnail_default = TRUE;
 const int max_thumb_size_default = 1 << 20;
+const int thumbnail_threads_default = 0;
+const int thumbnail_cache_size_default = 32 << 10;
 const int big_icon_size_default = 48;
 const int small_icon_size_default = 20;
 const gboolean single_click_default = FALSE;
@@ -92,6 +94,18 @@ static void parse_general_settings( char* line )
         app_settings.show_thumbnail = atoi( value );
     else if ( 0 == strcmp( name, "max_thumb_size" ) )
         app_settings.max_thumb_size = atoi( value ) << 10;
+    else if ( 0 == strcmp( name, "thumbnail_threads" ) )
+    {
+        app_settings.thumbnail_threads = atoi( value );
+        if( app_settings.thumbnail_threads < 0 )
+            app_settings.thumbnail_threads = thumbnail_threads_default;
+    }
+    else if ( 0 == strcmp( name, "thumbnail_cache_size" ) )
+    {
+        app_settings.thumbnail_cache_size = atoi( value );
+        if( app_settings.thumbnail_cache_size < 0 )
+            app_settings.thumbnail_cache_size = thumbnail_cache_size_default;
+    }
     else if ( 0 == strcmp( name, "big_icon_size" ) )
     {
         app_settings.big_icon_size = atoi( value );
@@ -266,6 +280,8 @@ void load_settings()
     app_settings.side_pane_mode = side_pane_mode_default;
     app_settings.show_thumbnail = show_thumbnail_default;
     app_settings.max_thumb_size = max_thumb_size_default;
+    app_settings.thumbnail_threads = thumbnail_threads_default;
+    app_settings.thumbnail_cache_size = thumbnail_cache_size_default;
     app_settings.big_icon_size = big_icon_size_default;
     app_settings.small_icon_size = small_icon_size_default;
     app_settings.use_trash_can = use_trash_can_default;
@@ -379,6 +395,10 @@ void save_settings()
             fprintf( file, "show_thumbnail=%d\n", !!app_settings.show_thumbnail );
         if ( app_settings.max_thumb_size != max_thumb_size_default )
             fprintf( file, "max_thumb_size=%d\n", app_settings.max_thumb_size >> 10 );
+        if ( app_settings.thumbnail_threads != thumbnail_threads_default )
+            fprintf( file, "thumbnail_threads=%d\n", app_settings.thumbnail_threads );
+        if ( app_settings.thumbnail_cache_size != thumbnail_cache_size_default )
+            fprintf( file, "thumbnail_cache_size=%d\n", app_settings.thumbnail_cache_size );
         if ( app_settings.big_icon_size != big_icon_size_default )
             fprintf( file, "big_icon_size=%d\n", app_settings.big_icon_size );
         if ( app_settings.small_icon_size != small_icon_size_default )
@@ -21,6 +21,8 @@ typedef struct
     int side_pane_mode;
     gboolean show_thumbnail;
     int max_thumb_size;
+    int thumbnail_threads;  /* 0 = one for each processor */
+    int thumbnail_cache_size;   /* in KB */
 
     int big_icon_size;
     int small_icon_size;
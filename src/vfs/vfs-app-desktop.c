@@ -15,6 +15,9 @@
 #include "glib-mem.h"
 
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "vfs-execute.h"
 
@@ -22,6 +25,103 @@
 
 const char desktop_entry_name[] = "Desktop Entry";
 
+/*
+* Parsed desktop entries are shared by the whole process.
+* file name passed to vfs_app_desktop_new() => DesktopCacheEntry
+* An entry is used again as long as the mtime of the file loaded for it
+* is not changed. Since a desktop file id can be shadowed by a new file
+* in another data dir, the cache is cleared when the applications dirs
+* are changed. (see vfs_app_desktop_clear_cache())
+* A file which is not found is only remembered for a short while, in case
+* it's installed somewhere the monitors cannot see.
+*/
+typedef struct _DesktopCacheEntry
+{
+    VFSAppDesktop* app;
+    char* path; /* the file actually loaded, NULL if it's not found */
+    time_t mtime;   /* mtime of the file, or when it was not found */
+}DesktopCacheEntry;
+
+#define DESKTOP_CACHE_MAX_ENTRIES   1024
+/* seconds to remember a file which is not found */
+#define DESKTOP_CACHE_MISS_TIMEOUT  5
+
+static GHashTable* desktop_cache = NULL;
+G_LOCK_DEFINE_STATIC( desktop_cache );
+
+static void desktop_cache_entry_free( DesktopCacheEntry* ent )
+{
+    vfs_app_desktop_unref( ent->app );
+    g_free( ent->path );
+    g_slice_free( DesktopCacheEntry, ent );
+}
+
+static VFSAppDesktop* desktop_cache_lookup( const char* file_name )
+{
+    DesktopCacheEntry* ent;
+    VFSAppDesktop* app = NULL;
+    struct stat statbuf;
+
+    G_LOCK( desktop_cache );
+    if( desktop_cache
+        && (ent = (DesktopCacheEntry*)g_hash_table_lookup( desktop_cache, file_name )) )
+    {
+        if( ent->path )
+        {
+            if( stat( ent->path, &statbuf ) == 0 && statbuf.st_mtime == ent->mtime )
+                app = ent->app;
+        }
+        else if( (guint)( time( NULL ) - ent->mtime ) < DESKTOP_CACHE_MISS_TIMEOUT
+                 && ( ! g_path_is_absolute( file_name )
+                      || ! g_file_test( file_name, G_FILE_TEST_EXISTS ) ) )
+            app = ent->app; /* still not found */
+
+        if( app )
+            vfs_app_desktop_ref( app );
+        else
+            g_hash_table_remove( desktop_cache, file_name );
+    }
+    G_UNLOCK( desktop_cache );
+    return app;
+}
+
+static void desktop_cache_insert( const char* file_name,
+                                  VFSAppDesktop* app,
+                                  char* path, time_t mtime )
+{
+    DesktopCacheEntry* ent = g_slice_new( DesktopCacheEntry );
+    vfs_app_desktop_ref( app );
+    ent->app = app;
+    ent->path = path;
+    ent->mtime = mtime;
+
+    G_LOCK( desktop_cache );
+    if( G_UNLIKELY( ! desktop_cache ) )
+        desktop_cache = g_hash_table_new_full( g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)desktop_cache_entry_free );
+    else if( g_hash_table_size( desktop_cache ) >= DESKTOP_CACHE_MAX_ENTRIES )
+    {
+        g_hash_table_destroy( desktop_cache );
+        desktop_cache = g_hash_table_new_full( g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)desktop_cache_entry_free );
+    }
+    g_hash_table_replace( desktop_cache, g_strdup( file_name ), ent );
+    G_UNLOCK( desktop_cache );
+}
+
+void vfs_app_desktop_clear_cache()
+{
+    GHashTable* cache;
+
+    G_LOCK( desktop_cache );
+    cache = desktop_cache;
+    desktop_cache = NULL;
+    G_UNLOCK( desktop_cache );
+
+    if( cache )
+        g_hash_table_destroy( cache );
+}
+
 /*
 * If file_name is not a full path, this function searches default paths
 * for the desktop file.
@@ -31,21 +131,32 @@ VFSAppDesktop* vfs_app_desktop_new( const char* file_name )
     GKeyFile* file;
     gboolean load;
     char* relative_path;
+    char* path = NULL;
+    struct stat statbuf;
+    time_t mtime = 0;
+    VFSAppDesktop* app;
 
-    VFSAppDesktop* app = g_slice_new0( VFSAppDesktop );
-    app->n_ref = 1;
+    if( G_LIKELY( file_name ) && (app = desktop_cache_lookup( file_name )) )
+        return app;
 
-    file = g_key_file_new();
+    app = g_slice_new0( VFSAppDesktop );
+    app->n_ref = 1;
 
+    /* The empty one is not cached since the callers fill it by themselves. */
     if( !file_name )
-    {
-        g_key_file_free( file );
         return app;
-    }
+
+    file = g_key_file_new();
 
     if( g_path_is_absolute( file_name ) )
     {
         app->file_name = g_path_get_basename( file_name );
+        /* stat before loading, so a later change is never missed */
+        if( stat( file_name, &statbuf ) == 0 )
+        {
+            path = g_strdup( file_name );
+            mtime = statbuf.st_mtime;
+        }
         load = g_key_file_load_from_file( file, file_name,
                                           G_KEY_FILE_NONE, NULL );
     }
@@ -54,9 +165,11 @@ VFSAppDesktop* vfs_app_desktop_new( const char* file_name )
         app->file_name = g_strdup( file_name );
         relative_path = g_build_filename( "applications",
                                           app->file_name, NULL );
-        load = g_key_file_load_from_data_dirs( file, relative_path, NULL,
+        load = g_key_file_load_from_data_dirs( file, relative_path, &path,
                                                G_KEY_FILE_NONE, NULL );
         g_free( relative_path );
+        if( path && stat( path, &statbuf ) == 0 )
+            mtime = statbuf.st_mtime;
     }
 
     if( load )
@@ -78,11 +191,16 @@ VFSAppDesktop* vfs_app_desktop_new( const char* file_name )
 
     g_key_file_free( file );
 
+    if( ! path )
+        mtime = time( NULL );
+    desktop_cache_insert( file_name, app, path, mtime );
+
     return app;
 }
 
 static void vfs_app_desktop_free( VFSAppDesktop* app )
 {
+    g_free( app->file_name );
     g_free( app->disp_name );
     g_free( app->comment );
     g_free( app->exec );
@@ -37,9 +37,14 @@ struct _VFSAppDesktop
 /*
 * If file_name is not a full path, this function searches default paths
 * for the desktop file.
+* The returned object is cached and shared, so it should never be modified.
+* vfs_app_desktop_new( NULL ) returns an empty one which can be filled.
 */
 VFSAppDesktop* vfs_app_desktop_new( const char* file_name );
 
+/* Should be called when the applications dirs are changed */
+void vfs_app_desktop_clear_cache();
+
 void vfs_app_desktop_ref( VFSAppDesktop* app );
 
 void vfs_app_desktop_unref( gpointer data );
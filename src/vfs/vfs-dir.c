@@ -10,15 +10,47 @@
 *
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for statx() */
+#endif
+
 #include "vfs-dir.h"
 #include "vfs-thumbnail-loader.h"
 #include "glib-mem.h"
 
 #include <glib/gi18n.h>
 #include <string.h>
+#include <errno.h>
 
 #include <fcntl.h>  /* for open() */
 #include <unistd.h> /* for read */
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h> /* for makedev() */
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define USE_GETDENTS64
+#define GETDENTS_BUF_SIZE   (64 * 1024)
+#endif
+
+#ifdef STATX_TYPE
+/* Only query the fields stored in VFSFileInfo */
+#define LOAD_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | \
+                         STATX_SIZE | STATX_MTIME | STATX_ATIME | STATX_BLOCKS)
+#endif
+
+/* Loaded files are published to dir->file_list and announced by "file-listed-partial"
+ * every LOAD_CHUNK_SIZE files, or every LOAD_CHUNK_INTERVAL milliseconds. */
+#define LOAD_CHUNK_SIZE     2000
+#define LOAD_CHUNK_INTERVAL 50
+
+/* Define VFS_DIR_DEBUG_LOAD to report loading speed of directories */
+/* #define VFS_DIR_DEBUG_LOAD */
 
 static void vfs_dir_class_init( VFSDirClass* klass );
 static void vfs_dir_init( VFSDir* dir );
@@ -37,10 +69,12 @@ static VFSDir* vfs_dir_new( const char* path );
 
 static void vfs_dir_load( VFSDir* dir );
 static gpointer vfs_dir_load_thread( VFSAsyncTask* task, VFSDir* dir );
+static gpointer vfs_dir_resync_thread( VFSAsyncTask* task, VFSDir* dir );
+static gpointer vfs_dir_sniff_thread( VFSAsyncTask* task, VFSDir* dir );
 
 static void vfs_dir_monitor_callback( VFSFileMonitor* fm,
-                                      VFSFileMonitorEvent event,
-                                      const char* file_name,
+                                      const VFSFileMonitorEventItem* events,
+                                      guint n_events,
                                       gpointer user_data );
 
 #if 0
@@ -60,6 +94,9 @@ static gboolean is_dir_desktop( const char* path );
 #endif
 
 static void on_list_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir );
+static void on_resync_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir );
+static void on_sniff_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir );
+static void sniff_jobs_free( GList* jobs );
 
 enum {
     FILE_CREATED_SIGNAL = 0,
@@ -67,6 +104,7 @@ enum {
     FILE_CHANGED_SIGNAL,
     THUMBNAIL_LOADED_SIGNAL,
     FILE_LISTED_SIGNAL,
+    FILE_LISTED_PARTIAL_SIGNAL,
     N_SIGNALS
 };
 
@@ -180,6 +218,20 @@ void vfs_dir_class_init( VFSDirClass* klass )
                        g_cclosure_marshal_VOID__BOOLEAN,
                        G_TYPE_NONE, 1, G_TYPE_BOOLEAN );
 
+    /*
+    * file-listed-partial is emitted periodically while the dir is still being loaded.
+    * The param is a GList of VFSFileInfo loaded since the last emission.
+    * These files are already in dir->file_list when the signal is emitted.
+    */
+    signals[ FILE_LISTED_PARTIAL_SIGNAL ] =
+        g_signal_new ( "file-listed-partial",
+                       G_TYPE_FROM_CLASS ( klass ),
+                       G_SIGNAL_RUN_FIRST,
+                       G_STRUCT_OFFSET ( VFSDirClass, file_listed_partial ),
+                       NULL, NULL,
+                       g_cclosure_marshal_VOID__POINTER,
+                       G_TYPE_NONE, 1, G_TYPE_POINTER );
+
     /* FIXME: Is there better way to do this? */
     if( G_UNLIKELY( ! is_desktop_set ) )
         vfs_get_desktop_dir();
@@ -192,6 +244,7 @@ void vfs_dir_class_init( VFSDirClass* klass )
 void vfs_dir_init( VFSDir* dir )
 {
     dir->mutex = g_mutex_new();
+    dir->file_hash = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
 }
 
 /* destructor */
@@ -200,22 +253,44 @@ void vfs_dir_finalize( GObject *obj )
 {
     VFSDir * dir = VFS_DIR( obj );
 
-    do{}
-    while( g_source_remove_by_user_data( dir ) );
-
     if( G_UNLIKELY( dir->task ) )
     {
         g_signal_handlers_disconnect_by_func( dir->task, on_list_task_finished, dir );
         /* FIXME: should we generate a "file-list" signal to indicate the dir loading was cancelled? */
         vfs_async_task_cancel( dir->task );
+        /* the files returned by the loader for vfs_dir_sniff_files() */
+        vfs_file_info_list_free( (GList*)vfs_async_task_get_return_value( dir->task ) );
         g_object_unref( dir->task );
         dir->task = NULL;
     }
+    if( G_UNLIKELY( dir->resync_task ) )
+    {
+        g_signal_handlers_disconnect_by_func( dir->resync_task, on_resync_task_finished, dir );
+        vfs_async_task_cancel( dir->resync_task );
+        vfs_file_info_list_free( (GList*)vfs_async_task_get_return_value( dir->resync_task ) );
+        g_object_unref( dir->resync_task );
+        dir->resync_task = NULL;
+    }
+    if( G_UNLIKELY( dir->sniff_task ) )
+    {
+        g_signal_handlers_disconnect_by_func( dir->sniff_task, on_sniff_task_finished, dir );
+        vfs_async_task_cancel( dir->sniff_task );
+        sniff_jobs_free( (GList*)vfs_async_task_get_return_value( dir->sniff_task ) );
+        g_object_unref( dir->sniff_task );
+        dir->sniff_task = NULL;
+    }
+    sniff_jobs_free( dir->sniff_jobs );
+    dir->sniff_jobs = NULL;
+
+    /* The loader thread is stopped now, so no more idle handlers can be added. */
+    do{}
+    while( g_source_remove_by_user_data( dir ) );
+    dir->pending_idle = 0;
     if ( dir->monitor )
     {
-        vfs_file_monitor_remove( dir->monitor,
-                                 vfs_dir_monitor_callback,
-                                 dir );
+        vfs_file_monitor_remove_batch( dir->monitor,
+                                       vfs_dir_monitor_callback,
+                                       dir );
     }
     if ( dir->path )
     {
@@ -262,6 +337,7 @@ void vfs_dir_finalize( GObject *obj )
         dir->file_list = NULL;
         dir->n_files = 0;
     }
+    g_hash_table_destroy( dir->file_hash );
 
     if( dir->changed_files )
     {
@@ -270,6 +346,18 @@ void vfs_dir_finalize( GObject *obj )
         dir->changed_files = NULL;
     }
 
+    if( dir->pending_files )
+    {
+        vfs_file_info_list_free( dir->pending_files );
+        dir->pending_files = NULL;
+        dir->n_pending_files = 0;
+    }
+    if( dir->pending_hash )
+    {
+        g_hash_table_destroy( dir->pending_hash );
+        dir->pending_hash = NULL;
+    }
+
     g_mutex_free( dir->mutex );
     G_OBJECT_CLASS( parent_class ) ->finalize( obj );
 }
@@ -286,23 +374,36 @@ void vfs_dir_set_property ( GObject *obj,
                             GParamSpec *pspec )
 {}
 
+/* NOTE: dir->mutex should be locked before calling the following functions. */
+
 static GList* vfs_dir_find_file( VFSDir* dir, const char* file_name, VFSFileInfo* file )
 {
-    GList * l;
-    VFSFileInfo* file2;
-    for ( l = dir->file_list; l; l = l->next )
-    {
-        file2 = ( VFSFileInfo* ) l->data;
-        if( G_UNLIKELY( file == file2 ) )
-            return l;
-        if ( file2->name && 0 == strcmp( file2->name, file_name ) )
-        {
-            return l;
-        }
-    }
-    return NULL;
+    return (GList*)g_hash_table_lookup( dir->file_hash,
+                                        file ? file->name : file_name );
+}
+
+/* Check if the file is loaded, but not moved to dir->file_list yet */
+static gboolean vfs_dir_is_file_pending( VFSDir* dir, const char* file_name )
+{
+    return dir->pending_hash && g_hash_table_lookup( dir->pending_hash, file_name );
+}
+
+static void vfs_dir_add_file( VFSDir* dir, VFSFileInfo* file )
+{
+    dir->file_list = g_list_prepend( dir->file_list, file );
+    g_hash_table_insert( dir->file_hash, g_strdup( file->name ), dir->file_list );
+    ++dir->n_files;
 }
 
+static void vfs_dir_remove_file( VFSDir* dir, const char* file_name, GList* l )
+{
+    g_hash_table_remove( dir->file_hash, file_name );
+    dir->file_list = g_list_delete_link( dir->file_list, l );
+    --dir->n_files;
+}
+
+static void emit_pending_files( VFSDir* dir );
+
 /* signal handlers */
 void vfs_dir_emit_file_created( VFSDir* dir, const char* file_name, VFSFileInfo* file )
 {
@@ -322,7 +423,8 @@ void vfs_dir_emit_file_created( VFSDir* dir, const char* file_name, VFSFileInfo*
 
     l = vfs_dir_find_file( dir, file_name, file );
 
-    if ( G_LIKELY( ! l ) )  /* not in our list */
+    /* files being loaded will be announced by "file-listed-partial" later */
+    if ( G_LIKELY( ! l && ! vfs_dir_is_file_pending( dir, file_name ) ) )
     {
         full_path = g_build_filename( dir->path, file_name, NULL );
         if( G_UNLIKELY( file ) )
@@ -352,8 +454,9 @@ void vfs_dir_emit_file_created( VFSDir* dir, const char* file_name, VFSFileInfo*
         if( /*G_UNLIKELY(is_desktop) &&*/ G_LIKELY(full_path) )
             vfs_file_info_load_special_info( file, full_path );
 
-        dir->file_list = g_list_prepend( dir->file_list, vfs_file_info_ref(file) );
-        ++dir->n_files;
+        g_mutex_lock( dir->mutex );
+        vfs_dir_add_file( dir, vfs_file_info_ref(file) );
+        g_mutex_unlock( dir->mutex );
 
         g_signal_emit( dir, signals[ FILE_CREATED_SIGNAL ], 0, file );
         vfs_file_info_unref( file );
@@ -374,6 +477,9 @@ void vfs_dir_emit_file_deleted( VFSDir* dir, const char* file_name, VFSFileInfo*
         g_list_foreach( dir->file_list, (GFunc)vfs_file_info_unref, NULL );
         g_list_free( dir->file_list );
         dir->file_list = NULL;
+        dir->n_files = 0;
+        g_hash_table_destroy( dir->file_hash );
+        dir->file_hash = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
         g_mutex_unlock( dir->mutex );
 
         g_signal_emit( dir, signals[ FILE_DELETED_SIGNAL ], 0, file );
@@ -383,12 +489,19 @@ void vfs_dir_emit_file_deleted( VFSDir* dir, const char* file_name, VFSFileInfo*
     g_mutex_lock( dir->mutex );
 
     l = vfs_dir_find_file( dir, file_name, file );
+    if( G_UNLIKELY( ! l && vfs_dir_is_file_pending( dir, file_name ) ) )
+    {
+        /* the file should be announced before being deleted */
+        g_mutex_unlock( dir->mutex );
+        emit_pending_files( dir );
+        g_mutex_lock( dir->mutex );
+        l = vfs_dir_find_file( dir, file_name, file );
+    }
 
     if ( l )
     {
         file = ( VFSFileInfo* ) l->data;
-        dir->file_list = g_list_delete_link( dir->file_list, l );
-        --dir->n_files;
+        vfs_dir_remove_file( dir, file->name, l );
     }
     else
         file = NULL;
@@ -407,6 +520,13 @@ void vfs_dir_emit_file_changed( VFSDir* dir, const char* file_name, VFSFileInfo*
     g_mutex_lock( dir->mutex );
 
     l = vfs_dir_find_file( dir, file_name, file );
+    if( G_UNLIKELY( ! l && vfs_dir_is_file_pending( dir, file_name ) ) )
+    {
+        g_mutex_unlock( dir->mutex );
+        emit_pending_files( dir );
+        g_mutex_lock( dir->mutex );
+        l = vfs_dir_find_file( dir, file_name, file );
+    }
     if ( G_LIKELY( l ) )
     {
         file = vfs_file_info_ref( ( VFSFileInfo* ) l->data );
@@ -460,11 +580,9 @@ void vfs_dir_emit_thumbnail_loaded( VFSDir* dir, VFSFileInfo* file )
     GList* l;
     g_mutex_lock( dir->mutex );
     l = vfs_dir_find_file( dir, file->name, file );
-    if( l )
-    {
-        g_assert( file == (VFSFileInfo*)l->data );
-        file = vfs_file_info_ref( (VFSFileInfo*)l->data );
-    }
+    /* the file might be replaced by a new one with the same name */
+    if( l && file == (VFSFileInfo*)l->data )
+        file = vfs_file_info_ref( file );
     else
         file = NULL;
     g_mutex_unlock( dir->mutex );
@@ -486,13 +604,335 @@ VFSDir* vfs_dir_new( const char* path )
     return dir;
 }
 
+/* Move files loaded by the loader thread to dir->file_list, and announce them. */
+static void emit_pending_files( VFSDir* dir )
+{
+    GList *files, *l;
+
+    g_mutex_lock( dir->mutex );
+    if( dir->pending_idle )
+    {
+        g_source_remove( dir->pending_idle );
+        dir->pending_idle = 0;
+    }
+    files = dir->pending_files;
+    if( G_LIKELY( files ) )
+    {
+        dir->pending_files = NULL;
+        dir->n_pending_files = 0;
+        g_hash_table_destroy( dir->pending_hash );
+        dir->pending_hash = NULL;
+        /* The files are added to dir->file_list, and the list itself is passed to the handlers. */
+        for( l = files; l; l = l->next )
+            vfs_dir_add_file( dir, (VFSFileInfo*)l->data );
+    }
+    g_mutex_unlock( dir->mutex );
+
+    if( G_LIKELY( files ) )
+    {
+        g_signal_emit( dir, signals[FILE_LISTED_PARTIAL_SIGNAL], 0, files );
+        g_list_free( files );
+    }
+}
+
+static gboolean on_pending_files_idle( VFSDir* dir )
+{
+    GDK_THREADS_ENTER();
+    g_mutex_lock( dir->mutex );
+    dir->pending_idle = 0;  /* this idle handler is going to be removed */
+    g_mutex_unlock( dir->mutex );
+    emit_pending_files( dir );
+    GDK_THREADS_LEAVE();
+    return FALSE;
+}
+
 void on_list_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir )
 {
+    GList* sniff_files = (GList*)vfs_async_task_get_return_value( task );
+
     g_object_unref( dir->task );
     dir->task = NULL;
+    /* announce the files which are loaded after the last "file-listed-partial" */
+    emit_pending_files( dir );
     g_signal_emit( dir, signals[FILE_LISTED_SIGNAL], 0, is_cancelled );
     dir->file_listed = 1;
     dir->load_complete = 1;
+
+    /* check the content of the files whose mime-types are still unknown */
+    if( G_UNLIKELY( sniff_files ) )
+    {
+        if( is_cancelled )
+            vfs_file_info_list_free( sniff_files );
+        else
+            vfs_dir_sniff_files( dir, sniff_files );
+    }
+
+    /* some changes might be missed during loading */
+    if( G_UNLIKELY( dir->need_resync ) )
+    {
+        dir->need_resync = 0;
+        if( ! is_cancelled )
+            vfs_dir_resync( dir );
+    }
+}
+
+static guint n_resyncs = 0;
+
+void vfs_dir_resync( VFSDir* dir )
+{
+    /* The dir is being loaded or rescanned. Rescan it again after that. */
+    if( dir->task || dir->resync_task )
+    {
+        dir->need_resync = 1;
+        return;
+    }
+    if( G_UNLIKELY( ! dir->path ) )
+        return;
+
+    dir->resync_task = vfs_async_task_new( (VFSAsyncFunc)vfs_dir_resync_thread, dir );
+    g_signal_connect( dir->resync_task, "finish", G_CALLBACK(on_resync_task_finished), dir );
+    vfs_async_task_execute( dir->resync_task );
+}
+
+/* Compare the files read by vfs_dir_resync_thread() with dir->file_list,
+ * and only emit the signals for the differences. */
+void on_resync_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir )
+{
+    GList *files, *l;
+    GSList *deleted = NULL, *changed = NULL, *sl;
+    GHashTable* disk_files;
+    VFSFileInfo *file, *old;
+
+    files = (GList*)vfs_async_task_get_return_value( task );
+    g_object_unref( dir->resync_task );
+    dir->resync_task = NULL;
+
+    /* If the dir cannot be read, we'll get "delete" event of the dir itself. */
+    if( G_UNLIKELY( is_cancelled || ( ! files && ! g_file_test( dir->path, G_FILE_TEST_IS_DIR ) ) ) )
+    {
+        vfs_file_info_list_free( files );
+        return;
+    }
+    ++n_resyncs;
+
+    disk_files = g_hash_table_new( g_str_hash, g_str_equal );
+    for( l = files; l; l = l->next )
+    {
+        file = (VFSFileInfo*)l->data;
+        g_hash_table_insert( disk_files, file->name, file );
+    }
+
+    g_mutex_lock( dir->mutex );
+    for( l = dir->file_list; l; l = l->next )
+    {
+        old = (VFSFileInfo*)l->data;
+        file = (VFSFileInfo*)g_hash_table_lookup( disk_files, old->name );
+        if( ! file )
+            deleted = g_slist_prepend( deleted, g_strdup( old->name ) );
+        else if( file->mtime != old->mtime || file->size != old->size
+                 || file->mode != old->mode || file->uid != old->uid || file->gid != old->gid )
+            changed = g_slist_prepend( changed, g_strdup( old->name ) );
+    }
+    g_mutex_unlock( dir->mutex );
+    g_hash_table_destroy( disk_files );
+
+    for( sl = deleted; sl; sl = sl->next )
+    {
+        vfs_dir_emit_file_deleted( dir, (char*)sl->data, NULL );
+        g_free( sl->data );
+    }
+    g_slist_free( deleted );
+
+    for( sl = changed; sl; sl = sl->next )
+    {
+        vfs_dir_emit_file_changed( dir, (char*)sl->data, NULL );
+        g_free( sl->data );
+    }
+    g_slist_free( changed );
+
+    /* files already in the list are skipped by vfs_dir_emit_file_created() */
+    for( l = files; l; l = l->next )
+    {
+        file = (VFSFileInfo*)l->data;
+        vfs_dir_emit_file_created( dir, file->name, file );
+    }
+    vfs_file_info_list_free( files );
+
+    if( G_UNLIKELY( dir->need_resync ) )
+    {
+        dir->need_resync = 0;
+        vfs_dir_resync( dir );
+    }
+}
+
+guint vfs_dir_get_n_resyncs()
+{
+    return n_resyncs;
+}
+
+/*
+* The sniffing thread never touches the VFSFileInfo itself, since
+* update_file_info() can reload it in the main thread at any time.
+* The fields used in mime-type detection are copied when the file is queued.
+*/
+typedef struct _SniffJob
+{
+    VFSFileInfo* file;
+    char* name;
+    char* disp_name;
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    VFSMimeType* mime_type; /* the mime-type found by the thread */
+}SniffJob;
+
+static guint n_sniffed = 0;
+static guint n_sniff_changes = 0;
+
+/* Check the content of the files in a background thread, and update their
+ * mime-types. "file-changed" is only emitted if the mime-type is changed. */
+void vfs_dir_sniff_files( VFSDir* dir, GList* files )
+{
+    GList* l;
+    VFSFileInfo* file;
+    SniffJob* job;
+
+    g_mutex_lock( dir->mutex );
+    for( l = files; l; l = l->next )
+    {
+        file = (VFSFileInfo*)l->data;
+        job = g_slice_new( SniffJob );
+        job->file = file;   /* steal the reference */
+        job->name = g_strdup( file->name );
+        job->disp_name = file->disp_name == file->name ? job->name : g_strdup( file->disp_name );
+        job->mode = file->mode;
+        job->size = file->size;
+        job->mtime = file->mtime;
+        job->mime_type = NULL;
+        dir->sniff_jobs = g_list_prepend( dir->sniff_jobs, job );
+    }
+    g_mutex_unlock( dir->mutex );
+    g_list_free( files );
+
+    /* The running thread checks the new files, too */
+    if( dir->sniff_task )
+        return;
+    dir->sniff_task = vfs_async_task_new( (VFSAsyncFunc)vfs_dir_sniff_thread, dir );
+    g_signal_connect( dir->sniff_task, "finish", G_CALLBACK(on_sniff_task_finished), dir );
+    vfs_async_task_execute( dir->sniff_task );
+}
+
+gpointer vfs_dir_sniff_thread( VFSAsyncTask* task, VFSDir* dir )
+{
+    GList *jobs, *l, *results = NULL;
+    GString* path;
+    gsize path_len;
+    struct stat file_stat;
+    SniffJob* job;
+
+    path = g_string_new( dir->path );
+    if( G_LIKELY( path->len == 0 || path->str[ path->len - 1 ] != '/' ) )
+        g_string_append_c( path, '/' );
+    path_len = path->len;
+
+    for( ;; )
+    {
+        g_mutex_lock( dir->mutex );
+        jobs = dir->sniff_jobs;
+        dir->sniff_jobs = NULL;
+        g_mutex_unlock( dir->mutex );
+        if( ! jobs )
+            break;
+
+        for( l = jobs; l; l = l->next )
+        {
+            job = (SniffJob*)l->data;
+            /* If only we have the reference, the file is already removed from the dir.
+             * The job is left without a mime-type, and dropped later. */
+            if( G_UNLIKELY( vfs_async_task_is_cancelled( task ) || job->file->n_ref == 1 ) )
+                continue;
+            g_string_truncate( path, path_len );
+            g_string_append( path, job->name );
+            /* only these fields are used in mime-type detection */
+            file_stat.st_mode = job->mode;
+            file_stat.st_size = job->size;
+            job->mime_type = vfs_mime_type_get_from_file( path->str, job->disp_name, &file_stat );
+            g_atomic_int_inc( (gint*)&n_sniffed );
+        }
+        results = g_list_concat( jobs, results );
+    }
+    g_string_free( path, TRUE );
+    return results;
+}
+
+void sniff_jobs_free( GList* jobs )
+{
+    GList* l;
+    SniffJob* job;
+
+    for( l = jobs; l; l = l->next )
+    {
+        job = (SniffJob*)l->data;
+        vfs_file_info_unref( job->file );
+        if( job->disp_name != job->name )
+            g_free( job->disp_name );
+        g_free( job->name );
+        if( job->mime_type )
+            vfs_mime_type_unref( job->mime_type );
+        g_slice_free( SniffJob, job );
+    }
+    g_list_free( jobs );
+}
+
+void on_sniff_task_finished( VFSAsyncTask* task, gboolean is_cancelled, VFSDir* dir )
+{
+    GList *results, *l, *link;
+    SniffJob* job;
+    VFSFileInfo* file;
+    VFSMimeType* old_mime_type;
+
+    results = (GList*)vfs_async_task_get_return_value( task );
+    g_object_unref( dir->sniff_task );
+    dir->sniff_task = NULL;
+
+    for( l = results; l && ! is_cancelled; l = l->next )
+    {
+        job = (SniffJob*)l->data;
+        file = job->file;
+        if( ! job->mime_type )
+            continue;
+        g_mutex_lock( dir->mutex );
+        link = vfs_dir_find_file( dir, NULL, file );
+        g_mutex_unlock( dir->mutex );
+        /* the file might be deleted or replaced in the meantime */
+        if( ! link || link->data != file )
+            continue;
+        /* The file was changed and reloaded by update_file_info(),
+         * which has already found its new mime-type. */
+        if( file->mtime != job->mtime || file->size != job->size
+            || file->mode != job->mode )
+            continue;
+        if( job->mime_type == file->mime_type )
+            continue;
+        old_mime_type = file->mime_type;
+        file->mime_type = job->mime_type;
+        job->mime_type = old_mime_type;  /* freed by sniff_jobs_free() */
+        ++n_sniff_changes;
+        g_signal_emit( dir, signals[ FILE_CHANGED_SIGNAL ], 0, file );
+    }
+    sniff_jobs_free( results );
+
+    /* files which are added after the thread is finished */
+    if( G_UNLIKELY( dir->sniff_jobs && ! is_cancelled ) )
+        vfs_dir_sniff_files( dir, NULL );
+}
+
+void vfs_dir_get_sniff_stats( guint* n_files, guint* n_changes )
+{
+    if( n_files )
+        *n_files = g_atomic_int_get( (gint*)&n_sniffed );
+    if( n_changes )
+        *n_changes = n_sniff_changes;
 }
 
 static gboolean is_dir_trash( const char* path )
@@ -567,94 +1007,292 @@ gboolean is_dir_desktop( const char* path )
 }
 #endif
 
-gpointer vfs_dir_load_thread(  VFSAsyncTask* task, VFSDir* dir )
+/* Stat a directory entry relative to the fd of its parent dir.
+ * Only the fields used by VFSFileInfo are requested when statx() is available,
+ * which saves quite some round trips on network file systems. */
+static gboolean stat_dir_entry( int dir_fd, const char* name, struct stat* file_stat )
 {
-    const gchar * file_name;
-    char* full_path;
-    GDir* dir_content;
+#ifdef STATX_TYPE
+    static gboolean have_statx = TRUE;
+    struct statx stx;
+
+    if( G_LIKELY( have_statx ) )
+    {
+        if( statx( dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                   LOAD_STATX_MASK, &stx ) == 0 )
+        {
+            memset( file_stat, 0, sizeof(struct stat) );
+            file_stat->st_mode = stx.stx_mode;
+            file_stat->st_dev = makedev( stx.stx_dev_major, stx.stx_dev_minor );
+            file_stat->st_uid = stx.stx_uid;
+            file_stat->st_gid = stx.stx_gid;
+            file_stat->st_size = stx.stx_size;
+            file_stat->st_mtime = stx.stx_mtime.tv_sec;
+            file_stat->st_atime = stx.stx_atime.tv_sec;
+            file_stat->st_blksize = stx.stx_blksize;
+            file_stat->st_blocks = stx.stx_blocks;
+            return TRUE;
+        }
+        if( errno != ENOSYS )
+            return FALSE;
+        /* kernel is too old, fallback to fstatat() */
+        have_statx = FALSE;
+    }
+#endif
+    return ( fstatat( dir_fd, name, file_stat, AT_SYMLINK_NOFOLLOW ) == 0 );
+}
+
+static void load_trash_info( VFSFileInfo* file, const char* file_name, GKeyFile* kf )
+{
+    gboolean info_loaded;
+    char* info = g_strconcat( home_trash_dir, "/info/", file_name, ".trashinfo", NULL );
+
+    info_loaded = g_key_file_load_from_file( kf, info, 0, NULL );
+    g_free( info );
+    if( info_loaded )
+    {
+        char* ori_path = g_key_file_get_string( kf, "Trash Info", "Path", NULL );
+        if( ori_path )
+        {
+            /* Thanks to the stupid freedesktop.org spec, the filename is encoded
+             * like a URL, which is insane. This add nothing more than overhead. */
+            char* fake_uri = g_strconcat( "file://", ori_path, NULL );
+            g_free( ori_path );
+            ori_path = g_filename_from_uri( fake_uri, NULL, NULL );
+            /* g_debug( ori_path ); */
+
+            if( file->disp_name && file->disp_name != file->name )
+                g_free( file->disp_name );
+            file->disp_name = g_filename_display_basename( ori_path );
+            g_free( ori_path );
+        }
+    }
+}
+
+/* Publish a chunk of newly loaded files with only one lock acquisition.
+ * They are added to dir->file_list later in main thread by on_pending_files_idle(). */
+static void publish_loaded_files( VFSDir* dir, GList* files, int n_files )
+{
+    GList* l;
+
+    if( G_UNLIKELY( ! files ) )
+        return;
+
+    g_mutex_lock( dir->mutex );
+    if( ! dir->pending_hash )
+        dir->pending_hash = g_hash_table_new( g_str_hash, g_str_equal );
+    for( l = files; l; l = l->next )
+        g_hash_table_insert( dir->pending_hash, ((VFSFileInfo*)l->data)->name, l->data );
+    dir->pending_files = g_list_concat( files, dir->pending_files );
+    dir->n_pending_files += n_files;
+    if( 0 == dir->pending_idle )
+        dir->pending_idle = g_idle_add( (GSourceFunc)on_pending_files_idle, dir );
+    g_mutex_unlock( dir->mutex );
+}
+
+typedef struct _DirLoader
+{
+    VFSDir* dir;
+    int fd;
+    GString* path;  /* buffer used to build full paths of the files */
+    gsize path_len; /* length of the dir path in the buffer, including the trailing '/' */
+    GKeyFile* kf;   /* used to load *.trashinfo */
+    GList* chunk;   /* files not published yet */
+    int n_chunk;
+    int n_loaded;
+    GTimer* timer;  /* time elapsed since the last chunk was published */
+    gboolean resync; /* collect all files in chunk without publishing them */
+    GList* sniff_files; /* files whose content has to be checked later */
+}DirLoader;
+
+static void dir_loader_add( DirLoader* loader, const char* file_name )
+{
+    struct stat file_stat;
     VFSFileInfo* file;
+    gboolean need_magic;
 
-    dir->file_listed = 0;
-    dir->load_complete = 0;
+    /* skip . and .. */
+    if( G_UNLIKELY( file_name[0] == '.' &&
+                    ( file_name[1] == '\0' || ( file_name[1] == '.' && file_name[2] == '\0' ) ) ) )
+        return;
 
-    if ( dir->path )
+    if( G_UNLIKELY( ! stat_dir_entry( loader->fd, file_name, &file_stat ) ) )
+        return;
+
+    g_string_truncate( loader->path, loader->path_len );
+    g_string_append( loader->path, file_name );
+
+    file = vfs_file_info_new();
+    if( G_UNLIKELY( loader->resync ) )
+        vfs_file_info_get_from_stat( file, loader->path->str, file_name, &file_stat );
+    else
     {
-        /* Install file alteration monitor */
-        dir->monitor = vfs_file_monitor_add_dir( dir->path,
-                                             vfs_dir_monitor_callback,
-                                             dir );
+        /* Reading every file is slow, leave that to vfs_dir_sniff_thread() */
+        vfs_file_info_get_from_stat_fast( file, loader->path->str, file_name, &file_stat, &need_magic );
+        if( G_UNLIKELY( need_magic ) )
+            loader->sniff_files = g_list_prepend( loader->sniff_files, vfs_file_info_ref( file ) );
+    }
+
+    /* Special processing for desktop folder */
+    vfs_file_info_load_special_info( file, loader->path->str );
+
+    /* FIXME: load info, too when new file is added to trash dir */
+    if( G_UNLIKELY( loader->kf ) ) /* load info of trashed files */
+        load_trash_info( file, file_name, loader->kf );
 
-        dir_content = g_dir_open( dir->path, 0, NULL );
+    loader->chunk = g_list_prepend( loader->chunk, file );
+    ++loader->n_chunk;
+    ++loader->n_loaded;
+
+    if( G_LIKELY( ! loader->resync )
+        && ( loader->n_chunk >= LOAD_CHUNK_SIZE
+             || g_timer_elapsed( loader->timer, NULL ) * 1000 >= LOAD_CHUNK_INTERVAL ) )
+    {
+        publish_loaded_files( loader->dir, loader->chunk, loader->n_chunk );
+        loader->chunk = NULL;
+        loader->n_chunk = 0;
+        g_timer_start( loader->timer );
+    }
+}
 
-        if ( dir_content )
+#ifdef USE_GETDENTS64
+/* layout of the records returned by getdents64 syscall */
+struct linux_dirent64
+{
+    guint64 d_ino;
+    gint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Read the dir entries in large batches with getdents64 syscall
+ * rather than going through readdir() one by one. */
+static void dir_loader_read_entries( DirLoader* loader, VFSAsyncTask* task )
+{
+    char* buf = g_malloc( GETDENTS_BUF_SIZE );
+    long n, pos;
+    struct linux_dirent64* ent;
+
+    while( ! vfs_async_task_is_cancelled( task )
+           && ( n = syscall( SYS_getdents64, loader->fd, buf, GETDENTS_BUF_SIZE ) ) > 0 )
+    {
+        for( pos = 0; pos < n && ! vfs_async_task_is_cancelled( task ); pos += ent->d_reclen )
         {
-            GKeyFile* kf;
+            ent = (struct linux_dirent64*)( buf + pos );
+            dir_loader_add( loader, ent->d_name );
+        }
+    }
+    g_free( buf );
+}
+#else
+static void dir_loader_read_entries( DirLoader* loader, VFSAsyncTask* task )
+{
+    DIR* dirp;
+    struct dirent* ent;
+    int fd = dup( loader->fd );  /* closedir() closes the fd */
 
-            if( G_UNLIKELY(dir->is_trash) )
-                kf = g_key_file_new();
+    if( G_UNLIKELY( ! ( dirp = fdopendir( fd ) ) ) )
+    {
+        close( fd );
+        return;
+    }
+    while( ! vfs_async_task_is_cancelled( task ) && ( ent = readdir( dirp ) ) )
+        dir_loader_add( loader, ent->d_name );
+    closedir( dirp );
+}
+#endif
 
-            while ( ! vfs_async_task_is_cancelled( dir->task )
-                        && ( file_name = g_dir_read_name( dir_content ) ) )
-            {
-                full_path = g_build_filename( dir->path, file_name, NULL );
-                if ( !full_path )
-                    continue;
-                /* FIXME: Is locking GDK needed here? */
-                /* GDK_THREADS_ENTER(); */
-                file = vfs_file_info_new();
-                if ( G_LIKELY( vfs_file_info_get( file, full_path, file_name ) ) )
-                {
-                    g_mutex_lock( dir->mutex );
+static gboolean dir_loader_init( DirLoader* loader, VFSDir* dir )
+{
+    loader->fd = open( dir->path, O_RDONLY | O_DIRECTORY );
+    if ( loader->fd == -1 )
+        return FALSE;
+    loader->dir = dir;
+    loader->chunk = NULL;
+    loader->n_chunk = loader->n_loaded = 0;
+    loader->path = g_string_sized_new( 4096 );
+    g_string_append( loader->path, dir->path );
+    if( G_LIKELY( loader->path->len == 0 || loader->path->str[ loader->path->len - 1 ] != '/' ) )
+        g_string_append_c( loader->path, '/' );
+    loader->path_len = loader->path->len;
+    loader->kf = G_UNLIKELY(dir->is_trash) ? g_key_file_new() : NULL;
+    loader->timer = g_timer_new();
+    loader->resync = FALSE;
+    loader->sniff_files = NULL;
+    return TRUE;
+}
 
-                    /* Special processing for desktop folder */
-                    vfs_file_info_load_special_info( file, full_path );
+static void dir_loader_cleanup( DirLoader* loader )
+{
+    close( loader->fd );
+    g_timer_destroy( loader->timer );
+    g_string_free( loader->path, TRUE );
+    if( G_UNLIKELY(loader->kf) )
+        g_key_file_free( loader->kf );
+}
 
-                    /* FIXME: load info, too when new file is added to trash dir */
-                    if( G_UNLIKELY( dir->is_trash ) ) /* load info of trashed files */
-                    {
-                        gboolean info_loaded;
-                        char* info = g_strconcat( home_trash_dir, "/info/", file_name, ".trashinfo", NULL );
+gpointer vfs_dir_load_thread(  VFSAsyncTask* task, VFSDir* dir )
+{
+    DirLoader loader;
+    GList* sniff_files = NULL;
+#ifdef VFS_DIR_DEBUG_LOAD
+    static guint64 n_total_loaded = 0;
+    static gdouble total_elapsed = 0;
+    GTimer* timer;
+    gdouble elapsed;
+#endif
 
-                        info_loaded = g_key_file_load_from_file( kf, info, 0, NULL );
-                        g_free( info );
-                        if( info_loaded )
-                        {
-                            char* ori_path = g_key_file_get_string( kf, "Trash Info", "Path", NULL );
-                            if( ori_path )
-                            {
-                                /* Thanks to the stupid freedesktop.org spec, the filename is encoded
-                                 * like a URL, which is insane. This add nothing more than overhead. */
-                                char* fake_uri = g_strconcat( "file://", ori_path, NULL );
-                                g_free( ori_path );
-                                ori_path = g_filename_from_uri( fake_uri, NULL, NULL );
-                                /* g_debug( ori_path ); */
-
-                                if( file->disp_name && file->disp_name != file->name )
-                                    g_free( file->disp_name );
-                                file->disp_name = g_filename_display_basename( ori_path );
-                                g_free( ori_path );
-                            }
-                        }
-                    }
+    dir->file_listed = 0;
+    dir->load_complete = 0;
 
-                    dir->file_list = g_list_prepend( dir->file_list, file );
-                    g_mutex_unlock( dir->mutex );
-                    ++dir->n_files;
-                }
-                else
-                {
-                    vfs_file_info_unref( file );
-                }
-                /* GDK_THREADS_LEAVE(); */
-                g_free( full_path );
-            }
-            g_dir_close( dir_content );
+    if ( dir->path )
+    {
+        /* Install file alteration monitor */
+        dir->monitor = vfs_file_monitor_add_dir_batch( dir->path,
+                                                       vfs_dir_monitor_callback,
+                                                       dir );
 
-            if( G_UNLIKELY(dir->is_trash) )
-                g_key_file_free( kf );
+        if ( dir_loader_init( &loader, dir ) )
+        {
+#ifdef VFS_DIR_DEBUG_LOAD
+            timer = g_timer_new();
+#endif
+            dir_loader_read_entries( &loader, task );
+
+            /* publish the remaining files */
+            publish_loaded_files( dir, loader.chunk, loader.n_chunk );
+            sniff_files = loader.sniff_files;
+
+            dir_loader_cleanup( &loader );
+#ifdef VFS_DIR_DEBUG_LOAD
+            elapsed = g_timer_elapsed( timer, NULL );
+            g_timer_destroy( timer );
+            n_total_loaded += loader.n_loaded;
+            total_elapsed += elapsed;
+            g_debug( "%s: %d files loaded in %.3f s (%.0f files/s, %.0f files/s overall)",
+                     dir->path, loader.n_loaded, elapsed,
+                     elapsed > 0 ? loader.n_loaded / elapsed : 0,
+                     total_elapsed > 0 ? n_total_loaded / total_elapsed : 0 );
+#endif
         }
     }
-    return NULL;
+    /* checked by vfs_dir_sniff_files() after the dir is listed */
+    return sniff_files;
+}
+
+/* Read the whole dir again. The result is compared with dir->file_list
+ * in the main thread by on_resync_task_finished(). */
+gpointer vfs_dir_resync_thread( VFSAsyncTask* task, VFSDir* dir )
+{
+    DirLoader loader;
+
+    if ( ! dir_loader_init( &loader, dir ) )
+        return NULL;
+    loader.resync = TRUE;
+    dir_loader_read_entries( &loader, task );
+    dir_loader_cleanup( &loader );
+    return loader.chunk;
 }
 
 gboolean vfs_dir_is_loading( VFSDir* dir )
@@ -704,11 +1342,10 @@ gboolean update_file_info( VFSDir* dir, VFSFileInfo* file )
         else /* The file doesn't exist */
         {
             GList* l;
-            l = g_list_find( dir->file_list, file );
+            l = vfs_dir_find_file( dir, file_name, NULL );
             if( G_UNLIKELY(l) )
             {
-                dir->file_list = g_list_delete_link( dir->file_list, l );
-                --dir->n_files;
+                vfs_dir_remove_file( dir, file_name, l );
                 if ( file )
                 {
                     g_signal_emit( dir, signals[ FILE_DELETED_SIGNAL ], 0, file );
@@ -755,29 +1392,40 @@ gboolean notify_file_change( gpointer user_data )
 }
 
 /* Callback function which will be called when monitored events happen */
+/* All the events of the dir collected by the monitor are applied at once */
 void vfs_dir_monitor_callback( VFSFileMonitor* fm,
-                               VFSFileMonitorEvent event,
-                               const char* file_name,
+                               const VFSFileMonitorEventItem* events,
+                               guint n_events,
                                gpointer user_data )
 {
     VFSDir* dir = ( VFSDir* ) user_data;
-    GDK_THREADS_ENTER();
+    guint i;
 
-    switch ( event )
-    {
-    case VFS_FILE_MONITOR_CREATE:
-        vfs_dir_emit_file_created( dir, file_name, NULL );
-        break;
-    case VFS_FILE_MONITOR_DELETE:
-        vfs_dir_emit_file_deleted( dir, file_name, NULL );
-        break;
-    case VFS_FILE_MONITOR_CHANGE:
-        vfs_dir_emit_file_changed( dir, file_name, NULL );
-        break;
-    default:
-        g_warning("Error: unrecognized file monitor signal!");
-        return;
+    GDK_THREADS_ENTER();
+    /* the handlers of the signals might drop the last reference */
+    g_object_ref( dir );
+    for ( i = 0; i < n_events; ++i )
+    {
+        switch ( events[ i ].event )
+        {
+        case VFS_FILE_MONITOR_CREATE:
+            vfs_dir_emit_file_created( dir, events[ i ].file_name, NULL );
+            break;
+        case VFS_FILE_MONITOR_DELETE:
+            vfs_dir_emit_file_deleted( dir, events[ i ].file_name, NULL );
+            break;
+        case VFS_FILE_MONITOR_CHANGE:
+            vfs_dir_emit_file_changed( dir, events[ i ].file_name, NULL );
+            break;
+        case VFS_FILE_MONITOR_OVERFLOW:
+            vfs_dir_resync( dir );
+            break;
+        default:
+            g_warning("Error: unrecognized file monitor signal!");
+            break;
+        }
     }
+    g_object_unref( dir );
     GDK_THREADS_LEAVE();
 }
 
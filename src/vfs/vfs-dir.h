@@ -40,6 +40,7 @@ struct _VFSDir
     char* disp_path;
     GList* file_list;
     int n_files;
+    GHashTable* file_hash;  /* file name => link in file_list */
 
     union {
         int flags;
@@ -57,14 +58,27 @@ struct _VFSDir
     VFSFileMonitor* monitor;
     GMutex* mutex;  /* Used to guard file_list */
     VFSAsyncTask* task;
+    VFSAsyncTask* resync_task;
+    VFSAsyncTask* sniff_task;
     gboolean file_listed : 1;
     gboolean load_complete : 1;
     gboolean cancel: 1;
     gboolean show_hidden : 1;
+    gboolean need_resync : 1;
 
     struct _VFSThumbnailLoader* thumbnail_loader;
 
     GSList* changed_files;
+
+    /* Files loaded by the loader thread, but not announced by "file-listed-partial" yet */
+    GList* pending_files;
+    int n_pending_files;
+    GHashTable* pending_hash;  /* file name => file in pending_files */
+    guint pending_idle;
+
+    /* Files whose mime-types can only be known by checking their content,
+     * queued as jobs for the sniffing thread */
+    GList* sniff_jobs;
 };
 
 struct _VFSDirClass
@@ -76,6 +90,7 @@ struct _VFSDirClass
     void ( *file_changed ) ( VFSDir* dir, VFSFileInfo* file );
     void ( *thumbnail_loaded ) ( VFSDir* dir, VFSFileInfo* file );
     void ( *file_listed ) ( VFSDir* dir );
+    void ( *file_listed_partial ) ( VFSDir* dir, GList* files );
     void ( *load_complete ) ( VFSDir* dir );
     /*  void (*need_reload) ( VFSDir* dir ); */
     /*  void (*update_mime) ( VFSDir* dir ); */
@@ -93,6 +108,21 @@ gboolean vfs_dir_is_file_listed( VFSDir* dir );
 
 void vfs_dir_unload_thumbnails( VFSDir* dir, gboolean is_big );
 
+/* Rescan the dir, and emit signals for the files which are created, deleted,
+ * or changed since they were loaded. */
+void vfs_dir_resync( VFSDir* dir );
+
+/* number of rescans done by vfs_dir_resync() */
+guint vfs_dir_get_n_resyncs();
+
+/* Determine the mime-types of the files by their content in a background
+ * thread, and emit "file-changed" for the files whose types are changed.
+ * The dir takes the ownership of the list and the file infos in it. */
+void vfs_dir_sniff_files( VFSDir* dir, GList* files );
+
+/* number of files checked by vfs_dir_sniff_files(), and the ones whose types were changed */
+void vfs_dir_get_sniff_stats( guint* n_files, guint* n_changes );
+
 /* emit signals */
 void vfs_dir_emit_file_created( VFSDir* dir, const char* file_name, VFSFileInfo* file );
 void vfs_dir_emit_file_deleted( VFSDir* dir, const char* file_name, VFSFileInfo* file );
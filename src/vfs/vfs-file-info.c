@@ -106,6 +106,24 @@ gboolean vfs_file_info_get( VFSFileInfo* fi,
                             const char* base_name )
 {
     struct stat file_stat;
+
+    if ( lstat( file_path, &file_stat ) == 0 )
+        return vfs_file_info_get_from_stat( fi, file_path, base_name, &file_stat );
+
+    vfs_file_info_clear( fi );
+    if ( base_name )
+        fi->name = g_strdup( base_name );
+    else
+        fi->name = g_path_get_basename( file_path );
+    fi->mime_type = vfs_mime_type_get_from_type( XDG_MIME_TYPE_UNKNOWN );
+    return FALSE;
+}
+
+static void vfs_file_info_set_stat( VFSFileInfo* fi,
+                                    const char* file_path,
+                                    const char* base_name,
+                                    struct stat* file_stat )
+{
     vfs_file_info_clear( fi );
 
     if ( base_name )
@@ -113,35 +131,51 @@ gboolean vfs_file_info_get( VFSFileInfo* fi,
     else
         fi->name = g_path_get_basename( file_path );
 
-    if ( lstat( file_path, &file_stat ) == 0 )
+    /* This is time-consuming but can save much memory */
+    fi->mode = file_stat->st_mode;
+    fi->dev = file_stat->st_dev;
+    fi->uid = file_stat->st_uid;
+    fi->gid = file_stat->st_gid;
+    fi->size = file_stat->st_size;
+    fi->mtime = file_stat->st_mtime;
+    fi->atime = file_stat->st_atime;
+    fi->blksize = file_stat->st_blksize;
+    fi->blocks = file_stat->st_blocks;
+
+    if ( G_LIKELY( utf8_file_name && g_utf8_validate ( fi->name, -1, NULL ) ) )
     {
-        /* This is time-consuming but can save much memory */
-        fi->mode = file_stat.st_mode;
-        fi->dev = file_stat.st_dev;
-        fi->uid = file_stat.st_uid;
-        fi->gid = file_stat.st_gid;
-        fi->size = file_stat.st_size;
-        fi->mtime = file_stat.st_mtime;
-        fi->atime = file_stat.st_atime;
-        fi->blksize = file_stat.st_blksize;
-        fi->blocks = file_stat.st_blocks;
-
-        if ( G_LIKELY( utf8_file_name && g_utf8_validate ( fi->name, -1, NULL ) ) )
-        {
-            fi->disp_name = fi->name;   /* Don't duplicate the name and save memory */
-        }
-        else
-        {
-            fi->disp_name = g_filename_display_name( fi->name );
-        }
-        fi->mime_type = vfs_mime_type_get_from_file( file_path,
-                                                     fi->disp_name,
-                                                     &file_stat );
-        return TRUE;
+        fi->disp_name = fi->name;   /* Don't duplicate the name and save memory */
     }
     else
-        fi->mime_type = vfs_mime_type_get_from_type( XDG_MIME_TYPE_UNKNOWN );
-    return FALSE;
+    {
+        fi->disp_name = g_filename_display_name( fi->name );
+    }
+}
+
+gboolean vfs_file_info_get_from_stat( VFSFileInfo* fi,
+                                      const char* file_path,
+                                      const char* base_name,
+                                      struct stat* file_stat )
+{
+    vfs_file_info_set_stat( fi, file_path, base_name, file_stat );
+    fi->mime_type = vfs_mime_type_get_from_file( file_path,
+                                                 fi->disp_name,
+                                                 file_stat );
+    return TRUE;
+}
+
+gboolean vfs_file_info_get_from_stat_fast( VFSFileInfo* fi,
+                                           const char* file_path,
+                                           const char* base_name,
+                                           struct stat* file_stat,
+                                           gboolean* need_magic )
+{
+    vfs_file_info_set_stat( fi, file_path, base_name, file_stat );
+    fi->mime_type = vfs_mime_type_get_from_file_fast( file_path,
+                                                      fi->disp_name,
+                                                      file_stat,
+                                                      need_magic );
+    return TRUE;
 }
 
 const char* vfs_file_info_get_name( VFSFileInfo* fi )
@@ -548,7 +582,12 @@ gboolean vfs_file_info_open_file( VFSFileInfo* fi,
         {
             app = vfs_app_desktop_new( app_name );
             if ( ! vfs_app_desktop_get_exec( app ) )
+            {
+                /* the cached desktop entry is shared, so use an empty one */
+                vfs_app_desktop_unref( app );
+                app = vfs_app_desktop_new( NULL );
                 app->exec = g_strdup( app_name );   /* FIXME: app->exec */
+            }
             files = g_list_prepend( files, (gpointer) file_path );
             /* FIXME: working dir is needed */
             ret = vfs_app_desktop_open_files( gdk_screen_get_default(),
@@ -84,6 +84,22 @@ gboolean vfs_file_info_get( VFSFileInfo* fi,
                             const char* file_path,
                             const char* base_name );
 
+/* Same as vfs_file_info_get(), but use the result of a previous
+ * lstat()/fstatat() call instead of querying the file system again. */
+gboolean vfs_file_info_get_from_stat( VFSFileInfo* fi,
+                                      const char* file_path,
+                                      const char* base_name,
+                                      struct stat* file_stat );
+
+/* Same as vfs_file_info_get_from_stat(), but the content of the file is not
+ * read to determine its mime-type.  If that's needed, *need_magic is set to
+ * TRUE, and vfs_file_info_reload_mime_type() should be called later. */
+gboolean vfs_file_info_get_from_stat_fast( VFSFileInfo* fi,
+                                           const char* file_path,
+                                           const char* base_name,
+                                           struct stat* file_stat,
+                                           gboolean* need_magic );
+
 const char* vfs_file_info_get_name( VFSFileInfo* fi );
 const char* vfs_file_info_get_disp_name( VFSFileInfo* fi );
 
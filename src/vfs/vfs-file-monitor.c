@@ -24,24 +24,53 @@
 #include <sys/types.h>  /* for stat */
 #include <sys/stat.h>
 #include <errno.h>
+#ifdef USE_INOTIFY
+#include <sys/ioctl.h>  /* for FIONREAD */
+#endif
 
 #include <stdlib.h>
 #include <string.h>
 
 #include "glib-mem.h"
 
+/* Events are collected and merged for this interval (in ms) before dispatching */
+#define DISPATCH_INTERVAL   100
+
 typedef struct
 {
     VFSFileMonitorCallback callback;
+    VFSFileMonitorBatchCallback batch_callback; /* used if callback is NULL */
     gpointer user_data;
 }
 VFSFileMonitorCallbackEntry;
 
+typedef struct
+{
+    char* file_name;
+    VFSFileMonitorEvent event;
+    gboolean deleted : 1;   /* the file was deleted before "create" */
+    gboolean changed : 1;   /* the file was changed after "create" */
+}
+VFSFileMonitorPendingEvent;
+
 static GHashTable* monitor_hash = NULL;
 static GIOChannel* fam_io_channel = NULL;
 static guint fam_io_watch = 0;
+
+static GSList* pending_monitors = NULL; /* monitors having pending events */
+static guint dispatch_timeout = 0;
+
+static guint n_overflows = 0;
+
 #ifdef USE_INOTIFY
+/* Minimal size of the buffer used to read inotify events.
+ * The buffer grows if more data is available. */
+#define INOTIFY_BUF_SIZE    (64 * 1024)
+
 static int inotify_fd = -1;
+static GHashTable* wd_hash = NULL;  /* wd => monitor */
+static char* inotify_buf = NULL;
+static gsize inotify_buf_size = 0;
 #else
 static FAMConnection fam;
 #endif
@@ -51,6 +80,8 @@ static gboolean on_fam_event( GIOChannel *channel,
                               GIOCondition cond,
                               gpointer user_data );
 
+static void free_pending_events( VFSFileMonitor* monitor );
+
 
 static gboolean connect_to_fam()
 {
@@ -125,6 +156,21 @@ void vfs_file_monitor_clean()
         g_hash_table_destroy( monitor_hash );
         monitor_hash = NULL;
     }
+#ifdef USE_INOTIFY
+    if ( wd_hash )
+    {
+        g_hash_table_destroy( wd_hash );
+        wd_hash = NULL;
+    }
+    g_free( inotify_buf );
+    inotify_buf = NULL;
+    inotify_buf_size = 0;
+#endif
+    if ( dispatch_timeout )
+    {
+        g_source_remove( dispatch_timeout );
+        dispatch_timeout = 0;
+    }
 }
 
 /*
@@ -134,15 +180,19 @@ void vfs_file_monitor_clean()
 gboolean vfs_file_monitor_init()
 {
     monitor_hash = g_hash_table_new( g_str_hash, g_str_equal );
+#ifdef USE_INOTIFY
+    wd_hash = g_hash_table_new( g_direct_hash, g_direct_equal );
+#endif
     if ( ! connect_to_fam() )
         return FALSE;
     return TRUE;
 }
 
-VFSFileMonitor* vfs_file_monitor_add( char* path,
-                                      gboolean is_dir,
-                                      VFSFileMonitorCallback cb,
-                                      gpointer user_data )
+static VFSFileMonitor* monitor_add( char* path,
+                                    gboolean is_dir,
+                                    VFSFileMonitorCallback cb,
+                                    VFSFileMonitorBatchCallback batch_cb,
+                                    gpointer user_data )
 {
     VFSFileMonitor * monitor;
     VFSFileMonitorCallbackEntry cb_ent;
@@ -191,6 +241,7 @@ VFSFileMonitor* vfs_file_monitor_add( char* path,
                         g_strerror ( errno ) );
             return NULL;
         }
+        g_hash_table_insert( wd_hash, GINT_TO_POINTER( monitor->wd ), monitor );
 #else /* Use FAM|gamin */
         if ( is_dir )
         {
@@ -213,9 +264,10 @@ VFSFileMonitor* vfs_file_monitor_add( char* path,
     if( G_LIKELY(monitor) )
     {
         /* g_debug( "monitor installed: %s, %p", path, monitor ); */
-        if ( cb )
+        if ( cb || batch_cb )
         { /* Install a callback */
             cb_ent.callback = cb;
+            cb_ent.batch_callback = batch_cb;
             cb_ent.user_data = user_data;
             monitor->callbacks = g_array_append_val( monitor->callbacks, cb_ent );
         }
@@ -224,19 +276,36 @@ VFSFileMonitor* vfs_file_monitor_add( char* path,
     return monitor;
 }
 
-void vfs_file_monitor_remove( VFSFileMonitor * fm,
-                              VFSFileMonitorCallback cb,
-                              gpointer user_data )
+VFSFileMonitor* vfs_file_monitor_add( char* path,
+                                      gboolean is_dir,
+                                      VFSFileMonitorCallback cb,
+                                      gpointer user_data )
+{
+    return monitor_add( path, is_dir, cb, NULL, user_data );
+}
+
+VFSFileMonitor* vfs_file_monitor_add_dir_batch( char* path,
+                                                VFSFileMonitorBatchCallback cb,
+                                                gpointer user_data )
+{
+    return monitor_add( path, TRUE, NULL, cb, user_data );
+}
+
+static void monitor_remove( VFSFileMonitor * fm,
+                            VFSFileMonitorCallback cb,
+                            VFSFileMonitorBatchCallback batch_cb,
+                            gpointer user_data )
 {
     int i;
     VFSFileMonitorCallbackEntry* callbacks;
 
-    if ( cb && fm && fm->callbacks )
+    if ( ( cb || batch_cb ) && fm && fm->callbacks )
     {
         callbacks = ( VFSFileMonitorCallbackEntry* ) fm->callbacks->data;
         for ( i = 0; i < fm->callbacks->len; ++i )
         {
-            if ( callbacks[ i ].callback == cb && callbacks[ i ].user_data == user_data )
+            if ( callbacks[ i ].callback == cb && callbacks[ i ].batch_callback == batch_cb
+                 && callbacks[ i ].user_data == user_data )
             {
                 fm->callbacks = g_array_remove_index_fast ( fm->callbacks, i );
                 break;
@@ -248,10 +317,14 @@ void vfs_file_monitor_remove( VFSFileMonitor * fm,
     {
 #ifdef USE_INOTIFY /* Linux inotify */
         inotify_rm_watch ( inotify_fd, fm->wd );
+        /* 2 different paths can have the same wd because of link */
+        if ( g_hash_table_lookup( wd_hash, GINT_TO_POINTER( fm->wd ) ) == fm )
+            g_hash_table_remove( wd_hash, GINT_TO_POINTER( fm->wd ) );
 #else /*  Use FAM|gamin */
 
         FAMCancelMonitor( &fam, &fm->request );
 #endif
+        free_pending_events( fm );
         g_hash_table_remove( monitor_hash, fm->path );
         g_free( fm->path );
         g_array_free( fm->callbacks, TRUE );
@@ -259,6 +332,20 @@ void vfs_file_monitor_remove( VFSFileMonitor * fm,
     }
 }
 
+void vfs_file_monitor_remove( VFSFileMonitor * fm,
+                              VFSFileMonitorCallback cb,
+                              gpointer user_data )
+{
+    monitor_remove( fm, cb, NULL, user_data );
+}
+
+void vfs_file_monitor_remove_batch( VFSFileMonitor * fm,
+                                    VFSFileMonitorBatchCallback cb,
+                                    gpointer user_data )
+{
+    monitor_remove( fm, NULL, cb, user_data );
+}
+
 static void reconnect_fam( gpointer key,
                            gpointer value,
                            gpointer user_data )
@@ -284,6 +371,7 @@ static void reconnect_fam( gpointer key,
                         g_strerror ( errno ) );
             return ;
         }
+        g_hash_table_insert( wd_hash, GINT_TO_POINTER( monitor->wd ), monitor );
 #else
         if ( S_ISDIR( file_stat.st_mode ) )
         {
@@ -305,54 +393,205 @@ static void reconnect_fam( gpointer key,
 }
 
 #ifdef USE_INOTIFY
-static gboolean find_monitor( gpointer key,
-                              gpointer value,
-                              gpointer user_data )
-{
-    int wd = GPOINTER_TO_INT( user_data );
-    VFSFileMonitor* monitor = ( VFSFileMonitor* ) value;
-    return ( monitor->wd == wd );
-}
-
 static VFSFileMonitorEvent translate_inotify_event( int inotify_mask )
 {
     if ( inotify_mask & ( IN_CREATE | IN_MOVED_TO ) )
         return VFS_FILE_MONITOR_CREATE;
     else if ( inotify_mask & ( IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_UNMOUNT ) )
         return VFS_FILE_MONITOR_DELETE;
-    else if ( inotify_mask & ( IN_MODIFY | IN_ATTRIB ) )
-        return VFS_FILE_MONITOR_CHANGE;
+    /* IN_MODIFY, IN_ATTRIB, and others */
+    return VFS_FILE_MONITOR_CHANGE;
 }
 #endif
 
-static void dispatch_event( VFSFileMonitor * monitor,
-                            VFSFileMonitorEvent evt,
-                            const char * file_name )
+/*
+ * Call the batch callbacks once with all the events, and the other
+ * callbacks with the events one by one.
+ */
+static void dispatch_events( VFSFileMonitor * monitor,
+                             const VFSFileMonitorEventItem* events,
+                             guint n_events )
 {
     VFSFileMonitorCallbackEntry * cb;
-    VFSFileMonitorCallback func;
     int i;
+    guint j;
     /* Call the callback functions */
-    if ( monitor->callbacks && monitor->callbacks->len )
+    /* NOTE: The callbacks can be removed while being called. */
+    for ( i = 0; monitor->callbacks && i < monitor->callbacks->len; ++i )
     {
         cb = ( VFSFileMonitorCallbackEntry* ) monitor->callbacks->data;
-        for ( i = 0; i < monitor->callbacks->len; ++i )
+        if ( ! cb[ i ].callback )
+            cb[ i ].batch_callback( monitor, events, n_events, cb[ i ].user_data );
+    }
+    for ( j = 0; j < n_events; ++j )
+    {
+        for ( i = 0; monitor->callbacks && i < monitor->callbacks->len; ++i )
+        {
+            cb = ( VFSFileMonitorCallbackEntry* ) monitor->callbacks->data;
+            if ( cb[ i ].callback )
+                cb[ i ].callback( monitor, events[ j ].event, events[ j ].file_name,
+                                  cb[ i ].user_data );
+        }
+    }
+}
+
+static void append_event_item( GArray* items, VFSFileMonitorEvent evt,
+                               const char* file_name )
+{
+    VFSFileMonitorEventItem item;
+    item.event = evt;
+    item.file_name = file_name;
+    g_array_append_val( items, item );
+}
+
+static void free_pending_event( VFSFileMonitorPendingEvent* pe )
+{
+    g_free( pe->file_name );
+    g_slice_free( VFSFileMonitorPendingEvent, pe );
+}
+
+static void free_pending_events( VFSFileMonitor* monitor )
+{
+    if ( monitor->pending_hash )
+    {
+        g_hash_table_destroy( monitor->pending_hash );
+        monitor->pending_hash = NULL;
+        g_list_foreach( monitor->pending, (GFunc)free_pending_event, NULL );
+        g_list_free( monitor->pending );
+        monitor->pending = NULL;
+        pending_monitors = g_slist_remove( pending_monitors, monitor );
+    }
+}
+
+/* Dispatch all pending events, one monitor after another */
+static gboolean on_dispatch_timeout( gpointer user_data )
+{
+    VFSFileMonitor* monitor;
+    VFSFileMonitorPendingEvent* pe;
+    GList *events, *l;
+    GArray* items;
+
+    dispatch_timeout = 0;
+    items = g_array_new( FALSE, FALSE, sizeof( VFSFileMonitorEventItem ) );
+    while ( pending_monitors )
+    {
+        monitor = ( VFSFileMonitor* ) pending_monitors->data;
+        pending_monitors = g_slist_delete_link( pending_monitors, pending_monitors );
+
+        events = g_list_reverse( monitor->pending );
+        monitor->pending = NULL;
+        g_hash_table_destroy( monitor->pending_hash );
+        monitor->pending_hash = NULL;
+
+        for ( l = events; l; l = l->next )
         {
-            func = cb[ i ].callback;
-            func( monitor, evt, file_name, cb[ i ].user_data );
+            pe = ( VFSFileMonitorPendingEvent* ) l->data;
+            if ( pe->deleted )
+                append_event_item( items, VFS_FILE_MONITOR_DELETE, pe->file_name );
+            append_event_item( items, pe->event, pe->file_name );
+            if ( pe->changed )
+                append_event_item( items, VFS_FILE_MONITOR_CHANGE, pe->file_name );
         }
+
+        /* prevent the monitor from being freed by the callbacks */
+        g_atomic_int_inc( &monitor->n_ref );
+        dispatch_events( monitor, ( VFSFileMonitorEventItem* ) items->data, items->len );
+        g_array_set_size( items, 0 );
+        g_list_foreach( events, (GFunc)free_pending_event, NULL );
+        g_list_free( events );
+        vfs_file_monitor_remove( monitor, NULL, NULL );
+    }
+    g_array_free( items, TRUE );
+    return FALSE;
+}
+
+/*
+ * Queue the event, and merge it with the pending events of the same file.
+ * All queued events are dispatched later in on_dispatch_timeout().
+ */
+static void queue_event( VFSFileMonitor * monitor,
+                         VFSFileMonitorEvent evt,
+                         const char * file_name )
+{
+    VFSFileMonitorPendingEvent* pe;
+
+    if ( ! monitor->pending_hash )
+    {
+        monitor->pending_hash = g_hash_table_new( g_str_hash, g_str_equal );
+        pending_monitors = g_slist_prepend( pending_monitors, monitor );
+        if ( 0 == dispatch_timeout )
+            dispatch_timeout = g_timeout_add( DISPATCH_INTERVAL, on_dispatch_timeout, NULL );
+    }
+
+    if ( G_UNLIKELY( evt == VFS_FILE_MONITOR_OVERFLOW ) )
+    {
+        /* The monitored path should be rescanned, so the pending events are useless.
+         * The overflow event is not added to the hash table, so it's never merged. */
+        g_hash_table_destroy( monitor->pending_hash );
+        monitor->pending_hash = g_hash_table_new( g_str_hash, g_str_equal );
+        g_list_foreach( monitor->pending, (GFunc)free_pending_event, NULL );
+        g_list_free( monitor->pending );
+        pe = g_slice_new0( VFSFileMonitorPendingEvent );
+        pe->file_name = g_strdup( file_name );
+        pe->event = evt;
+        monitor->pending = g_list_prepend( NULL, pe );
+        return;
+    }
+
+    pe = ( VFSFileMonitorPendingEvent* ) g_hash_table_lookup( monitor->pending_hash, file_name );
+    if ( G_LIKELY( ! pe ) )
+    {
+        pe = g_slice_new0( VFSFileMonitorPendingEvent );
+        pe->file_name = g_strdup( file_name );
+        pe->event = evt;
+        g_hash_table_insert( monitor->pending_hash, pe->file_name, pe );
+        monitor->pending = g_list_prepend( monitor->pending, pe );
+        return;
+    }
+
+    switch ( evt )
+    {
+    case VFS_FILE_MONITOR_CREATE:
+        /* The file is replaced by a new one. Both events are needed. */
+        if ( pe->event == VFS_FILE_MONITOR_DELETE )
+            pe->deleted = TRUE;
+        pe->event = VFS_FILE_MONITOR_CREATE;
+        pe->changed = FALSE;
+        break;
+    case VFS_FILE_MONITOR_DELETE:
+        /* previous events of the file don't matter anymore */
+        pe->event = VFS_FILE_MONITOR_DELETE;
+        pe->deleted = pe->changed = FALSE;
+        break;
+    case VFS_FILE_MONITOR_CHANGE:
+        if ( pe->event == VFS_FILE_MONITOR_CREATE )
+            pe->changed = TRUE;
+        break;
+    default:
+        break;
     }
 }
 
+#ifdef USE_INOTIFY
+static void queue_overflow( gpointer key, gpointer value, gpointer user_data )
+{
+    VFSFileMonitor* monitor = ( VFSFileMonitor* ) value;
+    queue_event( monitor, VFS_FILE_MONITOR_OVERFLOW, monitor->path );
+}
+#endif
+
+guint vfs_file_monitor_get_n_overflows()
+{
+    return n_overflows;
+}
+
 /* event handler of all FAM events */
 static gboolean on_fam_event( GIOChannel * channel,
                               GIOCondition cond,
                               gpointer user_data )
 {
 #ifdef USE_INOTIFY /* Linux inootify */
-#define BUF_LEN (1024 * (sizeof (struct inotify_event) + 16))
-    char buf[ BUF_LEN ];
-    int i, len;
+    int i, len, avail;
 #else /* FAM|gamin */
     FAMEvent evt;
 #endif
@@ -370,6 +609,10 @@ static gboolean on_fam_event( GIOChannel * channel,
               So we have to reconnect to FAM server.
             */
             connect_to_fam();
+#ifdef USE_INOTIFY
+            g_hash_table_destroy( wd_hash );
+            wd_hash = g_hash_table_new( g_direct_hash, g_direct_equal );
+#endif
             g_hash_table_foreach( monitor_hash, ( GHFunc ) reconnect_fam, NULL );
         }
         return TRUE; /* don't need to remove the event source since
@@ -377,44 +620,68 @@ static gboolean on_fam_event( GIOChannel * channel,
     }
 
 #ifdef USE_INOTIFY /* Linux inotify */
-    while ( ( len = read ( inotify_fd, buf, BUF_LEN ) ) < 0
-            && errno == EINTR );
-    if ( len < 0 )
+    /* Read all available events, with a buffer large enough to get them at once. */
+    for ( ;; )
     {
-        g_warning ( "Error reading inotify event: %s",
-                    g_strerror ( errno ) );
-        /* goto error_cancel; */
-        return FALSE;
-    }
+        if ( ioctl( inotify_fd, FIONREAD, &avail ) == -1 || avail < INOTIFY_BUF_SIZE )
+            avail = INOTIFY_BUF_SIZE;
+        if ( G_UNLIKELY( avail > inotify_buf_size ) )
+        {
+            inotify_buf_size = avail;
+            inotify_buf = g_realloc( inotify_buf, inotify_buf_size );
+        }
 
-    if ( len == 0 )
-    {
-        /*
-        * FIXME: handle this better?
-        */
-        g_warning ( "Error reading inotify event: supplied buffer was too small" );
-        /* goto error_cancel; */
-        return FALSE;
-    }
-    i = 0;
-    while ( i < len )
-    {
-        struct inotify_event * ievent = ( struct inotify_event * ) & buf [ i ];
-        /* FIXME: 2 different paths can have the same wd because of link */
-        monitor = ( VFSFileMonitor* ) g_hash_table_find(
-                      monitor_hash,
-                      find_monitor,
-                      GINT_TO_POINTER( ievent->wd ) );
-        if( G_LIKELY(monitor) )
+        while ( ( len = read ( inotify_fd, inotify_buf, inotify_buf_size ) ) < 0
+                && errno == EINTR );
+        if ( len < 0 )
         {
-            const char* file_name;
-            file_name = ievent->len > 0 ? ievent->name : monitor->path;
-            g_debug("inotify (%d) :%s", ievent->mask, file_name);
-            dispatch_event( monitor,
-                            translate_inotify_event( ievent->mask ),
-                            file_name );
+            if ( errno == EAGAIN )  /* all events are read */
+                break;
+            g_warning ( "Error reading inotify event: %s",
+                        g_strerror ( errno ) );
+            /* goto error_cancel; */
+            return FALSE;
+        }
+
+        if ( len == 0 )
+        {
+            /*
+            * FIXME: handle this better?
+            */
+            g_warning ( "Error reading inotify event: supplied buffer was too small" );
+            /* goto error_cancel; */
+            return FALSE;
+        }
+        i = 0;
+        while ( i < len )
+        {
+            struct inotify_event * ievent = ( struct inotify_event * ) & inotify_buf [ i ];
+            i += sizeof ( struct inotify_event ) + ievent->len;
+
+            if ( G_UNLIKELY( ievent->mask & IN_Q_OVERFLOW ) )
+            {
+                /* Some events are lost, and we don't know which dirs are affected. */
+                ++n_overflows;
+                g_warning( "inotify event queue overflowed, rescanning monitored paths" );
+                g_hash_table_foreach( monitor_hash, queue_overflow, NULL );
+                continue;
+            }
+            if ( ievent->mask & IN_IGNORED ) /* the watch was removed */
+                continue;
+
+            /* FIXME: 2 different paths can have the same wd because of link */
+            monitor = ( VFSFileMonitor* ) g_hash_table_lookup( wd_hash,
+                                                               GINT_TO_POINTER( ievent->wd ) );
+            if( G_LIKELY(monitor) )
+            {
+                const char* file_name;
+                file_name = ievent->len > 0 ? ievent->name : monitor->path;
+                /* g_debug("inotify (%d) :%s", ievent->mask, file_name); */
+                queue_event( monitor,
+                             translate_inotify_event( ievent->mask ),
+                             file_name );
+            }
         }
-        i += sizeof ( struct inotify_event ) + ievent->len;
     }
 #else /* FAM|gamin */
     while ( FAMPending( &fam ) )
@@ -432,8 +699,7 @@ static gboolean on_fam_event( GIOChannel * channel,
                           Should we delete original request, and create a new one when this happens?
                 */
                 /* g_debug("FAM event(%d): %s", evt.code, evt.filename); */
-                /* Call the callback functions */
-                dispatch_event( monitor, evt.code, evt.filename );
+                queue_event( monitor, evt.code, evt.filename );
                 break;
                 /* Other events are not supported */
             default:
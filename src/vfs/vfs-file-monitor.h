@@ -39,13 +39,15 @@ G_BEGIN_DECLS
 typedef enum{
   VFS_FILE_MONITOR_CREATE,
   VFS_FILE_MONITOR_DELETE,
-  VFS_FILE_MONITOR_CHANGE
+  VFS_FILE_MONITOR_CHANGE,
+  VFS_FILE_MONITOR_OVERFLOW /* some events were lost, file_name is the monitored path */
 }VFSFileMonitorEvent;
 #else
 typedef enum{
   VFS_FILE_MONITOR_CREATE = FAMCreated,
   VFS_FILE_MONITOR_DELETE = FAMDeleted,
-  VFS_FILE_MONITOR_CHANGE = FAMChanged
+  VFS_FILE_MONITOR_CHANGE = FAMChanged,
+  VFS_FILE_MONITOR_OVERFLOW = -1
 }VFSFileMonitorEvent;
 #endif
 
@@ -61,18 +63,38 @@ struct _VFSFileMonitor{
   FAMRequest request;
 #endif
   GArray* callbacks;
+  /* events waiting to be dispatched */
+  GHashTable* pending_hash; /* file name => pending event */
+  GList* pending;           /* pending events in reverse order */
 };
 
 /* Callback function which will be called when monitored events happen
  *  NOTE: GDK_THREADS_ENTER and GDK_THREADS_LEAVE might be needed
  *  if gtk+ APIs are called in this callback, since the callback is called from
- *  IO channel handler.
+ *  a timeout handler.
+ *  Events are not delivered immediately. They are collected for a short while,
+ *  and multiple events of the same file are merged.
  */
 typedef void (*VFSFileMonitorCallback)( VFSFileMonitor* fm,
                                         VFSFileMonitorEvent event,
                                         const char* file_name,
                                         gpointer user_data );
 
+typedef struct _VFSFileMonitorEventItem
+{
+  VFSFileMonitorEvent event;
+  const char* file_name;
+}VFSFileMonitorEventItem;
+
+/* Callback function which gets all the events of a monitor collected in
+ * one interval at once, in the order they happened.
+ * The same notes as VFSFileMonitorCallback apply.
+ */
+typedef void (*VFSFileMonitorBatchCallback)( VFSFileMonitor* fm,
+                                             const VFSFileMonitorEventItem* events,
+                                             guint n_events,
+                                             gpointer user_data );
+
 /*
 * Init monitor:
 * Establish connection with gamin/fam.
@@ -114,6 +136,18 @@ VFSFileMonitor* vfs_file_monitor_add( char* path,
 #define vfs_file_monitor_add_dir( path, cb, user_data )  \
                     vfs_file_monitor_add(path, TRUE, cb, user_data )
 
+/*
+* Monitor changes of a directory, and get the events in batches.
+*
+* Parameters:
+* path: the dir to be monitored
+* cb: callback function to be called with all pending events of the dir.
+* user_data: user data to be passed to callback function.
+*/
+VFSFileMonitor* vfs_file_monitor_add_dir_batch( char* path,
+                                                VFSFileMonitorBatchCallback cb,
+                                                gpointer user_data );
+
 /*
  * Remove previously installed monitor.
  */
@@ -121,11 +155,23 @@ void vfs_file_monitor_remove( VFSFileMonitor* fm,
                               VFSFileMonitorCallback cb,
                               gpointer user_data );
 
+/*
+ * Remove a monitor installed by vfs_file_monitor_add_dir_batch().
+ */
+void vfs_file_monitor_remove_batch( VFSFileMonitor* fm,
+                                    VFSFileMonitorBatchCallback cb,
+                                    gpointer user_data );
+
 /*
  * Clearn up and shutdown file alteration monitor.
  */
 void vfs_file_monitor_clean();
 
+/*
+ * Number of times the event queue of the kernel overflowed.
+ */
+guint vfs_file_monitor_get_n_overflows();
+
 G_END_DECLS
 
 #endif
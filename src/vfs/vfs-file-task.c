@@ -10,6 +10,10 @@
 *
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for copy_file_range() */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
@@ -21,6 +25,18 @@
 #include <utime.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>  /* for major() and minor() */
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>   /* for FICLONE */
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>    /* for statfs() */
+#endif
 
 #include <glib.h>
 #include "glib-mem.h"
@@ -31,9 +47,12 @@
 #include <stdlib.h> /* for mkstemp */
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
 
 #include "vfs-dir.h"
 
+typedef struct _VFSCopyEngine VFSCopyEngine;
+
 const mode_t chmod_flags[] =
     {
         S_IRUSR, S_IWUSR, S_IXUSR,
@@ -43,27 +62,93 @@ const mode_t chmod_flags[] =
     };
 
 /*
-* void get_total_size_of_dir( const char* path, off_t* size )
-* Recursively count total size of all files in the specified directory.
-* If the path specified is a file, the size of the file is directly returned.
-* cancel is used to cancel the operation. This function will check the value
-* pointed by cancel in every iteration. If cancel is set to TRUE, the
-* calculation is cancelled.
-* NOTE: *size should be set to zero before calling this function.
+* void get_total_size_of_dir( VFSFileTask* task, const char* path )
+* Recursively count total size of all files in the specified directory,
+* and add it to task->total_size.
+* If the path specified is a file, the size of the file is directly added.
+* Called by the size thread, the calculation stops when the task is aborted.
 */
 static void get_total_size_of_dir( VFSFileTask* task,
-                                   const char* path,
-                                   off_t* size );
+                                   const char* path );
+
+/* task->progress is also updated by the copy workers, and
+ * task->total_size by the size thread */
+G_LOCK_DEFINE_STATIC( progress );
+
+static void add_progress( VFSFileTask* task, off_t size )
+{
+    G_LOCK( progress );
+    task->progress += size;
+    G_UNLOCK( progress );
+}
+
+static void add_total_size( VFSFileTask* task, off_t size )
+{
+    G_LOCK( progress );
+    task->total_size += size;
+    G_UNLOCK( progress );
+}
+
+/* the progress is published at most once in this interval, in microseconds */
+#define PROGRESS_INTERVAL   ( G_USEC_PER_SEC / 10 )
+
+/* Get a copy of name to be published, reusing old if they are the same */
+static char* dup_progress_name( char* old, const char* name )
+{
+    if ( ! name )
+        return NULL;
+    if ( old && 0 == strcmp( old, name ) )
+        return old;
+    return g_strdup( name );
+}
 
 static gboolean
 call_progress_callback( VFSFileTask* task )
 {
-    /* FIXME: This has some impact on performance */
-    gdouble percent = ( ( gdouble ) task->progress ) / task->total_size;
-    int ipercent = ( int ) ( percent * 100 );
-
-    if ( ipercent != task->percent )
-        task->percent = ipercent;
+    gdouble percent;
+    int ipercent;
+    char *old_file, *new_file, *old_dest, *new_dest;
+    GTimeVal now;
+
+    /* This is called for every file and every chunk of data copied,
+     * so most calls only check the time. */
+    g_get_current_time( &now );
+    if ( ( now.tv_sec - task->last_progress.tv_sec ) * G_USEC_PER_SEC
+         + ( now.tv_usec - task->last_progress.tv_usec ) < PROGRESS_INTERVAL )
+        return FALSE;
+    task->last_progress = now;
+
+    /* current_file and current_dest may be freed by the task thread at any
+     * time, so copies of them are published for vfs_file_task_get_progress().
+     * Only the task thread changes the copies, so it can read them without
+     * the lock. */
+    old_file = task->progress_file;
+    new_file = dup_progress_name( old_file, task->current_file );
+    old_dest = task->progress_dest;
+    new_dest = dup_progress_name( old_dest, task->current_dest );
+
+    G_LOCK( progress );
+    percent = task->total_size > 0 ?
+              ( ( gdouble ) task->progress ) / task->total_size : 0;
+    ipercent = ( int ) ( percent * 100 );
+    if ( ! task->total_size_known )
+    {
+        /* The total still grows, so the percentage can go backwards.
+         * Hold it instead, and don't reach 100% before the end is known. */
+        ipercent = MIN( ipercent, 99 );
+        ipercent = MAX( ipercent, task->percent );
+    }
+    else if ( ipercent > 100 )
+        ipercent = 100;
+    task->percent = ipercent;
+    task->progress_file = new_file;
+    task->progress_dest = new_dest;
+    G_UNLOCK( progress );
+
+    if ( old_file != new_file )
+        g_free( old_file );
+    if ( old_dest != new_dest )
+        g_free( old_dest );
 
     if ( task->progress_cb )
     {
@@ -99,6 +184,293 @@ static gboolean should_abort( VFSFileTask* task )
     return ( task->state == VFS_FILE_TASK_ABORTED );
 }
 
+/* Used by the size thread, which cannot ask the user with should_abort() */
+static gboolean is_size_scan_stopped( VFSFileTask* task )
+{
+    /* total_size_known is only set early when the scan isn't needed anymore */
+    return ( task->state == VFS_FILE_TASK_ABORTED || task->total_size_known );
+}
+
+/* #define VFS_FILE_TASK_DEBUG_COPY */
+
+/* data copied by the kernel in one call, progress is updated after every chunk */
+#define COPY_CHUNK_SIZE     (4 * 1024 * 1024)
+/* buffer used when the data cannot be copied by the kernel */
+#define COPY_BUFFER_SIZE    (256 * 1024)
+
+/* max number of threads copying files between two non-rotational devices */
+#define MAX_COPY_WORKERS    8
+/* max number of files queued for the copy workers */
+#define MAX_COPY_JOBS       (MAX_COPY_WORKERS * 16)
+
+/*
+* Files are copied with a pool of worker threads when both the source
+* and the destination devices can handle many requests at once.
+* The task thread walks the tree, creates the dirs, asks the user, and
+* calls all the callbacks, while the workers copy the regular files.
+* The attributes of a dir are set after all files in it are copied.
+*/
+typedef struct _CopyDir CopyDir;
+struct _CopyDir
+{
+    char* src_file;
+    char* dest_file;
+    struct stat file_stat;
+    int n_pending;  /* files in it not copied yet, and one for the walker */
+    gboolean failed;
+    CopyDir* parent;
+};
+
+typedef struct _CopyJob
+{
+    char* src_file;
+    char* dest_file;
+    struct stat file_stat;
+    CopyDir* parent;
+    int error;  /* errno, 0 if the file is copied */
+}CopyJob;
+
+typedef struct _CopyPool
+{
+    dev_t src_dev;
+    dev_t dest_dev;
+    GThreadPool* threads;  /* NULL if the files should be copied one by one */
+}CopyPool;
+
+struct _VFSCopyEngine
+{
+    GSList* pools;
+    GAsyncQueue* done;  /* jobs finished by the workers */
+    int n_jobs; /* jobs not handled by the task thread yet */
+    char* current_file;
+    char* current_dest;
+};
+
+/* should_abort() for the copy workers, which never ask the user */
+static gboolean copy_should_abort( VFSFileTask* task, gboolean in_worker )
+{
+    if ( in_worker )
+        return task->state == VFS_FILE_TASK_ABORTED;
+    return should_abort( task );
+}
+
+/* Returns FALSE if the task is aborted */
+static gboolean copy_progress( VFSFileTask* task, gboolean in_worker, off_t size )
+{
+    add_progress( task, size );
+    /* the task thread reports the progress of the workers */
+    if ( ! in_worker )
+        call_progress_callback( task );
+    return ! copy_should_abort( task, in_worker );
+}
+
+/*
+* Whether the error returned by copy_file_range() or sendfile() means that
+* the files are not supported by it, so another way should be tried.
+*/
+static gboolean is_copy_unsupported( int err )
+{
+    switch ( err )
+    {
+    case ENOSYS:
+    case EXDEV:
+    case EINVAL:
+    case EBADF:
+    case EPERM:
+    case ENOTTY:
+    case EOPNOTSUPP:
+#if ENOTSUP != EOPNOTSUPP
+    case ENOTSUP:
+#endif
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean write_all( int fd, const char* buf, size_t size )
+{
+    ssize_t n;
+    while ( size > 0 )
+    {
+        if ( ( n = write( fd, buf, size ) ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            return FALSE;
+        }
+        buf += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+/*
+* Copy the content of rfd to wfd, starting from their current offsets.
+* A reflink is tried first, and then copy_file_range() and sendfile().
+* If the files are not supported by any of them, the data is copied with
+* read() and write().
+* Returns 0 on success, ECANCELED if the task is aborted, or the errno of
+* the error.
+*/
+static int copy_file_content( VFSFileTask* task, gboolean in_worker,
+                              int rfd, int wfd, off_t size )
+{
+    ssize_t n;
+    off_t copied = 0;   /* by copy_file_range() or sendfile() */
+    char* buffer;
+    int ret = 0;
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+    const char* method = "read/write";
+    GTimer* timer = g_timer_new();
+#endif
+
+    /* Pseudo files, such as the ones in /proc, have no size, and the kernel
+     * copies nothing from them. Copy them with read() and write(). */
+    if ( size <= 0 )
+        goto _read_write_;
+
+#ifdef FICLONE
+    /* share the extents on btrfs, XFS, etc. No data is copied at all. */
+    if ( ioctl( wfd, FICLONE, rfd ) == 0 )
+    {
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+        method = "reflink";
+#endif
+        if ( ! copy_progress( task, in_worker, size ) )
+            ret = ECANCELED;
+        goto _finish_;
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    /* copied in the kernel, or on the server by NFS */
+    while ( ( n = copy_file_range( rfd, NULL, wfd, NULL, COPY_CHUNK_SIZE, 0 ) ) > 0 )
+    {
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+        method = "copy_file_range";
+#endif
+        copied += n;
+        if ( ! copy_progress( task, in_worker, n ) )
+        {
+            ret = ECANCELED;
+            goto _finish_;
+        }
+    }
+    /* Some filesystems and kernels return 0 without copying anything.
+     * It's only the end of the file if some data is copied. */
+    if ( n == 0 && copied > 0 )
+        goto _finish_;
+    if ( n < 0 && errno != EINTR && ! is_copy_unsupported( errno ) )
+        goto _error_;
+#endif
+
+#ifdef HAVE_SENDFILE
+    while ( ( n = sendfile( wfd, rfd, NULL, COPY_CHUNK_SIZE ) ) > 0 )
+    {
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+        method = "sendfile";
+#endif
+        copied += n;
+        if ( ! copy_progress( task, in_worker, n ) )
+        {
+            ret = ECANCELED;
+            goto _finish_;
+        }
+    }
+    if ( n == 0 && copied > 0 )  /* see above */
+        goto _finish_;
+    if ( n < 0 && errno != EINTR && ! is_copy_unsupported( errno ) )
+        goto _error_;
+#endif
+
+_read_write_:
+    /* page aligned, so the data can be transferred by DMA directly */
+    if ( posix_memalign( (void**)&buffer, 4096, COPY_BUFFER_SIZE ) != 0 )
+    {
+        errno = ENOMEM;
+        goto _error_;
+    }
+    for ( ;; )
+    {
+        if ( ( n = read( rfd, buffer, COPY_BUFFER_SIZE ) ) <= 0 )
+        {
+            if ( n < 0 && errno == EINTR )
+                continue;
+            break;
+        }
+        if ( ! write_all( wfd, buffer, n ) )
+        {
+            n = -1;
+            break;
+        }
+        if ( ! copy_progress( task, in_worker, n ) )
+        {
+            ret = ECANCELED;
+            break;
+        }
+    }
+    if ( n < 0 )
+    {
+        int err = errno;
+        free( buffer );
+        errno = err;
+        goto _error_;
+    }
+    free( buffer );
+
+_finish_:
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+    g_debug( "%d bytes in %.3f s (%s)", (int)size,
+             g_timer_elapsed( timer, NULL ), method );
+    g_timer_destroy( timer );
+#endif
+    return ret;
+
+_error_:
+    ret = errno;
+#ifdef VFS_FILE_TASK_DEBUG_COPY
+    g_timer_destroy( timer );
+#endif
+    return ret;
+}
+
+/*
+* Copy a regular file, and delete the source file if it's moved.
+* Returns 0 on success, ECANCELED if the task is aborted, or the errno of
+* the error.
+*/
+static int copy_regular_file( VFSFileTask* task, gboolean in_worker,
+                              const char* src_file, const char* dest_file,
+                              struct stat* file_stat )
+{
+    int rfd, wfd, err;
+    struct utimbuf times;
+
+    if ( ( rfd = open( src_file, O_RDONLY ) ) < 0 )
+        return errno;
+    if ( ( wfd = creat( dest_file, file_stat->st_mode | S_IWUSR ) ) < 0 )
+    {
+        err = errno;
+        close( rfd );
+        return err;
+    }
+    err = copy_file_content( task, in_worker, rfd, wfd, file_stat->st_size );
+    close( wfd );
+    close( rfd );
+    chmod( dest_file, file_stat->st_mode );
+    times.actime = file_stat->st_atime;
+    times.modtime = file_stat->st_mtime;
+    utime( dest_file, &times );
+
+    /* Move files to different device: Need to delete source files */
+    if ( err == 0 && ( task->type == VFS_FILE_TASK_MOVE || task->type == VFS_FILE_TASK_TRASH )
+         && ! copy_should_abort( task, in_worker ) )
+    {
+        if ( unlink( src_file ) )
+            err = errno;
+    }
+    return err;
+}
 
 /*
 * Check if the destination file exists.
@@ -182,7 +554,6 @@ vfs_file_task_do_copy( VFSFileTask* task,
     char buffer[ 4096 ];
     int rfd;
     int wfd;
-    ssize_t rsize;
     char* new_dest_file = NULL;
     gboolean dest_exists;
     int result;
@@ -217,7 +588,7 @@ vfs_file_task_do_copy( VFSFileTask* task,
         if ( result == 0 )
         {
             struct utimbuf times;
-            task->progress += file_stat.st_size;
+            add_progress( task, file_stat.st_size );
             call_progress_callback( task );
 
             dir = g_dir_open( src_file, 0, NULL );
@@ -232,6 +603,9 @@ vfs_file_task_do_copy( VFSFileTask* task,
                 g_free( sub_src_file );
             }
             g_dir_close( dir );
+            /* the names of the sub files are freed */
+            task->current_file = src_file;
+            task->current_dest = dest_file;
             chmod( dest_file, file_stat.st_mode );
             times.actime = file_stat.st_atime;
             times.modtime = file_stat.st_mtime;
@@ -290,7 +664,7 @@ vfs_file_task_do_copy( VFSFileTask* task,
                         call_state_callback( task, VFS_FILE_TASK_ERROR );
                     }
                 }
-                task->progress += file_stat.st_size;
+                add_progress( task, file_stat.st_size );
                 call_progress_callback( task );
             }
             else
@@ -307,7 +681,7 @@ vfs_file_task_do_copy( VFSFileTask* task,
     }
     else
     {
-        if ( ( rfd = open( src_file, O_RDONLY ) ) >= 0 )
+        if ( access( src_file, R_OK ) == 0 )
         {
             if ( ! check_overwrite( task, dest_file,
                                     &dest_exists, &new_dest_file ) )
@@ -316,60 +690,490 @@ vfs_file_task_do_copy( VFSFileTask* task,
             if ( new_dest_file )
                 task->current_dest = dest_file = new_dest_file;
 
-            if ( ( wfd = creat( dest_file,
-                                file_stat.st_mode | S_IWUSR ) ) >= 0 )
+            result = copy_regular_file( task, FALSE, src_file, dest_file, &file_stat );
+            if ( result && result != ECANCELED )
             {
-                struct utimbuf times;
-                while ( ( rsize = read( rfd, buffer, sizeof( buffer ) ) ) > 0 )
-                {
-                    if ( should_abort( task ) )
-                        break;
+                task->error = result;
+                call_state_callback( task, VFS_FILE_TASK_ERROR );
+            }
+        }
+        else
+        {
+            task->error = errno;
+            call_state_callback( task, VFS_FILE_TASK_ERROR );
+        }
+    }
+_return_:
+    g_free( new_dest_file );
+}
 
-                    if ( write( wfd, buffer, rsize ) > 0 )
-                        task->progress += rsize;
-                    else
-                    {
-                        task->error = errno;
-                        call_state_callback( task, VFS_FILE_TASK_ERROR );
-                        close( wfd );
-                    }
-                    call_progress_callback( task );
-                }
-                close( wfd );
-                chmod( dest_file, file_stat.st_mode );
-                times.actime = file_stat.st_atime;
-                times.modtime = file_stat.st_mtime;
-                utime( dest_file, &times );
+#ifdef HAVE_SYS_VFS_H
+/* f_type of the filesystems which are not stored on a local disk */
+static const guint32 diskless_fs_types[] =
+{
+    0x01021994, /* tmpfs */
+    0x858458f6, /* ramfs */
+    0x6969,     /* nfs */
+    0x517b,     /* smbfs */
+    0xff534d42, /* cifs */
+    0xfe534d42, /* smb2 */
+    0x01021997, /* 9p */
+    0x00c36400, /* ceph */
+    0x5346414f  /* afs */
+};
+#endif
 
-                /* Move files to different device: Need to delete source files */
-                if ( (task->type == VFS_FILE_TASK_MOVE || task->type == VFS_FILE_TASK_TRASH)
-                     && !should_abort( task ) )
-                {
-                    result = unlink( src_file );
-                    if ( result )
-                    {
-                        task->error = errno;
-                        call_state_callback( task, VFS_FILE_TASK_ERROR );
-                    }
-                }
+/*
+* Get the block device of the filesystem containing path, from its
+* source in /proc/self/mountinfo. This is needed by filesystems like
+* btrfs, whose dev_t numbers don't belong to the disk.
+* Returns 0 if it's not found.
+*/
+static dev_t get_backing_device( const char* path, dev_t dev )
+{
+    char* data;
+    char** lines;
+    char** fields;
+    char* real_path;
+    char* mount_point;
+    char* source = NULL;
+    gsize len, best_len = 0;
+    guint maj, min;
+    int i, sep;
+    struct stat statbuf;
+    dev_t ret = 0;
+
+    if ( ! g_file_get_contents( "/proc/self/mountinfo", &data, NULL, NULL ) )
+        return 0;
+    real_path = realpath( path, NULL );
+    lines = g_strsplit( data, "\n", 0 );
+    g_free( data );
+
+    /* "id parent maj:min root mount_point options... - type source ..." */
+    for ( i = 0; lines[ i ]; ++i )
+    {
+        fields = g_strsplit( lines[ i ], " ", 0 );
+        for ( sep = 0; fields[ sep ] && strcmp( fields[ sep ], "-" ); ++sep )
+            ;
+        if ( sep < 5 || ! fields[ sep ] || ! fields[ sep + 1 ] || ! fields[ sep + 2 ]
+             || sscanf( fields[ 2 ], "%u:%u", &maj, &min ) != 2 )
+        {
+            g_strfreev( fields );
+            continue;
+        }
+        if ( makedev( maj, min ) == dev )
+        {
+            g_free( source );
+            source = g_strdup( fields[ sep + 2 ] );
+            g_strfreev( fields );
+            break;
+        }
+        /* subvolumes of btrfs have other numbers, so match the mount point */
+        if ( real_path )
+        {
+            mount_point = g_strcompress( fields[ 4 ] );  /* "\040" is a space */
+            len = strlen( mount_point );
+            if ( len > best_len && strncmp( real_path, mount_point, len ) == 0
+                 && ( real_path[ len ] == '/' || real_path[ len ] == '\0'
+                      || len == 1 ) )
+            {
+                best_len = len;
+                g_free( source );
+                source = g_strdup( fields[ sep + 2 ] );
             }
-            else
+            g_free( mount_point );
+        }
+        g_strfreev( fields );
+    }
+    g_strfreev( lines );
+    free( real_path );
+
+    if ( source && g_path_is_absolute( source )
+         && stat( source, &statbuf ) == 0 && S_ISBLK( statbuf.st_mode ) )
+        ret = statbuf.st_rdev;
+    g_free( source );
+    return ret;
+}
+
+/*
+* Read /sys/dev/block/maj:min/queue/rotational of a block device.
+* Returns -1 if it's unknown.
+*/
+static int get_queue_rotational( dev_t dev )
+{
+    char* path;
+    char* data = NULL;
+    int ret = -1;
+
+    path = g_strdup_printf( "/sys/dev/block/%u:%u/queue/rotational",
+                            major( dev ), minor( dev ) );
+    if ( ! g_file_get_contents( path, &data, NULL, NULL ) )
+    {
+        /* the queue of a partition belongs to its disk */
+        g_free( path );
+        path = g_strdup_printf( "/sys/dev/block/%u:%u/../queue/rotational",
+                                major( dev ), minor( dev ) );
+        g_file_get_contents( path, &data, NULL, NULL );
+    }
+    g_free( path );
+    if ( data )
+    {
+        ret = ( data[0] != '0' );
+        g_free( data );
+    }
+    return ret;
+}
+
+/*
+* Whether the filesystem of path, on device dev, is on a rotational disk,
+* which is slowed down by concurrent requests. Filesystems without a
+* local disk, like tmpfs and NFS, are not.
+*/
+static gboolean is_rotational_device( const char* path, dev_t dev )
+{
+    int rotational;
+#ifdef HAVE_SYS_VFS_H
+    struct statfs fs;
+    guint i;
+
+    if ( statfs( path, &fs ) == 0 )
+    {
+        for ( i = 0; i < G_N_ELEMENTS( diskless_fs_types ); ++i )
+        {
+            if ( ( guint32 ) fs.f_type == diskless_fs_types[ i ] )
+                return FALSE;
+        }
+    }
+#endif
+    if ( major( dev ) == 0 )
+        dev = get_backing_device( path, dev );
+    if ( major( dev ) == 0 || ( rotational = get_queue_rotational( dev ) ) < 0 )
+        return TRUE;    /* be safe if it's unknown */
+    return rotational;
+}
+
+static void copy_worker( CopyJob* job, VFSFileTask* task )
+{
+    if ( task->state == VFS_FILE_TASK_ABORTED )
+        job->error = ECANCELED;
+    else
+        job->error = copy_regular_file( task, TRUE, job->src_file,
+                                        job->dest_file, &job->file_stat );
+    g_async_queue_push( task->copy_engine->done, job );
+}
+
+/*
+* Get the pool used to copy files from src_dev to dest_dev.
+* src_file and dest_dir are on the devices.
+*/
+static CopyPool* get_copy_pool( VFSFileTask* task, const char* src_file, dev_t src_dev,
+                                const char* dest_dir, dev_t dest_dev )
+{
+    VFSCopyEngine* engine = task->copy_engine;
+    CopyPool* pool;
+    GSList* l;
+
+    if ( G_UNLIKELY( ! engine ) )
+    {
+        engine = task->copy_engine = g_slice_new0( VFSCopyEngine );
+        engine->done = g_async_queue_new();
+    }
+
+    for ( l = engine->pools; l; l = l->next )
+    {
+        pool = ( CopyPool* ) l->data;
+        if ( pool->src_dev == src_dev && pool->dest_dev == dest_dev )
+            return pool;
+    }
+
+    pool = g_slice_new0( CopyPool );
+    pool->src_dev = src_dev;
+    pool->dest_dev = dest_dev;
+    /* Concurrent requests make rotational disks seek back and forth */
+    if ( ! is_rotational_device( src_file, src_dev )
+         && ! is_rotational_device( dest_dir, dest_dev ) )
+        pool->threads = g_thread_pool_new( ( GFunc ) copy_worker, task,
+                                           MAX_COPY_WORKERS, FALSE, NULL );
+    engine->pools = g_slist_prepend( engine->pools, pool );
+    return pool;
+}
+
+/* The strings are kept by the engine since the jobs are freed in any order */
+static void set_copy_current_file( VFSFileTask* task,
+                                   const char* src_file, const char* dest_file )
+{
+    VFSCopyEngine* engine = task->copy_engine;
+    char* old_file = engine->current_file;
+    char* old_dest = engine->current_dest;
+
+    task->current_file = engine->current_file = g_strdup( src_file );
+    task->current_dest = engine->current_dest = g_strdup( dest_file );
+    g_free( old_file );
+    g_free( old_dest );
+}
+
+/* Called when all files in the dir are copied */
+static void release_copy_dir( VFSFileTask* task, CopyDir* dir )
+{
+    struct utimbuf times;
+    CopyDir* parent;
+
+    while ( dir && --dir->n_pending == 0 )
+    {
+        chmod( dir->dest_file, dir->file_stat.st_mode );
+        times.actime = dir->file_stat.st_atime;
+        times.modtime = dir->file_stat.st_mtime;
+        utime( dir->dest_file, &times );
+        /* Move files to different device: Need to delete source files */
+        if ( ( task->type == VFS_FILE_TASK_MOVE || task->type == VFS_FILE_TASK_TRASH )
+             && ! dir->failed && ! should_abort( task ) )
+        {
+            if ( rmdir( dir->src_file ) )
             {
                 task->error = errno;
+                set_copy_current_file( task, dir->src_file, dir->dest_file );
                 call_state_callback( task, VFS_FILE_TASK_ERROR );
+                dir->failed = TRUE;
             }
-            close( rfd );
         }
-        else
+        parent = dir->parent;
+        if ( parent && dir->failed )
+            parent->failed = TRUE;
+        g_free( dir->src_file );
+        g_free( dir->dest_file );
+        g_slice_free( CopyDir, dir );
+        dir = parent;
+    }
+}
+
+static void handle_copy_job( VFSFileTask* task, CopyJob* job )
+{
+    --task->copy_engine->n_jobs;
+    if ( job->error )
+    {
+        if ( job->error != ECANCELED )
         {
-            task->error = errno;
+            task->error = job->error;
+            set_copy_current_file( task, job->src_file, job->dest_file );
             call_state_callback( task, VFS_FILE_TASK_ERROR );
         }
+        if ( job->parent )
+            job->parent->failed = TRUE;
+    }
+    release_copy_dir( task, job->parent );
+    g_free( job->src_file );
+    g_free( job->dest_file );
+    g_slice_free( CopyJob, job );
+}
+
+/*
+* Handle the jobs finished by the workers.
+* If wait is TRUE, wait until at least one job is finished.
+*/
+static void handle_finished_copy_jobs( VFSFileTask* task, gboolean wait )
+{
+    VFSCopyEngine* engine = task->copy_engine;
+    CopyJob* job;
+    GTimeVal end_time;
+
+    for ( ;; )
+    {
+        if ( ( job = ( CopyJob* ) g_async_queue_try_pop( engine->done ) ) )
+        {
+            handle_copy_job( task, job );
+            wait = FALSE;
+            continue;
+        }
+        if ( ! wait || engine->n_jobs == 0 )
+            break;
+        g_get_current_time( &end_time );
+        g_time_val_add( &end_time, G_USEC_PER_SEC / 10 );
+        if ( ( job = ( CopyJob* ) g_async_queue_timed_pop( engine->done, &end_time ) ) )
+        {
+            handle_copy_job( task, job );
+            wait = FALSE;
+        }
+        else
+        {
+            /* a big file is being copied, ask the user if the task
+             * should be aborted in the meantime */
+            call_progress_callback( task );
+            should_abort( task );
+        }
     }
+    call_progress_callback( task );
+}
+
+/*
+* Walk the tree of src_file, and pass the regular files in it to the
+* copy workers. Other files are copied by the task thread itself.
+*/
+static void parallel_copy( VFSFileTask* task, CopyPool* pool,
+                           const char* src_file, const char* dest_file,
+                           CopyDir* parent )
+{
+    VFSCopyEngine* engine = task->copy_engine;
+    GDir* gdir;
+    const gchar* file_name;
+    gchar* sub_src_file;
+    gchar* sub_dest_file;
+    struct stat file_stat;
+    char* new_dest_file = NULL;
+    gboolean dest_exists;
+    CopyDir* dir;
+    CopyJob* job;
+
+    if ( should_abort( task ) )
+        return ;
+    if ( lstat( src_file, &file_stat ) == -1 )
+    {
+        task->error = errno;
+        call_state_callback( task, VFS_FILE_TASK_ERROR );
+        if ( parent )
+            parent->failed = TRUE;
+        return ;
+    }
+
+    if ( ! S_ISREG( file_stat.st_mode ) && ! S_ISDIR( file_stat.st_mode ) )
+    {
+        /* symlinks and special files */
+        vfs_file_task_do_copy( task, src_file, dest_file );
+        /* it points to the strings freed by the caller */
+        task->current_file = engine->current_file;
+        task->current_dest = engine->current_dest;
+        return ;
+    }
+
+    set_copy_current_file( task, src_file, dest_file );
+    call_progress_callback( task );
+
+    if ( ! check_overwrite( task, dest_file,
+                            &dest_exists, &new_dest_file ) )
+    {
+        /* the skipped source file should be kept if it's moved */
+        if ( parent )
+            parent->failed = TRUE;
+        goto _return_;
+    }
+    if ( new_dest_file )
+    {
+        dest_file = new_dest_file;
+        set_copy_current_file( task, src_file, dest_file );
+    }
+
+    if ( S_ISREG( file_stat.st_mode ) )
+    {
+        job = g_slice_new( CopyJob );
+        job->src_file = g_strdup( src_file );
+        job->dest_file = g_strdup( dest_file );
+        job->file_stat = file_stat;
+        job->parent = parent;
+        job->error = 0;
+        if ( parent )
+            ++parent->n_pending;
+
+        /* the memory used by the queued jobs is bounded */
+        if ( engine->n_jobs >= MAX_COPY_JOBS )
+            handle_finished_copy_jobs( task, TRUE );
+        ++engine->n_jobs;
+        g_thread_pool_push( pool->threads, job, NULL );
+        goto _return_;
+    }
+
+    /* It's a dir */
+    if ( ! dest_exists && mkdir( dest_file, file_stat.st_mode | 0700 ) )
+    {
+        task->error = errno;
+        call_state_callback( task, VFS_FILE_TASK_ERROR );
+        if ( parent )
+            parent->failed = TRUE;
+        goto _return_;
+    }
+    add_progress( task, file_stat.st_size );
+
+    dir = g_slice_new( CopyDir );
+    dir->src_file = g_strdup( src_file );
+    dir->dest_file = g_strdup( dest_file );
+    dir->file_stat = file_stat;
+    dir->n_pending = 1;
+    dir->failed = FALSE;
+    dir->parent = parent;
+    if ( parent )
+        ++parent->n_pending;
+
+    if ( ( gdir = g_dir_open( src_file, 0, NULL ) ) )
+    {
+        while ( (file_name = g_dir_read_name( gdir )) )
+        {
+            if ( should_abort( task ) )
+                break;
+            sub_src_file = g_build_filename( dir->src_file, file_name, NULL );
+            sub_dest_file = g_build_filename( dir->dest_file, file_name, NULL );
+            parallel_copy( task, pool, sub_src_file, sub_dest_file, dir );
+            g_free( sub_dest_file );
+            g_free( sub_src_file );
+        }
+        g_dir_close( gdir );
+    }
+    else
+    {
+        task->error = errno;
+        call_state_callback( task, VFS_FILE_TASK_ERROR );
+        dir->failed = TRUE;
+    }
+
+    /* the walker is done with it */
+    release_copy_dir( task, dir );
+    handle_finished_copy_jobs( task, FALSE );
 _return_:
     g_free( new_dest_file );
 }
 
+/* Copy the file or dir, with many threads if the devices can handle them. */
+static void copy_tree( VFSFileTask* task, const char* src_file, const char* dest_file )
+{
+    struct stat src_stat, dest_stat;
+    CopyPool* pool;
+
+    if ( lstat( src_file, &src_stat ) == 0 && stat( task->dest_dir, &dest_stat ) == 0 )
+    {
+        pool = get_copy_pool( task, src_file, src_stat.st_dev,
+                              task->dest_dir, dest_stat.st_dev );
+        if ( pool->threads )
+        {
+            parallel_copy( task, pool, src_file, dest_file, NULL );
+            return ;
+        }
+    }
+    vfs_file_task_do_copy( task, src_file, dest_file );
+}
+
+/* Wait for all the copy workers, and free them */
+static void finish_copy_engine( VFSFileTask* task )
+{
+    VFSCopyEngine* engine = task->copy_engine;
+    GSList* l;
+
+    while ( engine->n_jobs > 0 )
+        handle_finished_copy_jobs( task, TRUE );
+
+    for ( l = engine->pools; l; l = l->next )
+    {
+        CopyPool* pool = ( CopyPool* ) l->data;
+        if ( pool->threads )
+            g_thread_pool_free( pool->threads, FALSE, TRUE );
+        g_slice_free( CopyPool, pool );
+    }
+    g_slist_free( engine->pools );
+    g_async_queue_unref( engine->done );
+
+    task->current_file = task->current_dest = NULL;
+    g_free( engine->current_file );
+    g_free( engine->current_dest );
+    g_slice_free( VFSCopyEngine, engine );
+    task->copy_engine = NULL;
+}
+
 static void
 vfs_file_task_copy( char* src_file, VFSFileTask* task )
 {
@@ -380,7 +1184,7 @@ vfs_file_task_copy( char* src_file, VFSFileTask* task )
     file_name = g_path_get_basename( src_file );
     dest_file = g_build_filename( task->dest_dir, file_name, NULL );
     g_free( file_name );
-    vfs_file_task_do_copy( task, src_file, dest_file );
+    copy_tree( task, src_file, dest_file );
     g_free( dest_file );
 }
 
@@ -435,7 +1239,7 @@ vfs_file_task_do_move ( VFSFileTask* task,
     else
         chmod( dest_file, file_stat.st_mode );
 
-    task->progress += file_stat.st_size;
+    add_progress( task, file_stat.st_size );
     call_progress_callback( task );
 
     g_free( new_dest_file );
@@ -480,7 +1284,11 @@ vfs_file_task_move( char* src_file, VFSFileTask* task )
         if ( src_stat.st_dev != dest_stat.st_dev )
         {
             /* g_print("not on the same dev: %s\n", src_file); */
-            vfs_file_task_do_copy( task, src_file, dest_file );
+            /* The temporary file in trash is removed right after this */
+            if ( task->type == VFS_FILE_TASK_MOVE )
+                copy_tree( task, src_file, dest_file );
+            else
+                vfs_file_task_do_copy( task, src_file, dest_file );
         }
         else
         {
@@ -502,14 +1310,357 @@ on_error:
     g_free( dest_file );
 }
 
+/*
+* Files are deleted relative to the fds of their dirs, so the kernel
+* doesn't resolve their full paths again, and the types returned by
+* readdir() are used to avoid lstat(). The task thread deletes the
+* files near the top of the tree, and passes the dirs below
+* DELETE_SPLIT_DEPTH to a pool of workers, each of which deletes a
+* whole subtree. A dir is removed after all the entries in it.
+* The progress of deletion is counted in files rather than bytes.
+*/
+
+/* max number of threads deleting subtrees */
+#define MAX_DELETE_WORKERS      8
+/* max number of subtrees queued for the workers */
+#define MAX_DELETE_JOBS         (MAX_DELETE_WORKERS * 16)
+/* dirs at this depth are deleted by the workers */
+#define DELETE_SPLIT_DEPTH      2
+/* files deleted by a worker before they are added to the progress */
+#define DELETE_PROGRESS_BATCH   256
+/* min interval between two progress callbacks, in microseconds */
+#define DELETE_PROGRESS_INTERVAL    (G_USEC_PER_SEC / 10)
+
+typedef struct _DeleteDir DeleteDir;
+struct _DeleteDir
+{
+    DIR* dirp;
+    int fd; /* fd of dirp, used by the workers */
+    char* name; /* relative to the parent dir, or the full path of the top dir */
+    int n_pending;  /* subtrees in it not deleted yet, and one for the walker */
+    gboolean failed;
+    DeleteDir* parent;
+};
+
+typedef struct _DeleteJob
+{
+    DeleteDir* parent;
+    char* name;
+    int error;  /* errno, 0 if the subtree is deleted */
+}DeleteJob;
+
+typedef struct _DeleteEngine
+{
+    VFSFileTask* task;
+    GThreadPool* threads;
+    GAsyncQueue* done;  /* jobs finished by the workers */
+    int n_jobs; /* jobs not handled by the task thread yet */
+    int n_deleted;  /* files deleted by the task thread, not added to the progress yet */
+    GTimeVal last_progress;
+}DeleteEngine;
+
+static gboolean is_dot_or_dotdot( const char* name )
+{
+    return name[0] == '.' && ( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) );
+}
+
+/* get the type of the file if readdir() doesn't know it */
+static unsigned char get_file_type_at( int dirfd, const char* name, unsigned char d_type )
+{
+    struct stat file_stat;
+    if ( d_type != DT_UNKNOWN )
+        return d_type;
+    if ( fstatat( dirfd, name, &file_stat, AT_SYMLINK_NOFOLLOW ) )
+        return DT_UNKNOWN;
+    return S_ISDIR( file_stat.st_mode ) ? DT_DIR : DT_REG;
+}
+
+static void count_deleted_file( VFSFileTask* task, int* n_deleted )
+{
+    if ( ++*n_deleted >= DELETE_PROGRESS_BATCH )
+    {
+        add_progress( task, *n_deleted );
+        *n_deleted = 0;
+    }
+}
+
+/*
+* Count the files in the tree of name, for the progress of deletion.
+* Called by the size thread.
+*/
+static void count_files_at( VFSFileTask* task, int dirfd, const char* name,
+                            unsigned char d_type )
+{
+    int fd;
+    DIR* dirp;
+    struct dirent* ent;
+
+    add_total_size( task, 1 );
+    if ( get_file_type_at( dirfd, name, d_type ) != DT_DIR )
+        return ;
+    if ( ( fd = openat( dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW ) ) < 0 )
+        return ;
+    if ( ! ( dirp = fdopendir( fd ) ) )
+    {
+        close( fd );
+        return ;
+    }
+    while ( ( ent = readdir( dirp ) ) )
+    {
+        if ( is_size_scan_stopped( task ) )
+            break;
+        if ( ! is_dot_or_dotdot( ent->d_name ) )
+            count_files_at( task, fd, ent->d_name, ent->d_type );
+    }
+    closedir( dirp );
+}
+
+/*
+* Delete name in the dir dirfd, and everything in it if it's a dir.
+* d_type is the type returned by readdir().
+* Returns 0 on success, ECANCELED if the task is aborted, or the errno
+* of the first error. After an error the rest of the tree is still
+* deleted, only the dirs which cannot be emptied are kept.
+* Called by the delete workers.
+*/
+static int delete_tree_at( VFSFileTask* task, int dirfd, const char* name,
+                           unsigned char d_type, int* n_deleted )
+{
+    int fd, ret, err = 0;
+    DIR* dirp;
+    struct dirent* ent;
+
+    if ( task->state == VFS_FILE_TASK_ABORTED )
+        return ECANCELED;
+
+    if ( ( d_type = get_file_type_at( dirfd, name, d_type ) ) == DT_UNKNOWN )
+        return errno;
+    if ( d_type == DT_DIR )
+    {
+        if ( ( fd = openat( dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW ) ) < 0 )
+            return errno;
+        if ( ! ( dirp = fdopendir( fd ) ) )
+        {
+            err = errno;
+            close( fd );
+            return err;
+        }
+        while ( ( ent = readdir( dirp ) ) )
+        {
+            if ( is_dot_or_dotdot( ent->d_name ) )
+                continue;
+            if ( ( ret = delete_tree_at( task, fd, ent->d_name, ent->d_type, n_deleted ) ) )
+            {
+                if ( ! err || ret == ECANCELED )
+                    err = ret;
+                if ( ret == ECANCELED )
+                    break;
+            }
+        }
+        closedir( dirp );
+        if ( err )
+            return err;
+        if ( unlinkat( dirfd, name, AT_REMOVEDIR ) )
+            return errno;
+    }
+    else if ( unlinkat( dirfd, name, 0 ) )
+        return errno;
+
+    count_deleted_file( task, n_deleted );
+    return 0;
+}
+
+static void delete_worker( DeleteJob* job, DeleteEngine* engine )
+{
+    int n_deleted = 0;
+    job->error = delete_tree_at( engine->task, job->parent->fd, job->name,
+                                 DT_DIR, &n_deleted );
+    add_progress( engine->task, n_deleted );
+    g_async_queue_push( engine->done, job );
+}
+
+static void report_delete_progress( VFSFileTask* task, DeleteEngine* engine )
+{
+    GTimeVal now;
+    g_get_current_time( &now );
+    if ( ( now.tv_sec - engine->last_progress.tv_sec ) * G_USEC_PER_SEC
+         + ( now.tv_usec - engine->last_progress.tv_usec ) >= DELETE_PROGRESS_INTERVAL )
+    {
+        engine->last_progress = now;
+        add_progress( task, engine->n_deleted );
+        engine->n_deleted = 0;
+        call_progress_callback( task );
+    }
+}
+
+static void report_delete_error( VFSFileTask* task, int err )
+{
+    task->error = err;
+    call_state_callback( task, VFS_FILE_TASK_ERROR );
+}
+
+/* Called when all subtrees in the dir are deleted */
+static void release_delete_dir( VFSFileTask* task, DeleteEngine* engine, DeleteDir* dir )
+{
+    DeleteDir* parent;
+
+    while ( dir && --dir->n_pending == 0 )
+    {
+        parent = dir->parent;
+        closedir( dir->dirp );
+        if ( ! dir->failed && ! should_abort( task ) )
+        {
+            if ( unlinkat( parent ? parent->fd : AT_FDCWD, dir->name, AT_REMOVEDIR ) )
+            {
+                report_delete_error( task, errno );
+                dir->failed = TRUE;
+            }
+            else
+                ++engine->n_deleted;
+        }
+        if ( parent && dir->failed )
+            parent->failed = TRUE;
+        g_free( dir->name );
+        g_slice_free( DeleteDir, dir );
+        dir = parent;
+    }
+}
+
+/*
+* Handle the jobs finished by the workers.
+* If wait is TRUE, wait until at least one job is finished.
+*/
+static void handle_finished_delete_jobs( VFSFileTask* task, DeleteEngine* engine,
+                                         gboolean wait )
+{
+    DeleteJob* job;
+    GTimeVal end_time;
+
+    for ( ;; )
+    {
+        if ( ! ( job = ( DeleteJob* ) g_async_queue_try_pop( engine->done ) ) )
+        {
+            if ( ! wait || engine->n_jobs == 0 )
+                break;
+            g_get_current_time( &end_time );
+            g_time_val_add( &end_time, DELETE_PROGRESS_INTERVAL );
+            job = ( DeleteJob* ) g_async_queue_timed_pop( engine->done, &end_time );
+        }
+        if ( job )
+        {
+            --engine->n_jobs;
+            if ( job->error )
+            {
+                if ( job->error != ECANCELED )
+                    report_delete_error( task, job->error );
+                job->parent->failed = TRUE;
+            }
+            release_delete_dir( task, engine, job->parent );
+            g_free( job->name );
+            g_slice_free( DeleteJob, job );
+            wait = FALSE;
+        }
+        else    /* ask the user if the task should be aborted in the meantime */
+            should_abort( task );
+        report_delete_progress( task, engine );
+    }
+    report_delete_progress( task, engine );
+}
+
+static DeleteDir* open_delete_dir( DeleteDir* parent, const char* name )
+{
+    DeleteDir* dir;
+    int fd;
+    DIR* dirp;
+
+    fd = openat( parent ? parent->fd : AT_FDCWD, name,
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+    if ( fd < 0 )
+        return NULL;
+    if ( ! ( dirp = fdopendir( fd ) ) )
+    {
+        int err = errno;
+        close( fd );
+        errno = err;
+        return NULL;
+    }
+    dir = g_slice_new( DeleteDir );
+    dir->dirp = dirp;
+    dir->fd = fd;
+    dir->name = g_strdup( name );
+    dir->n_pending = 1;
+    dir->failed = FALSE;
+    dir->parent = parent;
+    if ( parent )
+        ++parent->n_pending;
+    return dir;
+}
+
+/* Delete the entries in the dir, and pass the deep subtrees to the workers */
+static void walk_delete_dir( VFSFileTask* task, DeleteEngine* engine,
+                             DeleteDir* dir, int depth )
+{
+    struct dirent* ent;
+    unsigned char d_type;
+    DeleteDir* sub_dir;
+    DeleteJob* job;
+
+    while ( ( ent = readdir( dir->dirp ) ) )
+    {
+        if ( should_abort( task ) )
+            break;
+        if ( is_dot_or_dotdot( ent->d_name ) )
+            continue;
+
+        d_type = get_file_type_at( dir->fd, ent->d_name, ent->d_type );
+        if ( d_type != DT_DIR )
+        {
+            if ( unlinkat( dir->fd, ent->d_name, 0 ) )
+            {
+                report_delete_error( task, errno );
+                dir->failed = TRUE;
+            }
+            else
+                ++engine->n_deleted;
+        }
+        else if ( depth + 1 < DELETE_SPLIT_DEPTH )
+        {
+            if ( ( sub_dir = open_delete_dir( dir, ent->d_name ) ) )
+                walk_delete_dir( task, engine, sub_dir, depth + 1 );
+            else
+            {
+                report_delete_error( task, errno );
+                dir->failed = TRUE;
+            }
+        }
+        else
+        {
+            if ( G_UNLIKELY( ! engine->threads ) )
+                engine->threads = g_thread_pool_new( ( GFunc ) delete_worker, engine,
+                                                     MAX_DELETE_WORKERS, FALSE, NULL );
+            job = g_slice_new( DeleteJob );
+            job->parent = dir;
+            job->name = g_strdup( ent->d_name );
+            job->error = 0;
+            ++dir->n_pending;
+            /* the memory used by the queued jobs is bounded */
+            if ( engine->n_jobs >= MAX_DELETE_JOBS )
+                handle_finished_delete_jobs( task, engine, TRUE );
+            ++engine->n_jobs;
+            g_thread_pool_push( engine->threads, job, NULL );
+        }
+        handle_finished_delete_jobs( task, engine, FALSE );
+    }
+    /* the walker is done with it */
+    release_delete_dir( task, engine, dir );
+}
+
 static void
 vfs_file_task_delete( char* src_file, VFSFileTask* task )
 {
-    GDir * dir;
-    const gchar* file_name;
-    gchar* sub_src_file;
     struct stat file_stat;
-    int result;
+    DeleteEngine engine;
+    DeleteDir* dir;
 
     task->current_file = src_file;
 
@@ -526,44 +1677,42 @@ vfs_file_task_delete( char* src_file, VFSFileTask* task )
     task->current_file = src_file;
     call_progress_callback( task );
 
-    if ( S_ISDIR( file_stat.st_mode ) )
+    if ( ! S_ISDIR( file_stat.st_mode ) )
     {
-        dir = g_dir_open( src_file, 0, NULL );
-        while ( (file_name = g_dir_read_name( dir )) )
-        {
-            if ( should_abort( task ) )
-                break;
-            sub_src_file = g_build_filename( src_file, file_name, NULL );
-            vfs_file_task_delete( sub_src_file, task );
-            g_free( sub_src_file );
-        }
-        g_dir_close( dir );
-        if ( should_abort( task ) )
-            return ;
-        result = rmdir( src_file );
-        if ( result != 0 )
+        if ( unlink( src_file ) != 0 )
         {
             task->error = errno;
             call_state_callback( task, VFS_FILE_TASK_ERROR );
             return ;
         }
-
-        task->progress += file_stat.st_size;
+        add_progress( task, 1 );
         call_progress_callback( task );
+        return ;
     }
-    else
-    {
-        result = unlink( src_file );
-        if ( result != 0 )
-        {
-            task->error = errno;
-            call_state_callback( task, VFS_FILE_TASK_ERROR );
-            return ;
-        }
 
-        task->progress += file_stat.st_size;
-        call_progress_callback( task );
+    if ( ! ( dir = open_delete_dir( NULL, src_file ) ) )
+    {
+        task->error = errno;
+        call_state_callback( task, VFS_FILE_TASK_ERROR );
+        return ;
     }
+
+    memset( &engine, 0, sizeof( engine ) );
+    engine.task = task;
+    engine.done = g_async_queue_new();
+    g_get_current_time( &engine.last_progress );
+
+    walk_delete_dir( task, &engine, dir, 0 );
+
+    /* wait for the workers */
+    while ( engine.n_jobs > 0 )
+        handle_finished_delete_jobs( task, &engine, TRUE );
+    if ( engine.threads )
+        g_thread_pool_free( engine.threads, FALSE, TRUE );
+    g_async_queue_unref( engine.done );
+
+    add_progress( task, engine.n_deleted );
+    call_progress_callback( task );
 }
 
 static void
@@ -598,7 +1747,7 @@ vfs_file_task_link( char* src_file, VFSFileTask* task )
         if ( should_abort( task ) )
             return ;
     }
-    task->progress += src_stat.st_size;
+    add_progress( task, src_stat.st_size );
     call_progress_callback( task );
 }
 
@@ -661,7 +1810,7 @@ vfs_file_task_chown_chmod( char* src_file, VFSFileTask* task )
             }
         }
 
-        task->progress += src_stat.st_size;
+        add_progress( task, src_stat.st_size );
         call_progress_callback( task );
 
         if ( S_ISDIR( src_stat.st_mode ) && task->recursive )
@@ -689,8 +1838,95 @@ vfs_file_task_chown_chmod( char* src_file, VFSFileTask* task )
     }
 }
 
+typedef struct _SizeScan
+{
+    VFSFileTask* task;
+    GSList* paths;  /* the paths whose trees should be scanned */
+}SizeScan;
+
+/*
+* Calculate task->total_size, usually in a separate thread, so the files
+* can be processed while the trees are still being scanned.  The scan
+* walks the trees ahead of the task thread, so the metadata is mostly
+* read from the disk only once, and the task thread gets it from the cache.
+* The size thread never calls the callbacks of the task.
+*/
+static gpointer calc_total_size( SizeScan* scan )
+{
+    VFSFileTask* task = scan->task;
+    GSList* l;
+
+    for ( l = scan->paths; l; l = l->next )
+    {
+        if ( is_size_scan_stopped( task ) )
+            break;
+        /* the progress of deletion is counted in files */
+        if ( task->type == VFS_FILE_TASK_DELETE )
+            count_files_at( task, AT_FDCWD, ( char* ) l->data, DT_UNKNOWN );
+        else
+            get_total_size_of_dir( task, ( char* ) l->data );
+    }
+
+    G_LOCK( progress );
+    task->total_size_known = TRUE;
+    G_UNLOCK( progress );
+
+    g_slist_free( scan->paths );
+    g_slice_free( SizeScan, scan );
+    return NULL;
+}
+
+/*
+* Start to calculate the total size of the trees of paths.
+* Deletion, and moves across devices, remove the source files while they
+* are processed, so a scan at the same time would miss them. These trees
+* are still scanned before they are processed.
+*/
+static void start_size_scan( VFSFileTask* task, GSList* paths )
+{
+    SizeScan* scan;
+
+    if ( paths )
+    {
+        scan = g_slice_new( SizeScan );
+        scan->task = task;
+        scan->paths = g_slist_reverse( paths );
+        if ( task->type == VFS_FILE_TASK_DELETE || task->type == VFS_FILE_TASK_MOVE
+             || task->type == VFS_FILE_TASK_TRASH )
+        {
+            calc_total_size( scan );
+            return;
+        }
+        task->size_thread = g_thread_create( ( GThreadFunc ) calc_total_size,
+                                             scan, TRUE, NULL );
+        if ( task->size_thread )
+            return;
+        /* scan the trees before processing them if there is no thread */
+        calc_total_size( scan );
+    }
+    else
+    {
+        G_LOCK( progress );
+        task->total_size_known = TRUE;
+        G_UNLOCK( progress );
+    }
+}
+
+static void stop_size_scan( VFSFileTask* task )
+{
+    if ( ! task->size_thread )
+        return;
+    /* the total size is no longer needed */
+    G_LOCK( progress );
+    task->total_size_known = TRUE;
+    G_UNLOCK( progress );
+    g_thread_join( task->size_thread );
+    task->size_thread = NULL;
+}
+
 static gpointer vfs_file_task_thread ( VFSFileTask* task )
 {
+    GSList* scan_paths = NULL;
     GList * l;
     struct stat file_stat;
     dev_t dest_dev = 0;
@@ -756,7 +1992,7 @@ static gpointer vfs_file_task_thread ( VFSFileTask* task )
                         goto _exit_thread;
                 }
             }
-            get_total_size_of_dir( task, ( char* ) l->data, &task->total_size );
+            scan_paths = g_slist_prepend( scan_paths, l->data );
         }
     }
     else
@@ -789,22 +2025,24 @@ static gpointer vfs_file_task_thread ( VFSFileTask* task )
                 task->recursive = ( file_stat.st_dev != dest_dev );
 
             if ( task->recursive )
-            {
-                get_total_size_of_dir( task, ( char* ) l->data,
-                                       &task->total_size );
-            }
+                scan_paths = g_slist_prepend( scan_paths, l->data );
             else
-            {
-                task->total_size += file_stat.st_size;
-            }
+                add_total_size( task, file_stat.st_size );
         }
     }
 
+    start_size_scan( task, scan_paths );
+    scan_paths = NULL;
+
     g_list_foreach( task->src_paths,
                     funcs[ task->type ],
                     task );
 
 _exit_thread:
+    g_slist_free( scan_paths );
+    stop_size_scan( task );
+    if ( task->copy_engine )
+        finish_copy_engine( task );
     if ( task->state_cb )
         call_state_callback( task, VFS_FILE_TASK_FINISH );
     else
@@ -890,33 +2128,32 @@ void vfs_file_task_free ( VFSFileTask* task )
         g_slice_free1( sizeof( guchar ) * N_CHMOD_ACTIONS,
                        task->chmod_actions );
 
+    g_free( task->progress_file );
+    g_free( task->progress_dest );
+
     g_slice_free( VFSFileTask, task );
 }
 
 /*
-* void get_total_size_of_dir( const char* path, off_t* size )
-* Recursively count total size of all files in the specified directory.
-* If the path specified is a file, the size of the file is directly returned.
-* cancel is used to cancel the operation. This function will check the value
-* pointed by cancel in every iteration. If cancel is set to TRUE, the
-* calculation is cancelled.
-* NOTE: *size should be set to zero before calling this function.
+* void get_total_size_of_dir( VFSFileTask* task, const char* path )
+* Recursively count total size of all files in the specified directory,
+* and add it to task->total_size.
 */
 void get_total_size_of_dir( VFSFileTask* task,
-                            const char* path,
-                            off_t* size )
+                            const char* path )
 {
     GDir * dir;
     const char* name;
     char* full_path;
     struct stat file_stat;
 
-    if ( should_abort( task ) )
+    if ( is_size_scan_stopped( task ) )
         return;
 
-    lstat( path, &file_stat );
+    if ( lstat( path, &file_stat ) < 0 )
+        return ;
 
-    *size += file_stat.st_size;
+    add_total_size( task, file_stat.st_size );
     if ( S_ISLNK( file_stat.st_mode ) )             /* Don't follow symlinks */
         return ;
 
@@ -925,17 +2162,15 @@ void get_total_size_of_dir( VFSFileTask* task,
     {
         while ( (name = g_dir_read_name( dir )) )
         {
-            if ( should_abort( task ) )
+            if ( is_size_scan_stopped( task ) )
                 break;
             full_path = g_build_filename( path, name, NULL );
-            lstat( full_path, &file_stat );
-            if ( S_ISDIR( file_stat.st_mode ) )
+            if ( lstat( full_path, &file_stat ) == 0 )
             {
-                get_total_size_of_dir( task, full_path, size );
-            }
-            else
-            {
-                *size += file_stat.st_size;
+                if ( S_ISDIR( file_stat.st_mode ) )
+                    get_total_size_of_dir( task, full_path );
+                else
+                    add_total_size( task, file_stat.st_size );
             }
             g_free( full_path );
         }
@@ -962,6 +2197,20 @@ void vfs_file_task_set_progress_callback( VFSFileTask* task,
     task->progress_cb_data = user_data;
 }
 
+int vfs_file_task_get_progress( VFSFileTask* task, char** current_file,
+                                char** current_dest )
+{
+    int percent;
+
+    G_LOCK( progress );
+    percent = task->percent;
+    *current_file = g_strdup( task->progress_file );
+    if ( current_dest )
+        *current_dest = g_strdup( task->progress_dest );
+    G_UNLOCK( progress );
+    return percent;
+}
+
 void vfs_file_task_set_state_callback( VFSFileTask* task,
                                        VFSFileTaskStateCallback cb,
                                        gpointer user_data )
@@ -98,7 +98,8 @@ struct _VFSFileTask
     /* For chmod */
     guchar *chmod_actions;  /* If chmod is not needed, this should be NULL */
 
-    off_t total_size; /* Total size of the files to be processed, in bytes */
+    off_t total_size; /* Total size of the files to be processed, in bytes.
+                         It grows while the task is running. */
     off_t progress; /* Total size of current processed files, in btytes */
     int percent; /* progress (percentage) */
 
@@ -115,6 +116,14 @@ struct _VFSFileTask
 
     VFSFileTaskStateCallback state_cb;
     gpointer state_cb_data;
+
+    /* <private> */
+    struct _VFSCopyEngine* copy_engine; /* used to copy files with many threads */
+    GThread* size_thread; /* calculates total_size while the files are processed */
+    gboolean total_size_known; /* total_size is final, or no longer needed */
+    GTimeVal last_progress; /* when the progress was published last time */
+    char* progress_file; /* copy of current_file published with the progress */
+    char* progress_dest; /* copy of current_dest published with the progress */
 };
 
 /*
@@ -133,10 +142,19 @@ void vfs_file_task_set_chmod( VFSFileTask* task,
 void vfs_file_task_set_chown( VFSFileTask* task,
                               uid_t uid, gid_t gid );
 
+/* The progress callback is called by the task thread at most
+ * ten times per second, no matter how many files are processed. */
 void vfs_file_task_set_progress_callback( VFSFileTask* task,
                                           VFSFileTaskProgressCallback cb,
                                           gpointer user_data );
 
+/* Get the percentage, the current file and its destination last published
+ * by the task thread. This can be polled by the UI with a timer instead of
+ * using the progress callback. current_dest can be NULL. The returned
+ * files should be freed with g_free(). */
+int vfs_file_task_get_progress( VFSFileTask* task, char** current_file,
+                                char** current_dest );
+
 void vfs_file_task_set_state_callback( VFSFileTask* task,
                                        VFSFileTaskStateCallback cb,
                                        gpointer user_data );
@@ -12,6 +12,7 @@
 
 #include "vfs-mime-type.h"
 #include "mime-action.h"
+#include "vfs-app-desktop.h"
 #include "vfs-file-monitor.h"
 
 #include <sys/types.h>
@@ -35,6 +36,11 @@ static GList* reload_cb = NULL;
 static int big_icon_size = 32, small_icon_size = 16;
 
 static VFSFileMonitor** mime_caches_monitor = NULL;
+/* monitors of "applications" dirs containing mimeinfo.cache, defaults.list and desktop files,
+ * and of their sub dirs, since desktop ids like kde4-foo.desktop are found in sub dirs */
+static GSList* app_dirs_monitor = NULL;
+/* monitors of the data dirs, to find "applications" dirs created later */
+static GSList* data_dirs_monitor = NULL;
 
 static guint theme_change_notify = 0;
 
@@ -77,7 +83,15 @@ static void on_mime_cache_changed( VFSFileMonitor* fm,
                                         const char* file_name,
                                         gpointer user_data )
 {
-    MimeCache* cache = (MimeCache*)user_data;
+    MimeCache** caches;
+    MimeCache* cache;
+    int n_caches;
+
+    /* The caches are replaced when reloaded, so they are referred to by index */
+    caches = mime_type_get_caches( &n_caches );
+    if( GPOINTER_TO_INT( user_data ) >= n_caches )
+        return;
+    cache = caches[ GPOINTER_TO_INT( user_data ) ];
     switch( event )
     {
     case VFS_FILE_MONITOR_CREATE:
@@ -87,6 +101,7 @@ static void on_mime_cache_changed( VFSFileMonitor* fm,
         if( ! cache->buffer )
             return;
     case VFS_FILE_MONITOR_CHANGE:
+    case VFS_FILE_MONITOR_OVERFLOW:
         mime_cache_reload( cache );
         /* g_debug( "reload cache: %s", file_name ); */
         if( 0 == reload_callback_id )
@@ -94,11 +109,206 @@ static void on_mime_cache_changed( VFSFileMonitor* fm,
     }
 }
 
+static void add_app_dir_monitor( const char* path, int depth );
+
+static gboolean is_app_dir_monitored( const char* path )
+{
+    GSList* l;
+    for( l = app_dirs_monitor; l; l = l->next )
+    {
+        if( 0 == strcmp( ((VFSFileMonitor*)l->data)->path, path ) )
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Stop monitoring the removed dir and its sub dirs */
+static void remove_app_dir_monitors( const char* path )
+{
+    GSList *l, *next;
+    VFSFileMonitor* fm;
+    int len = strlen( path );
+
+    for( l = app_dirs_monitor; l; l = next )
+    {
+        next = l->next;
+        fm = (VFSFileMonitor*)l->data;
+        if( 0 == strncmp( fm->path, path, len )
+            && ( fm->path[ len ] == '\0' || fm->path[ len ] == '/' ) )
+        {
+            app_dirs_monitor = g_slist_delete_link( app_dirs_monitor, l );
+            vfs_file_monitor_remove( fm, on_app_dir_changed, NULL );
+        }
+    }
+}
+
+static void rescan_app_dir_monitors( const char* path, int depth );
+
+static void on_app_dir_changed( VFSFileMonitor* fm,
+                                VFSFileMonitorEvent event,
+                                const char* file_name,
+                                gpointer user_data )
+{
+    char* path;
+
+    if( event == VFS_FILE_MONITOR_OVERFLOW )
+    {
+        /* the sub dirs created or removed meanwhile are not known */
+        rescan_app_dir_monitors( fm->path, 1 );
+    }
+    else if( event == VFS_FILE_MONITOR_CREATE || event == VFS_FILE_MONITOR_DELETE )
+    {
+        path = g_build_filename( fm->path, file_name, NULL );
+        /* monitor the new sub dirs, and stop monitoring the removed ones */
+        if( event == VFS_FILE_MONITOR_CREATE )
+            add_app_dir_monitor( path, 1 );
+        else if( strcmp( path, fm->path ) )
+            remove_app_dir_monitors( path );
+        g_free( path );
+    }
+
+    /* they will be parsed again when needed */
+    mime_type_reload_actions();
+    vfs_app_desktop_clear_cache();
+}
+
+/* Monitor the dir and its sub dirs. depth is 0 for the "applications" dir itself */
+static void add_app_dir_monitor( const char* path, int depth )
+{
+    VFSFileMonitor* fm;
+    GDir* dir;
+    const char* name;
+    char* sub_dir;
+
+    if( depth > 8 || is_app_dir_monitored( path )
+        || ! g_file_test( path, G_FILE_TEST_IS_DIR ) )
+        return;
+    fm = vfs_file_monitor_add_dir( (char*)path, on_app_dir_changed, NULL );
+    if( ! fm )
+        return;
+    app_dirs_monitor = g_slist_prepend( app_dirs_monitor, fm );
+
+    if( (dir = g_dir_open( path, 0, NULL )) )
+    {
+        while( (name = g_dir_read_name( dir )) )
+        {
+            sub_dir = g_build_filename( path, name, NULL );
+            add_app_dir_monitor( sub_dir, depth + 1 );
+            g_free( sub_dir );
+        }
+        g_dir_close( dir );
+    }
+}
+
+/* Monitor the sub dirs not monitored yet. The dir itself is added if needed. */
+static void add_new_app_dir_monitors( const char* path, int depth )
+{
+    GDir* dir;
+    const char* name;
+    char* sub_dir;
+
+    if( depth > 8 )
+        return;
+    if( ! is_app_dir_monitored( path ) )
+    {
+        add_app_dir_monitor( path, depth );
+        return;
+    }
+    if( (dir = g_dir_open( path, 0, NULL )) )
+    {
+        while( (name = g_dir_read_name( dir )) )
+        {
+            sub_dir = g_build_filename( path, name, NULL );
+            add_new_app_dir_monitors( sub_dir, depth + 1 );
+            g_free( sub_dir );
+        }
+        g_dir_close( dir );
+    }
+}
+
+/*
+ * Called after the events of the dir were lost. Stop monitoring the sub dirs
+ * which are removed, and monitor the new ones.
+ */
+static void rescan_app_dir_monitors( const char* path, int depth )
+{
+    GSList* l;
+    VFSFileMonitor* fm;
+    char* removed;
+    int len = strlen( path );
+
+    for( l = app_dirs_monitor; l; )
+    {
+        fm = (VFSFileMonitor*)l->data;
+        if( 0 == strncmp( fm->path, path, len ) && fm->path[ len ] == '/'
+            && ! g_file_test( fm->path, G_FILE_TEST_IS_DIR ) )
+        {
+            /* fm is freed while its sub dirs are removed */
+            removed = g_strdup( fm->path );
+            remove_app_dir_monitors( removed );
+            g_free( removed );
+            l = app_dirs_monitor;   /* the list is changed */
+        }
+        else
+            l = l->next;
+    }
+    add_new_app_dir_monitors( path, depth );
+}
+
+static void on_data_dir_changed( VFSFileMonitor* fm,
+                                 VFSFileMonitorEvent event,
+                                 const char* file_name,
+                                 gpointer user_data )
+{
+    char* path;
+
+    if( event == VFS_FILE_MONITOR_OVERFLOW )
+    {
+        /* file_name is the path of the data dir, and the events are lost */
+        path = g_build_filename( fm->path, "applications", NULL );
+        if( g_file_test( path, G_FILE_TEST_IS_DIR ) )
+            rescan_app_dir_monitors( path, 0 );
+        else
+            remove_app_dir_monitors( path );
+        g_free( path );
+        mime_type_reload_actions();
+        vfs_app_desktop_clear_cache();
+        return;
+    }
+    if( strcmp( file_name, "applications" ) )
+        return;
+    /* The "applications" dir is created or removed after we started */
+    path = g_build_filename( fm->path, file_name, NULL );
+    if( event == VFS_FILE_MONITOR_CREATE )
+        add_app_dir_monitor( path, 0 );
+    else if( event == VFS_FILE_MONITOR_DELETE )
+        remove_app_dir_monitors( path );
+    g_free( path );
+    mime_type_reload_actions();
+    vfs_app_desktop_clear_cache();
+}
+
+static void add_data_dir_monitor( const char* data_dir )
+{
+    VFSFileMonitor* fm;
+    char* path = g_build_filename( data_dir, "applications", NULL );
+
+    add_app_dir_monitor( path, 0 );
+    g_free( path );
+    if( g_file_test( data_dir, G_FILE_TEST_IS_DIR ) )
+    {
+        fm = vfs_file_monitor_add_dir( (char*)data_dir, on_data_dir_changed, NULL );
+        if( fm )
+            data_dirs_monitor = g_slist_prepend( data_dirs_monitor, fm );
+    }
+}
+
 void vfs_mime_type_init()
 {
     GtkIconTheme * theme;
     MimeCache** caches;
     int i, n_caches;
+    const gchar* const * dirs;
 
     mime_type_init();
 
@@ -108,9 +318,15 @@ void vfs_mime_type_init()
     for( i = 0; i < n_caches; ++i )
     {
         VFSFileMonitor* fm = vfs_file_monitor_add_file( caches[i]->file_path,
-                                                                on_mime_cache_changed, caches[i] );
+                                                                on_mime_cache_changed, GINT_TO_POINTER(i) );
         mime_caches_monitor[i] = fm;
     }
+
+    /* install file alteration monitor for the files used to find the actions */
+    add_data_dir_monitor( g_get_user_data_dir() );
+    for( dirs = g_get_system_data_dirs(); *dirs; ++dirs )
+        add_data_dir_monitor( *dirs );
+
     mime_hash = g_hash_table_new_full( g_str_hash, g_str_equal,
                                        NULL, vfs_mime_type_unref );
     theme = gtk_icon_theme_get_default();
@@ -124,6 +340,7 @@ void vfs_mime_type_clean()
     GtkIconTheme * theme;
     MimeCache** caches;
     int i, n_caches;
+    GSList* l;
 
     theme = gtk_icon_theme_get_default();
     g_signal_handler_disconnect( theme, theme_change_notify );
@@ -133,10 +350,21 @@ void vfs_mime_type_clean()
     for( i = 0; i < n_caches; ++i )
     {
         vfs_file_monitor_remove( mime_caches_monitor[i],
-                                        on_mime_cache_changed, caches[i] );
+                                        on_mime_cache_changed, GINT_TO_POINTER(i) );
     }
     g_free( mime_caches_monitor );
 
+    for( l = app_dirs_monitor; l; l = l->next )
+        vfs_file_monitor_remove( (VFSFileMonitor*)l->data, on_app_dir_changed, NULL );
+    g_slist_free( app_dirs_monitor );
+    app_dirs_monitor = NULL;
+    for( l = data_dirs_monitor; l; l = l->next )
+        vfs_file_monitor_remove( (VFSFileMonitor*)l->data, on_data_dir_changed, NULL );
+    g_slist_free( data_dirs_monitor );
+    data_dirs_monitor = NULL;
+    mime_type_reload_actions();
+    vfs_app_desktop_clear_cache();
+
     mime_type_finalize();
 
     g_hash_table_destroy( mime_hash );
@@ -159,6 +387,16 @@ VFSMimeType* vfs_mime_type_get_from_file( const char* file_path,
     return vfs_mime_type_get_from_type( type );
 }
 
+VFSMimeType* vfs_mime_type_get_from_file_fast( const char* file_path,
+                                               const char* base_name,
+                                               struct stat* pstat,
+                                               gboolean* need_magic )
+{
+    const char * type;
+    type = mime_type_get_by_file_fast( file_path, pstat, base_name, need_magic );
+    return vfs_mime_type_get_from_type( type );
+}
+
 VFSMimeType* vfs_mime_type_get_from_type( const char* type )
 {
     VFSMimeType * mime_type;
@@ -44,6 +44,13 @@ VFSMimeType* vfs_mime_type_get_from_file( const char* file_path,  /* Should be o
                                           const char* base_name,  /* Should be in UTF-8 */
                                           struct stat* pstat );   /* Can be NULL */
 
+/* Same as vfs_mime_type_get_from_file(), but never read the content of the file.
+ * See mime_type_get_by_file_fast(). */
+VFSMimeType* vfs_mime_type_get_from_file_fast( const char* file_path,
+                                               const char* base_name,
+                                               struct stat* pstat,
+                                               gboolean* need_magic );
+
 VFSMimeType* vfs_mime_type_get_from_type( const char* type );
 
 VFSMimeType* vfs_mime_type_new( const char* type_name );
@@ -25,16 +25,26 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
 
 #if GLIB_CHECK_VERSION(2, 16, 0)
     #include "md5.h"    /* for thumbnails */
 #endif
 
+/*
+ * All VFSDirs share one pool of worker threads.  Requests wait in a global
+ * queue for each priority level, and the workers always take the oldest
+ * request with the highest priority.  The per-dir loader only keeps track of
+ * its own requests, and delivers the loaded thumbnails in the main loop.
+ */
+
 struct _VFSThumbnailLoader
 {
-    VFSDir* dir;
-    GQueue* queue;
-    VFSAsyncTask* task;
+    VFSDir* dir;    /* NULL after the loader is freed */
+    int n_ref;      /* the dir, every unfinished request, and the idle handler */
+    GHashTable* requests;   /* VFSFileInfo* => queued ThumbnailRequest */
+    int n_requests; /* queued and running requests */
     guint idle_handler;
     GQueue* update_queue;
 };
@@ -50,12 +60,24 @@ typedef struct _ThumbnailRequest
 {
     int n_requests[ N_LOAD_TYPES ];
     VFSFileInfo* file;
+    char* path;
+    VFSThumbnailLoader* loader;
+    VFSThumbnailPriority priority;
+    GList* link;    /* link in the queue of its priority, NULL if it's running */
 }
 ThumbnailRequest;
 
-static gpointer thumbnail_loader_thread( VFSAsyncTask* task, VFSThumbnailLoader* loader );
-/* static void on_load_finish( VFSAsyncTask* task, gboolean is_cancelled, VFSThumbnailLoader* loader ); */
+/* Guards the queues, and everything in the loaders and the requests */
+G_LOCK_DEFINE_STATIC( queue );
+static GQueue* queues[ N_VFS_THUMBNAIL_PRIORITIES ] = { NULL };
+static GThreadPool* pool = NULL;
+static int max_threads = 0;
+
+static void thumbnail_worker( gpointer data, gpointer user_data );
 static void thumbnail_request_free( ThumbnailRequest* req );
+static void thumbnail_request_set_priority( ThumbnailRequest* req,
+                                            VFSThumbnailPriority priority );
+static void thumbnail_loader_unref( VFSThumbnailLoader* loader );
 static gboolean on_thumbnail_idle( VFSThumbnailLoader* loader );
 
 
@@ -63,54 +85,72 @@ VFSThumbnailLoader* vfs_thumbnail_loader_new( VFSDir* dir )
 {
     VFSThumbnailLoader* loader = g_slice_new0( VFSThumbnailLoader );
     loader->dir = g_object_ref( dir );
-    loader->queue = g_queue_new();
+    loader->n_ref = 1;
+    loader->requests = g_hash_table_new( g_direct_hash, g_direct_equal );
     loader->update_queue = g_queue_new();
-    loader->task = vfs_async_task_new( (VFSAsyncFunc)thumbnail_loader_thread, loader );
-    /* g_signal_connect( loader->task, "finish", G_CALLBACK(on_load_finish), loader ); */
     return loader;
 }
 
-void vfs_thumbnail_loader_free( VFSThumbnailLoader* loader )
+/* Called with the lock held. If load_type is NULL, the request is always removed. */
+static gboolean remove_request( VFSFileInfo* file, ThumbnailRequest* req, int* load_type )
 {
-    if( loader->idle_handler )
-        g_source_remove( loader->idle_handler );
+    if( load_type )
+        --req->n_requests[ *load_type ];
+    if( req->n_requests[0] > 0 || req->n_requests[1] > 0 )
+        return FALSE;
+    /* nobody needs this, take it off the queue.
+     * The worker which was woken up for it will find nothing to do. */
+    g_queue_delete_link( queues[ req->priority ], req->link );
+    --req->loader->n_requests;
+    thumbnail_request_free( req );
+    return TRUE;
+}
 
-    /* g_signal_handlers_disconnect_by_func( loader->task, on_load_finish, loader ); */
-    /* stop the running thread, if any. */
-    vfs_async_task_cancel( loader->task );
+/* Stop delivering thumbnails to the dir, and drop all queued requests.
+ * Requests being processed by the workers still hold a reference of the
+ * loader, so it's really freed after they are finished. */
+void vfs_thumbnail_loader_free( VFSThumbnailLoader* loader )
+{
+    VFSDir* dir;
+    VFSFileInfo* file;
 
+    G_LOCK( queue );
+    g_hash_table_foreach_remove( loader->requests, (GHRFunc)remove_request, NULL );
+    while( ( file = (VFSFileInfo*)g_queue_pop_head( loader->update_queue ) ) )
+        vfs_file_info_unref( file );
     if( loader->idle_handler )
-        g_source_remove( loader->idle_handler );
-
-    g_object_unref( loader->task );
-
-    if( loader->queue )
     {
-        g_queue_foreach( loader->queue, (GFunc) thumbnail_request_free, NULL );
-        g_queue_free( loader->queue );
-    }
-    if( loader->update_queue )
-    {
-        g_queue_foreach( loader->update_queue, (GFunc) vfs_file_info_unref, NULL );
-        g_queue_free( loader->update_queue );
+        g_source_remove( loader->idle_handler );
+        loader->idle_handler = 0;
+        --loader->n_ref;
     }
+    dir = loader->dir;
+    loader->dir = NULL;
+    thumbnail_loader_unref( loader );
+    G_UNLOCK( queue );
     /* g_debug( "FREE THUMBNAIL LOADER" ); */
 
     /* prevent recursive unref called from vfs_dir_finalize */
-    loader->dir->thumbnail_loader = NULL;
-    g_object_unref( loader->dir );
+    dir->thumbnail_loader = NULL;
+    g_object_unref( dir );
 }
 
-#if 0  /* This is not used in the program. For debug only */
-void on_load_finish( VFSAsyncTask* task, gboolean is_cancelled, VFSThumbnailLoader* loader )
+/* Called with the lock held */
+void thumbnail_loader_unref( VFSThumbnailLoader* loader )
 {
-    g_debug( "TASK FINISHED" );
+    if( --loader->n_ref > 0 )
+        return;
+    g_hash_table_destroy( loader->requests );
+    g_queue_free( loader->update_queue );
+    g_slice_free( VFSThumbnailLoader, loader );
 }
-#endif
 
+/* Called with the lock held */
 void thumbnail_request_free( ThumbnailRequest* req )
 {
     vfs_file_info_unref( req->file );
+    g_free( req->path );
+    thumbnail_loader_unref( req->loader );
     g_slice_free( ThumbnailRequest, req );
     /* g_debug( "FREE REQUEST!" ); */
 }
@@ -118,199 +158,404 @@ void thumbnail_request_free( ThumbnailRequest* req )
 gboolean on_thumbnail_idle( VFSThumbnailLoader* loader )
 {
     VFSFileInfo* file;
+    GList *files, *l;
+    gboolean finished;
+
     /* g_debug( "ENTER ON_THUMBNAIL_IDLE" ); */
-    vfs_async_task_lock( loader->task );
+    G_LOCK( queue );
+    files = loader->update_queue->head;
+    loader->update_queue->head = loader->update_queue->tail = NULL;
+    loader->update_queue->length = 0;
+    loader->idle_handler = 0;
+    G_UNLOCK( queue );
 
-    while( ( file = (VFSFileInfo*)g_queue_pop_head(loader->update_queue) )  )
+    GDK_THREADS_ENTER();
+    for( l = files; l; l = l->next )
     {
-        GDK_THREADS_ENTER();
-        vfs_dir_emit_thumbnail_loaded( loader->dir, file );
+        file = (VFSFileInfo*)l->data;
+        /* The handlers might free the loader */
+        if( G_LIKELY( loader->dir ) )
+            vfs_dir_emit_thumbnail_loaded( loader->dir, file );
         vfs_file_info_unref( file );
-        GDK_THREADS_LEAVE();
     }
+    g_list_free( files );
 
-    loader->idle_handler = 0;
-
-    vfs_async_task_unlock( loader->task );
+    G_LOCK( queue );
+    /* Nothing is left to do, unless the handlers queued new requests */
+    finished = loader->dir && 0 == loader->n_requests && 0 == loader->idle_handler;
+    thumbnail_loader_unref( loader );
+    G_UNLOCK( queue );
 
-    if( vfs_async_task_is_finished( loader->task ) )
+    if( finished )
     {
         /* g_debug( "FREE LOADER IN IDLE HANDLER" ); */
-        loader->dir->thumbnail_loader = NULL;
         vfs_thumbnail_loader_free(loader);
     }
+    GDK_THREADS_LEAVE();
     /* g_debug( "LEAVE ON_THUMBNAIL_IDLE" ); */
 
     return FALSE;
 }
 
-gpointer thumbnail_loader_thread( VFSAsyncTask* task, VFSThumbnailLoader* loader )
+/* Called with the lock held */
+void thumbnail_request_set_priority( ThumbnailRequest* req, VFSThumbnailPriority priority )
 {
-    ThumbnailRequest* req;
-    int i;
+    g_queue_unlink( queues[ req->priority ], req->link );
+    req->priority = priority;
+    g_queue_push_tail_link( queues[ priority ], req->link );
+}
+
+void thumbnail_worker( gpointer data, gpointer user_data )
+{
+    ThumbnailRequest* req = NULL;
+    VFSThumbnailLoader* loader;
+    int i, n_requests[ N_LOAD_TYPES ];
     gboolean load_big, need_update;
 
-    while( G_LIKELY( ! vfs_async_task_is_cancelled(task) ))
+    G_LOCK( queue );
+    for( i = N_VFS_THUMBNAIL_PRIORITIES - 1; i >= 0; --i )
     {
-        vfs_async_task_lock( task );
-        req = (ThumbnailRequest*)g_queue_pop_head( loader->queue );
-        vfs_async_task_unlock( task );
-        if( G_UNLIKELY( ! req ) )
+        if( ( req = (ThumbnailRequest*)g_queue_pop_head( queues[ i ] ) ) )
             break;
-        /* g_debug("pop: %s", req->file->name); */
-
-        /* Only we have the reference. That means, no body is using the file */
-        if( req->file->n_ref == 1 )
-        {
-            thumbnail_request_free( req );
-            continue;
-        }
-
-        need_update = FALSE;
-        for ( i = 0; i < 2; ++i )
+    }
+    if( G_UNLIKELY( ! req ) ) /* the request was cancelled */
+    {
+        G_UNLOCK( queue );
+        return;
+    }
+    req->link = NULL;
+    loader = req->loader;
+    g_hash_table_remove( loader->requests, req->file );
+    memcpy( n_requests, req->n_requests, sizeof(n_requests) );
+    G_UNLOCK( queue );
+    /* g_debug("pop: %s", req->file->name); */
+
+    need_update = FALSE;
+    /* If only we have the reference, nobody is using the file */
+    if( req->file->n_ref > 1 )
+    {
+        for ( i = 0; i < N_LOAD_TYPES; ++i )
         {
-            if ( 0 == req->n_requests[ i ] )
+            if ( 0 == n_requests[ i ] )
                 continue;
             load_big = ( i == LOAD_BIG_THUMBNAIL );
             if ( ! vfs_file_info_is_thumbnail_loaded( req->file, load_big ) )
             {
-                char* full_path;
-                full_path = g_build_filename( loader->dir->path,
-                                              vfs_file_info_get_name( req->file ),
-                                              NULL );
-                vfs_file_info_load_thumbnail( req->file, full_path, load_big );
-                g_free( full_path );
-                /*  Slow down for displaying. */
-                g_usleep(G_USEC_PER_SEC/1000);
-
-                /* g_debug( "thumbnail loaded: %s", req->file ); */
+                vfs_file_info_load_thumbnail( req->file, req->path, load_big );
+                /* g_debug( "thumbnail loaded: %s", req->path ); */
             }
             need_update = TRUE;
         }
-
-        if( ! vfs_async_task_is_cancelled(task) && need_update )
-        {
-            vfs_async_task_lock( task );
-            g_queue_push_tail( loader->update_queue, vfs_file_info_ref(req->file) );
-            if( 0 == loader->idle_handler)
-                loader->idle_handler = g_idle_add_full( G_PRIORITY_LOW, (GSourceFunc) on_thumbnail_idle, loader, NULL );
-            vfs_async_task_unlock( task );
-        }
-        /* g_debug( "NEED_UPDATE: %d", need_update ); */
-        thumbnail_request_free( req );
     }
 
-    if( vfs_async_task_is_cancelled(task) )
+    G_LOCK( queue );
+    if( G_LIKELY( loader->dir ) )    /* the loader isn't freed */
     {
-        /* g_debug( "THREAD CANCELLED!!!" ); */
-        vfs_async_task_lock( task );
-        if( loader->idle_handler)
-        {
-            g_source_remove( loader->idle_handler );
-            loader->idle_handler = 0;
-        }
-        vfs_async_task_unlock( task );
-    }
-    else
-    {
-        if( 0 == loader->idle_handler)
+        if( need_update )
+            g_queue_push_tail( loader->update_queue, vfs_file_info_ref(req->file) );
+        /* The last request also needs the idle handler to free the loader */
+        if( ( need_update || 1 == loader->n_requests ) && 0 == loader->idle_handler )
         {
-            /* g_debug( "ADD IDLE HANDLER BEFORE THREAD ENDING" ); */
+            ++loader->n_ref;
             loader->idle_handler = g_idle_add_full( G_PRIORITY_LOW, (GSourceFunc) on_thumbnail_idle, loader, NULL );
         }
     }
-    /* g_debug("THREAD ENDED!");  */
-    return NULL;
+    --loader->n_requests;
+    /* g_debug( "NEED_UPDATE: %d", need_update ); */
+    thumbnail_request_free( req );
+    G_UNLOCK( queue );
+}
+
+static int get_n_processors()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    int n = sysconf( _SC_NPROCESSORS_ONLN );
+    if( n > 0 )
+        return n;
+#endif
+    return 1;
+}
+
+void vfs_thumbnail_set_max_threads( int n )
+{
+    if( n <= 0 )    /* one thread for each processor by default */
+        n = get_n_processors();
+    G_LOCK( queue );
+    max_threads = n;
+    if( pool )
+        g_thread_pool_set_max_threads( pool, max_threads, NULL );
+    G_UNLOCK( queue );
 }
 
 void vfs_thumbnail_loader_request( VFSDir* dir, VFSFileInfo* file, gboolean is_big )
+{
+    vfs_thumbnail_loader_request_full( dir, file, is_big,
+                                       VFS_THUMBNAIL_PRIORITY_NORMAL );
+}
+
+void vfs_thumbnail_loader_request_full( VFSDir* dir, VFSFileInfo* file,
+                                        gboolean is_big, VFSThumbnailPriority priority )
 {
     VFSThumbnailLoader* loader;
     ThumbnailRequest* req;
-    gboolean new_task = FALSE;
-    GList* l;
+    int i;
 
     /* g_debug( "request thumbnail: %s, is_big: %d", file->name, is_big ); */
     if( G_UNLIKELY( ! dir->thumbnail_loader ) )
-    {
         dir->thumbnail_loader = vfs_thumbnail_loader_new( dir );
-        new_task = TRUE;
-    }
 
     loader = dir->thumbnail_loader;
 
-    if( G_UNLIKELY( ! loader->task ) )
+    G_LOCK( queue );
+
+    if( G_UNLIKELY( ! pool ) )
     {
-        loader->task = vfs_async_task_new( (VFSAsyncFunc)thumbnail_loader_thread, loader );
-        new_task = TRUE;
+        for( i = 0; i < N_VFS_THUMBNAIL_PRIORITIES; ++i )
+            queues[ i ] = g_queue_new();
+        if( max_threads <= 0 )
+            max_threads = get_n_processors();
+        pool = g_thread_pool_new( thumbnail_worker, NULL, max_threads, FALSE, NULL );
     }
-    vfs_async_task_lock( loader->task );
 
     /* Check if the request is already scheduled */
-    for( l = loader->queue->head; l; l = l->next )
-    {
-        req = (ThumbnailRequest*)l->data;
-        /* If file with the same name is already in our queue */
-        if( req->file == file || 0 == strcmp( req->file->name, file->name ) )
-            break;
-    }
-    if( l )
+    req = (ThumbnailRequest*)g_hash_table_lookup( loader->requests, file );
+    if( req )
     {
-        req = (ThumbnailRequest*)l->data;
+        /* Move it forward if it's needed more urgently now */
+        if( priority > req->priority )
+            thumbnail_request_set_priority( req, priority );
     }
     else
     {
         req = g_slice_new0( ThumbnailRequest );
         req->file = vfs_file_info_ref(file);
-        g_queue_push_tail( dir->thumbnail_loader->queue, req );
+        req->path = g_build_filename( dir->path, vfs_file_info_get_name( file ), NULL );
+        req->loader = loader;
+        ++loader->n_ref;
+        ++loader->n_requests;
+        req->priority = priority;
+        g_queue_push_tail( queues[ priority ], req );
+        req->link = queues[ priority ]->tail;
+        g_hash_table_insert( loader->requests, file, req );
+        /* wake up a worker, which takes the most urgent request */
+        g_thread_pool_push( pool, GINT_TO_POINTER(1), NULL );
     }
 
     ++req->n_requests[ is_big ? LOAD_BIG_THUMBNAIL : LOAD_SMALL_THUMBNAIL ];
 
-    vfs_async_task_unlock( loader->task );
+    G_UNLOCK( queue );
+}
+
+void vfs_thumbnail_loader_set_priority( VFSDir* dir, VFSFileInfo* file,
+                                        VFSThumbnailPriority priority )
+{
+    ThumbnailRequest* req;
 
-    if( new_task )
-        vfs_async_task_execute( loader->task );
+    if( ! dir->thumbnail_loader )
+        return;
+    G_LOCK( queue );
+    req = (ThumbnailRequest*)g_hash_table_lookup( dir->thumbnail_loader->requests, file );
+    if( req && req->priority != priority )
+        thumbnail_request_set_priority( req, priority );
+    G_UNLOCK( queue );
 }
 
 void vfs_thumbnail_loader_cancel_all_requests( VFSDir* dir, gboolean is_big )
 {
-    GList* l;
     VFSThumbnailLoader* loader;
-    ThumbnailRequest* req;
+    int load_type = is_big ? LOAD_BIG_THUMBNAIL : LOAD_SMALL_THUMBNAIL;
 
     if( G_UNLIKELY( (loader=dir->thumbnail_loader) ) )
     {
-        vfs_async_task_lock( loader->task );
+        G_LOCK( queue );
         /* g_debug( "TRY TO CANCEL REQUESTS!!" ); */
-        for( l = loader->queue->head; l;  )
+        g_hash_table_foreach_remove( loader->requests, (GHRFunc)remove_request, &load_type );
+
+        if( 0 == loader->n_requests )
         {
-            req = (ThumbnailRequest*)l->data;
-            --req->n_requests[ is_big ? LOAD_BIG_THUMBNAIL : LOAD_SMALL_THUMBNAIL ];
+            /* g_debug( "FREE LOADER IN vfs_thumbnail_loader_cancel_all_requests!" ); */
+            G_UNLOCK( queue );
+            vfs_thumbnail_loader_free( loader );
+            return;
+        }
+        G_UNLOCK( queue );
+    }
+}
+
+/* Scale the pixbuf to fit in a size x size square, keeping its aspect ratio */
+static GdkPixbuf* scale_thumbnail( GdkPixbuf* pixbuf, int size )
+{
+    int w, h;
+
+    w = gdk_pixbuf_get_width( pixbuf );
+    h = gdk_pixbuf_get_height( pixbuf );
+
+    if ( w > h )
+    {
+        h = h * size / w;
+        w = size;
+    }
+    else if ( h > w )
+    {
+        w = w * size / h;
+        h = size;
+    }
+    else
+    {
+        w = h = size;
+    }
+    return gdk_pixbuf_scale_simple( pixbuf, MAX( w, 1 ), MAX( h, 1 ),
+                                    GDK_INTERP_BILINEAR );
+}
+
+static gboolean is_jpeg( GdkPixbufFormat* format )
+{
+    char* name = gdk_pixbuf_format_get_name( format );
+    gboolean ret = ( name && 0 == strcmp( name, "jpeg" ) );
+    g_free( name );
+    return ret;
+}
 
-            if( req->n_requests[0]  <= 0 && req->n_requests[1] <= 0 )   /* nobody needs this */
+/*
+ * Most digital cameras store a small JPEG preview, usually 160x120, in the
+ * EXIF data of their photos.  Decoding it is much cheaper than decoding the
+ * photo itself.  The EXIF data is in the APP1 segment, which can't be larger
+ * than 64 KB and is always near the beginning of the file.
+ */
+#define EXIF_READ_SIZE  ( 64 * 1024 + 32 )
+
+static guint exif_get16( const guchar* p, gboolean big_endian )
+{
+    return big_endian ? ( p[0] << 8 | p[1] ) : ( p[1] << 8 | p[0] );
+}
+
+static guint32 exif_get32( const guchar* p, gboolean big_endian )
+{
+    return big_endian ? ( (guint32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] )
+                      : ( (guint32)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0] );
+}
+
+/* Find the embedded JPEG thumbnail in the TIFF structure of EXIF data.
+ * Returns FALSE if there is none. */
+static gboolean exif_find_thumbnail( const guchar* tiff, guint32 len,
+                                     guint32* offset, guint32* size )
+{
+    gboolean big_endian;
+    guint32 ifd, n, i;
+    const guchar* entry;
+
+    if( len < 8 )
+        return FALSE;
+    if( tiff[0] == 'M' && tiff[1] == 'M' )
+        big_endian = TRUE;
+    else if( tiff[0] == 'I' && tiff[1] == 'I' )
+        big_endian = FALSE;
+    else
+        return FALSE;
+
+    /* skip IFD0, which describes the main image */
+    ifd = exif_get32( tiff + 4, big_endian );
+    if( ifd > len - 2 )
+        return FALSE;
+    n = exif_get16( tiff + ifd, big_endian );
+    if( ifd + 2 + n * 12 + 4 > len )
+        return FALSE;
+    /* IFD1 describes the thumbnail */
+    ifd = exif_get32( tiff + ifd + 2 + n * 12, big_endian );
+    if( 0 == ifd || ifd > len - 2 )
+        return FALSE;
+    n = exif_get16( tiff + ifd, big_endian );
+    if( ifd + 2 + n * 12 > len )
+        return FALSE;
+
+    *offset = *size = 0;
+    for( i = 0; i < n; ++i )
+    {
+        entry = tiff + ifd + 2 + i * 12;
+        switch( exif_get16( entry, big_endian ) )
+        {
+        case 0x0201:    /* JPEGInterchangeFormat */
+            *offset = exif_get32( entry + 8, big_endian );
+            break;
+        case 0x0202:    /* JPEGInterchangeFormatLength */
+            *size = exif_get32( entry + 8, big_endian );
+            break;
+        }
+    }
+    return ( *offset > 0 && *size > 0 && *offset < len && *size <= len - *offset );
+}
+
+/* Load the thumbnail embedded in the EXIF data of a JPEG file.
+ * It's only used if it's large enough for a normal thumbnail, and if it has
+ * the same aspect ratio as the photo (some cameras add black borders to it).
+ * Returns NULL if no suitable thumbnail is found. */
+static GdkPixbuf* load_exif_thumbnail( const char* file_path, int width, int height )
+{
+    FILE* f;
+    guchar* buf;
+    gsize len, pos, seg_len;
+    guint32 offset, size;
+    const guchar* tiff = NULL;
+    guint32 tiff_len = 0;
+    GdkPixbufLoader* loader;
+    GdkPixbuf* pixbuf = NULL;
+    int w, h;
+
+    if( ! ( f = fopen( file_path, "r" ) ) )
+        return NULL;
+    buf = g_malloc( EXIF_READ_SIZE );
+    len = fread( buf, 1, EXIF_READ_SIZE, f );
+    fclose( f );
+
+    /* look for the APP1 segment before the image data starts */
+    if( len > 4 && buf[0] == 0xFF && buf[1] == 0xD8 )
+    {
+        for( pos = 2; pos + 4 <= len && buf[ pos ] == 0xFF; pos += 2 + seg_len )
+        {
+            seg_len = buf[ pos + 2 ] << 8 | buf[ pos + 3 ];
+            if( buf[ pos + 1 ] == 0xDA || seg_len < 2 )  /* start of scan */
+                break;
+            if( buf[ pos + 1 ] == 0xE1 && seg_len > 8 && pos + 10 <= len
+                && 0 == memcmp( buf + pos + 4, "Exif\0\0", 6 ) )
             {
-                GList* next = l->next;
-                g_queue_delete_link( loader->queue, l );
-                l = next;
+                tiff = buf + pos + 10;
+                tiff_len = MIN( seg_len - 8, len - pos - 10 );
+                break;
             }
-            else
-                l = l->next;
         }
+    }
 
-        if( g_queue_get_length( loader->queue ) == 0 )
+    if( tiff && exif_find_thumbnail( tiff, tiff_len, &offset, &size ) )
+    {
+        loader = gdk_pixbuf_loader_new();
+        if( gdk_pixbuf_loader_write( loader, tiff + offset, size, NULL ) )
         {
-            /* g_debug( "FREE LOADER IN vfs_thumbnail_loader_cancel_all_requests!" ); */
-            vfs_async_task_unlock( loader->task );
-            loader->dir->thumbnail_loader = NULL;
-            vfs_thumbnail_loader_free( loader );
-            return;
+            gdk_pixbuf_loader_close( loader, NULL );
+            if( ( pixbuf = gdk_pixbuf_loader_get_pixbuf( loader ) ) )
+                g_object_ref( pixbuf );
+        }
+        else
+            gdk_pixbuf_loader_close( loader, NULL );
+        g_object_unref( loader );
+    }
+    g_free( buf );
+
+    if( pixbuf )
+    {
+        w = gdk_pixbuf_get_width( pixbuf );
+        h = gdk_pixbuf_get_height( pixbuf );
+        /* allow 2% difference of the aspect ratios caused by rounding */
+        if( MAX( w, h ) < 128
+            || ABS( (gint64)w * height - (gint64)h * width ) * 50 > (gint64)w * height )
+        {
+            g_object_unref( pixbuf );
+            pixbuf = NULL;
         }
-        vfs_async_task_unlock( loader->task );
     }
+    return pixbuf;
 }
 
-static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
+static GdkPixbuf* _vfs_thumbnail_load_real( const char* file_path, const char* uri,
                                                                           int size, time_t mtime )
 {
 #if GLIB_CHECK_VERSION(2, 16, 0)
@@ -324,10 +569,10 @@ static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
     char mtime_str[ 32 ];
     const char* thumb_mtime;
     int i, w, h;
-    struct stat statbuf;
-    GdkPixbuf* thumbnail, *result = NULL;
+    GdkPixbuf* thumbnail, *exif_thumbnail, *result = NULL;
+    GdkPixbufFormat* format;
 
-    if ( !gdk_pixbuf_get_file_info( file_path, &w, &h ) )
+    if ( !( format = gdk_pixbuf_get_file_info( file_path, &w, &h ) ) )
         return NULL;   /* image format cannot be recognized */
 
     /* If the image itself is very small, we should load it directly */
@@ -357,12 +602,6 @@ static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
                                        ".thumbnails/normal",
                                        file_name, NULL );
 
-    if( G_UNLIKELY( 0 == mtime ) )
-    {
-        if( stat( file_path, &statbuf ) != -1 )
-            mtime = statbuf.st_mtime;
-    }
-
     /* load existing thumbnail */
     thumbnail = gdk_pixbuf_new_from_file( thumbnail_file, NULL );
     if ( !thumbnail ||
@@ -372,7 +611,18 @@ static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
         if( thumbnail )
             g_object_unref( thumbnail );
         /* create new thumbnail */
-        thumbnail = gdk_pixbuf_new_from_file_at_size( file_path, 128, 128, NULL );
+        thumbnail = NULL;
+        if( is_jpeg( format )
+            && ( exif_thumbnail = load_exif_thumbnail( file_path, w, h ) ) )
+        {
+            thumbnail = scale_thumbnail( exif_thumbnail, 128 );
+            g_object_unref( exif_thumbnail );
+        }
+        /* The JPEG loader of gdk-pixbuf decodes the image at 1/2, 1/4, or 1/8
+         * of its size when a smaller size is requested, so there is no need
+         * to handle JPEG files here. */
+        if( ! thumbnail )
+            thumbnail = gdk_pixbuf_new_from_file_at_size( file_path, 128, 128, NULL );
         if ( thumbnail )
         {
             sprintf( mtime_str, "%lu", mtime );
@@ -384,30 +634,156 @@ static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
 
     if ( thumbnail )
     {
-        w = gdk_pixbuf_get_width( thumbnail );
-        h = gdk_pixbuf_get_height( thumbnail );
+        result = scale_thumbnail( thumbnail, size );
+        gdk_pixbuf_unref( thumbnail );
+    }
+    g_free( thumbnail_file );
+    return result;
+}
 
-        if ( w > h )
-        {
-            h = h * size / w;
-            w = size;
-        }
-        else if ( h > w )
+/*
+ * Thumbnails loaded recently are kept in memory, so they don't need to be
+ * loaded from ~/.thumbnails again when a folder is opened again after its
+ * VFSDir is freed.  The cache is shared by all dirs and threads, and the
+ * least recently used thumbnails are dropped when it grows too large.
+ */
+typedef struct _ThumbnailCacheEntry
+{
+    char* key;      /* "size:path" */
+    time_t mtime;
+    GdkPixbuf* pixbuf;
+    gsize n_bytes;
+    GList* link;    /* link in cache_lru */
+}ThumbnailCacheEntry;
+
+G_LOCK_DEFINE_STATIC( cache );
+static GHashTable* cache_hash = NULL; /* key => ThumbnailCacheEntry */
+static GQueue* cache_lru = NULL;      /* most recently used entry first */
+static gsize cache_size = 0;
+static gsize cache_max_size = 32 * 1024 * 1024;
+static guint cache_hits = 0;
+static guint cache_misses = 0;
+
+/* Called with the lock held */
+static void thumbnail_cache_remove( ThumbnailCacheEntry* ent )
+{
+    g_hash_table_remove( cache_hash, ent->key );
+    g_queue_delete_link( cache_lru, ent->link );
+    cache_size -= ent->n_bytes;
+    g_free( ent->key );
+    g_object_unref( ent->pixbuf );
+    g_slice_free( ThumbnailCacheEntry, ent );
+}
+
+/* Called with the lock held */
+static void thumbnail_cache_trim( gsize max_size )
+{
+    while( cache_size > max_size && cache_lru->tail )
+        thumbnail_cache_remove( (ThumbnailCacheEntry*)cache_lru->tail->data );
+}
+
+static GdkPixbuf* thumbnail_cache_lookup( const char* key, time_t mtime )
+{
+    ThumbnailCacheEntry* ent;
+    GdkPixbuf* pixbuf = NULL;
+
+    G_LOCK( cache );
+    if( G_LIKELY( cache_hash ) && ( ent = g_hash_table_lookup( cache_hash, key ) ) )
+    {
+        if( ent->mtime == mtime )
         {
-            w = w * size / h;
-            h = size;
+            pixbuf = g_object_ref( ent->pixbuf );
+            /* move it to the front of the LRU list */
+            g_queue_unlink( cache_lru, ent->link );
+            g_queue_push_head_link( cache_lru, ent->link );
         }
-        else
+        else    /* the file is changed */
+            thumbnail_cache_remove( ent );
+    }
+    if( pixbuf )
+        ++cache_hits;
+    else
+        ++cache_misses;
+    G_UNLOCK( cache );
+    return pixbuf;
+}
+
+static void thumbnail_cache_insert( const char* key, time_t mtime, GdkPixbuf* pixbuf )
+{
+    ThumbnailCacheEntry* ent;
+    gsize n_bytes;
+
+    n_bytes = gdk_pixbuf_get_rowstride( pixbuf ) * gdk_pixbuf_get_height( pixbuf );
+    G_LOCK( cache );
+    if( n_bytes <= cache_max_size )
+    {
+        if( G_UNLIKELY( ! cache_hash ) )
         {
-            w = h = size;
+            cache_hash = g_hash_table_new( g_str_hash, g_str_equal );
+            cache_lru = g_queue_new();
         }
-        result = gdk_pixbuf_scale_simple(
-                     thumbnail,
-                     w, h, GDK_INTERP_BILINEAR );
-        gdk_pixbuf_unref( thumbnail );
+        /* another thread might have loaded the same thumbnail */
+        if( ( ent = g_hash_table_lookup( cache_hash, key ) ) )
+            thumbnail_cache_remove( ent );
+        thumbnail_cache_trim( cache_max_size - n_bytes );
+
+        ent = g_slice_new( ThumbnailCacheEntry );
+        ent->key = g_strdup( key );
+        ent->mtime = mtime;
+        ent->pixbuf = g_object_ref( pixbuf );
+        ent->n_bytes = n_bytes;
+        g_queue_push_head( cache_lru, ent );
+        ent->link = cache_lru->head;
+        g_hash_table_insert( cache_hash, ent->key, ent );
+        cache_size += n_bytes;
     }
-    g_free( thumbnail_file );
-    return result;
+    G_UNLOCK( cache );
+}
+
+static GdkPixbuf* _vfs_thumbnail_load( const char* file_path, const char* uri,
+                                       int size, time_t mtime )
+{
+    struct stat statbuf;
+    GdkPixbuf* thumbnail;
+    char* key;
+
+    if( G_UNLIKELY( 0 == mtime ) )
+    {
+        if( stat( file_path, &statbuf ) != -1 )
+            mtime = statbuf.st_mtime;
+    }
+
+    key = g_strdup_printf( "%d:%s", size, file_path );
+    thumbnail = thumbnail_cache_lookup( key, mtime );
+    if( ! thumbnail )
+    {
+        thumbnail = _vfs_thumbnail_load_real( file_path, uri, size, mtime );
+        if( thumbnail )
+            thumbnail_cache_insert( key, mtime, thumbnail );
+    }
+    g_free( key );
+    return thumbnail;
+}
+
+void vfs_thumbnail_cache_set_max_size( gsize max_size )
+{
+    G_LOCK( cache );
+    cache_max_size = max_size;
+    if( cache_hash )
+        thumbnail_cache_trim( cache_max_size );
+    G_UNLOCK( cache );
+}
+
+void vfs_thumbnail_cache_get_stats( guint* hits, guint* misses, gsize* size )
+{
+    G_LOCK( cache );
+    if( hits )
+        *hits = cache_hits;
+    if( misses )
+        *misses = cache_misses;
+    if( size )
+        *size = cache_size;
+    G_UNLOCK( cache );
 }
 
 GdkPixbuf* vfs_thumbnail_load_for_uri(  const char* uri, int size, time_t mtime )
@@ -32,12 +32,33 @@ G_BEGIN_DECLS
 
 typedef struct _VFSThumbnailLoader VFSThumbnailLoader;
 
+/* Requests with higher priority are loaded first */
+typedef enum
+{
+    VFS_THUMBNAIL_PRIORITY_LOW,
+    VFS_THUMBNAIL_PRIORITY_NORMAL,
+    VFS_THUMBNAIL_PRIORITY_HIGH,
+    N_VFS_THUMBNAIL_PRIORITIES
+}VFSThumbnailPriority;
+
 VFSThumbnailLoader* vfs_thumbnail_loader_new( VFSDir* dir );
 void vfs_thumbnail_loader_free( VFSThumbnailLoader* loader );
 
 void vfs_thumbnail_loader_request( VFSDir* dir, VFSFileInfo* file, gboolean is_big );
+/* If the file is already requested, its priority is raised to the new one */
+void vfs_thumbnail_loader_request_full( VFSDir* dir, VFSFileInfo* file,
+                                        gboolean is_big, VFSThumbnailPriority priority );
 void vfs_thumbnail_loader_cancel_all_requests( VFSDir* dir, gboolean is_big );
 
+/* Move a queued request of the file to another priority level, without adding
+ * a new request. Nothing is done if the file isn't waiting in the queue. */
+void vfs_thumbnail_loader_set_priority( VFSDir* dir, VFSFileInfo* file,
+                                        VFSThumbnailPriority priority );
+
+/* Set the number of threads shared by all dirs to load thumbnails.
+ * n <= 0 means one thread for each processor, which is the default. */
+void vfs_thumbnail_set_max_threads( int n );
+
 /* Load thumbnail for the specified file
  *  If the caller knows mtime of the file, it should pass mtime to this function to
  *  prevent unnecessary disk I/O and this can speed up the loading.
@@ -49,6 +70,12 @@ GdkPixbuf* vfs_thumbnail_load_for_file( const char* file, int size, time_t mtime
 
 void vfs_thumbnail_init();
 
+/* Thumbnails loaded recently are cached in memory by their path, mtime, and size.
+ * Set the memory used by the cache in bytes. 0 disables the cache. */
+void vfs_thumbnail_cache_set_max_size( gsize max_size );
+/* Get the number of cache hits and misses, and the memory used by the cache */
+void vfs_thumbnail_cache_get_stats( guint* hits, guint* misses, gsize* size );
+
 /*
 void vfs_thumbnail_delete_for _file();
 void vfs_thumbnail_delete_for _uri();
@@ -24,7 +24,99 @@
 
 #include "vfs-utils.h"
 
-GdkPixbuf* vfs_load_icon( GtkIconTheme* theme, const char* icon_name, int size )
+/*
+ * Icons loaded by vfs_load_icon() are cached per icon theme.
+ * (name, size) => GdkPixbuf, or NULL if the icon is not found.
+ * The cache of a theme is dropped when the theme is changed.
+ */
+typedef struct _IconCacheKey
+{
+    char* name;
+    int size;
+}IconCacheKey;
+
+#define ICON_CACHE_MAX_ENTRIES  1024
+
+static GQuark icon_cache_quark = 0;
+static GQuark cached_icon_quark = 0;    /* marks the icons put in a cache */
+static guint icon_cache_hits = 0;
+static guint icon_cache_misses = 0;
+static guint icon_cache_serial = 0;  /* increased when a theme is changed */
+G_LOCK_DEFINE_STATIC( icon_cache );
+
+static guint icon_cache_key_hash( gconstpointer key )
+{
+    const IconCacheKey* k = (const IconCacheKey*)key;
+    return g_str_hash( k->name ) * 31 + k->size;
+}
+
+static gboolean icon_cache_key_equal( gconstpointer a, gconstpointer b )
+{
+    const IconCacheKey* ka = (const IconCacheKey*)a;
+    const IconCacheKey* kb = (const IconCacheKey*)b;
+    return ka->size == kb->size && 0 == strcmp( ka->name, kb->name );
+}
+
+static void icon_cache_key_free( IconCacheKey* key )
+{
+    g_free( key->name );
+    g_slice_free( IconCacheKey, key );
+}
+
+static void icon_cache_value_free( gpointer icon )
+{
+    if( icon )
+        g_object_unref( icon );
+}
+
+/*
+ * This is an emission hook rather than a signal handler, so the cache is
+ * already cleared when the handlers connected to "changed" reload their icons.
+ */
+static gboolean on_icon_theme_changed( GSignalInvocationHint* ihint,
+                                       guint n_param_values,
+                                       const GValue* param_values,
+                                       gpointer data )
+{
+    GObject* theme = g_value_get_object( &param_values[0] );
+    GHashTable* cache;
+
+    G_LOCK( icon_cache );
+    cache = (GHashTable*)g_object_steal_qdata( theme, icon_cache_quark );
+    ++icon_cache_serial;
+    G_UNLOCK( icon_cache );
+
+    if( cache )
+        g_hash_table_destroy( cache );
+    return TRUE;
+}
+
+/* must be called with the lock held */
+static GHashTable* get_icon_cache( GtkIconTheme* theme )
+{
+    GHashTable* cache;
+
+    if( G_UNLIKELY( 0 == icon_cache_quark ) )
+    {
+        icon_cache_quark = g_quark_from_static_string( "vfs-icon-cache" );
+        cached_icon_quark = g_quark_from_static_string( "vfs-cached-icon" );
+        g_signal_add_emission_hook( g_signal_lookup( "changed", GTK_TYPE_ICON_THEME ), 0,
+                                    on_icon_theme_changed, NULL, NULL );
+    }
+
+    cache = (GHashTable*)g_object_get_qdata( G_OBJECT(theme), icon_cache_quark );
+    if( G_UNLIKELY( ! cache ) )
+    {
+        cache = g_hash_table_new_full( icon_cache_key_hash, icon_cache_key_equal,
+                                       (GDestroyNotify)icon_cache_key_free,
+                                       icon_cache_value_free );
+        g_object_set_qdata_full( G_OBJECT(theme), icon_cache_quark,
+                                 cache, (GDestroyNotify)g_hash_table_destroy );
+    }
+    return cache;
+}
+
+static GdkPixbuf* load_theme_icon( GtkIconTheme* theme, const char* icon_name, int size )
 {
     GdkPixbuf* icon = NULL;
     const char* file;
@@ -72,6 +164,79 @@ GdkPixbuf* vfs_load_icon( GtkIconTheme* theme, const char* icon_name, int size )
     return icon;
 }
 
+GdkPixbuf* vfs_load_icon( GtkIconTheme* theme, const char* icon_name, int size )
+{
+    GHashTable* cache;
+    IconCacheKey key, *new_key;
+    gpointer orig_key, icon;
+    guint serial;
+
+    if( G_UNLIKELY( ! icon_name ) )
+        return NULL;
+
+    key.name = (char*)icon_name;
+    key.size = size;
+
+    G_LOCK( icon_cache );
+    cache = get_icon_cache( theme );
+    if( g_hash_table_lookup_extended( cache, &key, &orig_key, &icon ) )
+    {
+        ++icon_cache_hits;
+        if( icon )
+            g_object_ref( icon );
+        G_UNLOCK( icon_cache );
+        return (GdkPixbuf*)icon;
+    }
+    ++icon_cache_misses;
+    serial = icon_cache_serial;
+    G_UNLOCK( icon_cache );
+
+    icon = load_theme_icon( theme, icon_name, size );
+
+    G_LOCK( icon_cache );
+    /* the icon might be loaded from the old theme if it's changed in the meantime */
+    if( G_UNLIKELY( serial != icon_cache_serial ) )
+    {
+        G_UNLOCK( icon_cache );
+        return (GdkPixbuf*)icon;
+    }
+    new_key = g_slice_new( IconCacheKey );
+    new_key->name = g_strdup( icon_name );
+    new_key->size = size;
+
+    cache = get_icon_cache( theme );
+    if( G_UNLIKELY( g_hash_table_size( cache ) >= ICON_CACHE_MAX_ENTRIES ) )
+    {
+        g_object_set_qdata( G_OBJECT(theme), icon_cache_quark, NULL );
+        cache = get_icon_cache( theme );
+    }
+    if( icon )
+    {
+        g_object_set_qdata( G_OBJECT(icon), cached_icon_quark, GINT_TO_POINTER( 1 ) );
+        g_object_ref( icon );
+    }
+    g_hash_table_replace( cache, new_key, icon );
+    G_UNLOCK( icon_cache );
+
+    return (GdkPixbuf*)icon;
+}
+
+gboolean vfs_is_cached_icon( GdkPixbuf* icon )
+{
+    return cached_icon_quark
+           && g_object_get_qdata( G_OBJECT(icon), cached_icon_quark ) != NULL;
+}
+
+void vfs_get_icon_cache_stats( guint* hits, guint* misses )
+{
+    G_LOCK( icon_cache );
+    if( hits )
+        *hits = icon_cache_hits;
+    if( misses )
+        *misses = icon_cache_misses;
+    G_UNLOCK( icon_cache );
+}
+
 static char* find_su_program( GError** err )
 {
     char* su;
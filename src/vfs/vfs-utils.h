@@ -24,8 +24,18 @@
 
 #include <gtk/gtk.h>
 
+/* The loaded icons are cached until the icon theme is changed. */
 GdkPixbuf* vfs_load_icon( GtkIconTheme* theme, const char* icon_name, int size );
 
+/* Number of vfs_load_icon() calls answered from the cache, and the others */
+void vfs_get_icon_cache_stats( guint* hits, guint* misses );
+
+/*
+ * Whether the icon is returned by vfs_load_icon() from its cache, so it's
+ * shared by all the files using it, unlike thumbnails.
+ */
+gboolean vfs_is_cached_icon( GdkPixbuf* icon );
+
 /* execute programs with sudo */
 gboolean vfs_sudo_cmd_sync( const char* cwd, char*cmd,
                                                int* exit_status,